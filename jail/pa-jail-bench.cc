@@ -0,0 +1,417 @@
+// pa-jail-bench.cc -- microbenchmarks for pa-jail's data paths
+// Peteramati is Copyright (c) 2013-2024 Eddie Kohler and others
+// See LICENSE for open-source distribution terms
+//
+// `make bench` builds and runs this. It includes pa-jail.cc whole, so it
+// times exactly the code pa-jail runs, but only on synthetic inputs, so
+// it needs no root and no jail. Each benchmark repeats until it has run
+// for SECONDS and reports throughput, time per operation, and operator
+// new allocations per operation.
+//
+//   pa-jail-bench [-t SECONDS] [PATTERN...]
+//
+// runs the benchmarks whose names contain any PATTERN.
+
+#include <new>
+#define main pa_jail_main
+#include "pa-jail.cc"
+#undef main
+#include <random>
+
+static double bench_seconds = 0.5;
+static std::vector<std::string> bench_patterns;
+static unsigned long long bench_allocs = 0;
+
+// Count allocations. None of these is inlined, so the compiler doesn't
+// see `operator new` pointers passed to `free`.
+__attribute__((noinline)) void* operator new(size_t n) {
+    ++bench_allocs;
+    if (void* p = malloc(n ? n : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+__attribute__((noinline)) void* operator new[](size_t n) {
+    return operator new(n);
+}
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    free(p);
+}
+__attribute__((noinline)) void operator delete[](void* p) noexcept {
+    free(p);
+}
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+__attribute__((noinline)) void operator delete[](void* p, size_t) noexcept {
+    free(p);
+}
+
+
+// benchmark runner
+
+static bool bench_wanted(const std::string& name) {
+    if (bench_patterns.empty()) {
+        return true;
+    }
+    for (auto& p : bench_patterns) {
+        if (name.find(p) != std::string::npos) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Run `f` until `bench_seconds` pass. Each call handles `bytes` bytes of
+// input (0 if throughput doesn't apply) in `ops` operations.
+template <typename F>
+static void bench(const std::string& name, size_t bytes, size_t ops, F f) {
+    if (!bench_wanted(name)) {
+        return;
+    }
+    f();
+    unsigned long long allocs = bench_allocs;
+    long long start = monotonic_usec(), now;
+    size_t iters = 0;
+    do {
+        f();
+        ++iters;
+        now = monotonic_usec();
+    } while (now - start < bench_seconds * 1e6);
+    double usec = now - start;
+    if (bytes) {
+        printf("%-28s %10.1f", name.c_str(), bytes * iters / usec);
+    } else {
+        printf("%-28s %10s", name.c_str(), "-");
+    }
+    printf(" %12.1f %11.2f\n", usec * 1000 / (iters * ops),
+           double(bench_allocs - allocs) / (iters * ops));
+    fflush(stdout);
+}
+
+
+// synthetic inputs
+
+static const size_t bench_input_size = 1 << 20;
+
+static unsigned rand32(std::mt19937& rng) {
+    return rng();
+}
+
+// Test logs: mostly printable ASCII lines.
+static std::string make_ascii_log(std::mt19937& rng) {
+    static const char* const levels[] = {"info", "debug", "warn", "error"};
+    std::string s;
+    char buf[256];
+    for (unsigned i = 0; s.size() < bench_input_size; ++i) {
+        snprintf(buf, sizeof(buf), "2024-03-%02u 12:%02u:%02u [%s] test_%u: %s in %u.%03ums (\"expected\" %u)\n",
+                 1 + i % 28, i % 60, rand32(rng) % 60, levels[rand32(rng) % 4], i,
+                 rand32(rng) % 8 ? "passed" : "FAILED", rand32(rng) % 100, rand32(rng) % 1000,
+                 rand32(rng) % 65536);
+        s += buf;
+    }
+    s.resize(bench_input_size);
+    return s;
+}
+
+// A program writing raw memory: arbitrary bytes, mostly invalid UTF-8.
+static std::string make_binary(std::mt19937& rng) {
+    std::string s(bench_input_size, '\0');
+    for (auto& ch : s) {
+        ch = rand32(rng);
+    }
+    return s;
+}
+
+// Text in other scripts: two-, three-, and four-byte UTF-8 characters
+// separated by ASCII spaces and newlines.
+static std::string make_utf8(std::mt19937& rng) {
+    static const char32_t ranges[][2] = {
+        {0x3B1, 0x3C9}, {0x430, 0x44F}, {0x4E00, 0x9FFF}, {0x3041, 0x3096},
+        {0xAC00, 0xD7A3}, {0x1F600, 0x1F64F}, {0x2500, 0x257F}
+    };
+    std::string s;
+    while (s.size() < bench_input_size) {
+        auto& r = ranges[rand32(rng) % 7];
+        for (unsigned n = 1 + rand32(rng) % 8; n != 0; --n) {
+            append_utf8(s, r[0] + rand32(rng) % (r[1] - r[0] + 1));
+        }
+        s += rand32(rng) % 10 ? ' ' : '\n';
+    }
+    s.resize(bench_input_size - 8);   // may cut a character; the tail is flushed
+    return s;
+}
+
+// A curses program redrawing its screen: cursor motion, colors, and
+// line-drawing characters with a few letters between them.
+static std::string make_ansi(std::mt19937& rng) {
+    std::string s;
+    char buf[64];
+    while (s.size() < bench_input_size) {
+        snprintf(buf, sizeof(buf), "\x1b[%u;%uH\x1b[%u;3%um", 1 + rand32(rng) % 25,
+                 1 + rand32(rng) % 80, rand32(rng) % 2, rand32(rng) % 8);
+        s += buf;
+        for (unsigned n = rand32(rng) % 12; n != 0; --n) {
+            switch (rand32(rng) % 4) {
+            case 0:
+                append_utf8(s, 0x2500 + rand32(rng) % 0x80);
+                break;
+            case 1:
+                s += "\x1b[0m";
+                break;
+            default:
+                s += char('a' + rand32(rng) % 26);
+                break;
+            }
+        }
+        if (rand32(rng) % 16 == 0) {
+            s += "\x1b[K\r\n";
+        }
+    }
+    s.resize(bench_input_size);
+    return s;
+}
+
+struct benchinput {
+    const char* name;
+    std::string data;
+};
+
+static std::vector<benchinput> make_inputs() {
+    std::mt19937 rng(20240301);
+    std::vector<benchinput> inputs;
+    inputs.push_back({"ascii-log", make_ascii_log(rng)});
+    inputs.push_back({"binary", make_binary(rng)});
+    inputs.push_back({"utf8", make_utf8(rng)});
+    inputs.push_back({"ansi", make_ansi(rng)});
+    return inputs;
+}
+
+// A pa-jail.conf just under the size limit: many allowed and disabled
+// jail trees, skeletons, and tree directories.
+static std::string make_conf() {
+    std::string s = "# pa-jail.conf\nenablejail /jails/run*\ntreedir /jails\n";
+    char buf[128];
+    for (unsigned i = 0; ; ++i) {
+        int n;
+        if (i % 4 == 3) {
+            n = snprintf(buf, sizeof(buf), "enableskeleton /var/skel/course%u\n", i);
+        } else if (i % 4 == 2) {
+            n = snprintf(buf, sizeof(buf), "disablejail /jails/run%u/*\n", i);
+        } else {
+            n = snprintf(buf, sizeof(buf), "enablejail /home/course%u/jails/~*\n", i);
+        }
+        if (s.size() + n + 32 >= 8192) {
+            break;
+        }
+        s.append(buf, n);
+    }
+    s += "disablejail /jails/run/*/*\n";
+    return s;
+}
+
+// A manifest like those peteramati generates: directory lines, many
+// files, renamed files, and flagged bind and mount entries.
+static std::string make_manifest(std::mt19937& rng, size_t* nentries) {
+    static const char* const dirs[] = {
+        "/bin", "/usr/bin", "/usr/lib/x86_64-linux-gnu", "./lib", "usr/share/zoneinfo/America"
+    };
+    std::string s;
+    char buf[256];
+    *nentries = 0;
+    while (s.size() < bench_input_size) {
+        s += dirs[rand32(rng) % 5];
+        s += ":\n";
+        for (unsigned n = 10 + rand32(rng) % 100; n != 0; --n) {
+            unsigned k = rand32(rng) % 32;
+            if (k == 0) {
+                snprintf(buf, sizeof(buf), "lib%u.so.%u <- /opt/lib/lib%u.so [cp]\n", rand32(rng) % 1000, rand32(rng) % 9, rand32(rng) % 1000);
+            } else if (k == 1) {
+                snprintf(buf, sizeof(buf), "/usr/share/data%u [bind-ro tag%u files%u]\n", rand32(rng) % 100, rand32(rng) % 9, rand32(rng) % 9);
+            } else if (k == 2) {
+                snprintf(buf, sizeof(buf), "/tmp%u [mount tmpfs size=%um,mode=1777; cp]\n", rand32(rng) % 10, 1 + rand32(rng) % 64);
+            } else if (k == 3) {
+                snprintf(buf, sizeof(buf), "# comment %u\n\n", rand32(rng));
+                --*nentries;
+            } else {
+                snprintf(buf, sizeof(buf), "file-%08x.%s\n", rand32(rng), k % 2 ? "so" : "py");
+            }
+            s += buf;
+            ++*nentries;
+        }
+    }
+    return s;
+}
+
+
+// benchmarks
+
+static void bench_json(const std::vector<benchinput>& inputs) {
+    for (int scalar = 0; scalar != 2; ++scalar) {
+        for (auto& in : inputs) {
+            std::string name = std::string(scalar ? "json-scalar/" : "json/") + in.name;
+            json_scan_function old_scan = json_scan;
+            if (scalar) {
+                json_scan = json_scan_scalar;
+            }
+            jbuffer jb(8192);
+            auto first = reinterpret_cast<const unsigned char*>(in.data.data());
+            auto last = first + in.data.size();
+            bench(name, in.data.size(), in.data.size() / 4096, [&] {
+                for (auto p = first; p != last; ) {
+                    auto q = std::min(p + 4096, last);
+                    auto r = jb.append_json_chars(p, q);
+                    jb.consume_to(jb.bufpos_ + jb.tail_);
+                    p = r == q || q == last ? q : r;
+                }
+            });
+            json_scan = old_scan;
+        }
+    }
+}
+
+static void bench_events(const std::vector<benchinput>& inputs) {
+    int nullfd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (nullfd == -1) {
+        perror_die("/dev/null");
+    }
+    for (int gzip = 0; gzip != 2; ++gzip) {
+        for (auto& in : inputs) {
+            if (gzip && strcmp(in.name, "ascii-log") != 0) {
+                continue;
+            }
+            std::string name = std::string(gzip ? "events-gzip/" : "events/") + in.name;
+            esfd esf(nullfd);
+            if (gzip && !esf.start_deflate(31)) {
+                die("deflateInit2 failed\n");
+            }
+            auto first = reinterpret_cast<const unsigned char*>(in.data.data());
+            auto last = first + in.data.size();
+            size_t off = 0;
+            bench(name, in.data.size(), in.data.size() / 4096, [&] {
+                for (auto p = first; p != last; ) {
+                    auto q = std::min(p + 4096, last);
+                    essegment seg;
+                    size_t noff = encode_event(off, p, q, seg, q == last);
+                    esf.push(std::move(seg), noff);
+                    while (esf.write()) {
+                    }
+                    p += noff - off;
+                    off = noff;
+                }
+            });
+        }
+    }
+    close(nullfd);
+}
+
+static void bench_jbuffer() {
+    int zerofd = open("/dev/zero", O_RDONLY | O_CLOEXEC);
+    int nullfd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (zerofd == -1 || nullfd == -1) {
+        perror_die(zerofd == -1 ? "/dev/zero" : "/dev/null");
+    }
+    for (int ring = 0; ring != 2; ++ring) {
+        jbuffer jb(8192);
+        if (ring && !jb.map_ring(65536)) {
+            continue;
+        }
+        size_t off = jb.bufpos_;
+        bench(ring ? "jbuffer-ring/read-write" : "jbuffer/read-write",
+              bench_input_size, bench_input_size / 4096, [&] {
+            for (size_t n = 0; n < bench_input_size; ) {
+                size_t tail = jb.tail_;
+                jb.read(zerofd, 4096);
+                n += jb.tail_ - tail;
+                jb.write(nullfd, off);
+                jb.consume_to(off);
+            }
+        });
+    }
+
+    // A consumer that lags by up to half the buffer, so consume_to moves
+    // data back to the front.
+    jbuffer jb(65536);
+    std::string chunk(4096, 'x');
+    bench("jbuffer/append-consume", bench_input_size, bench_input_size / 4096, [&] {
+        for (size_t n = 0; n < bench_input_size; n += chunk.size()) {
+            jb.append(chunk.data(), chunk.size());
+            size_t end = jb.bufpos_ + jb.tail_;
+            if (jb.tail_ - jb.head_ > 32768) {
+                jb.consume_to(end - 16384);
+            }
+        }
+    });
+    close(zerofd);
+    close(nullfd);
+}
+
+static void bench_conf() {
+    pajailconf jc(make_conf());
+    static const char* const dirs[] = {
+        "/jails/run12/", "/jails/run2/x/", "/home/course41/jails/~alice/",
+        "/home/nobody/jails/", "/jails/run/a/b/"
+    };
+    bench("conf/allow_jail", 0, 15, [&] {
+        for (auto dir : dirs) {
+            jc.allow_jail(dir);
+            jc.allow_jail_subdir(dir);
+            jc.allow_skeleton(dir);
+        }
+    });
+}
+
+static void bench_manifest() {
+    std::mt19937 rng(20240302);
+    size_t nentries;
+    std::string manifest = make_manifest(rng, &nentries);
+    bench("manifest/parse", manifest.size(), nentries, [&] {
+        manifestparser mp(manifest);
+        manifestentry me;
+        size_t n = 0;
+        while (mp.next(me)) {
+            ++n;
+        }
+        assert(n == nentries);
+    });
+}
+
+static void bench_mountslot() {
+    static const char* const optstrs[] = {
+        "rw,nosuid,nodev,noexec,relatime",
+        "rw,nosuid,nodev,relatime,size=65536k,mode=755,uid=1000,gid=1000,inode64",
+        "ro,relatime,errors=remount-ro,data=ordered",
+        "bind,rec,unbindable,ro",
+        "rw,relatime,fd=29,pgrp=1,timeout=0,minproto=5,maxproto=5,direct,pipe_ino=1234"
+    };
+    bench("mountslot/parse", 0, 15, [&] {
+        for (auto optstr : optstrs) {
+            mountslot ms("tmpfs", "tmpfs", optstr);
+            ms.add_mountopt("size=1m");
+            ms.add_mountopt("nosuid");
+        }
+    });
+}
+
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            bench_seconds = strtod(argv[++i], nullptr);
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "Usage: pa-jail-bench [-t SECONDS] [PATTERN...]\n");
+            exit(1);
+        } else {
+            bench_patterns.push_back(argv[i]);
+        }
+    }
+
+    printf("%-28s %10s %12s %11s\n", "benchmark", "MB/s", "ns/op", "allocs/op");
+    auto inputs = make_inputs();
+    bench_json(inputs);
+    bench_events(inputs);
+    bench_jbuffer();
+    bench_conf();
+    bench_manifest();
+    bench_mountslot();
+}
@@ -9,6 +9,7 @@
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <sys/un.h>
 #include <unistd.h>
 #include <cassert>
@@ -28,15 +29,26 @@
 #include <utime.h>
 #include <getopt.h>
 #include <fnmatch.h>
+#include <regex.h>
 #include <string>
+#include <algorithm>
+#include <atomic>
 #include <list>
+#include <deque>
+#include <memory>
 #include <unordered_map>
 #include <vector>
+#include <thread>
 #include <iostream>
 #include <sys/ioctl.h>
 #include <sys/file.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#define ZLIB_CONST 1
+#include <zlib.h>
 #if __linux__
 #include <mntent.h>
+#include <linux/perf_event.h>
 #include <sched.h>
 #include <sys/signalfd.h>
 #include <sys/sysmacros.h>
@@ -46,6 +58,10 @@
 #include <sys/ucred.h>
 #include <sys/mount.h>
 #endif
+#if __x86_64__ || (__i386__ && __SSE2__)
+#include <immintrin.h>
+#define PA_JAIL_X86_SIMD 1
+#endif
 
 #define ROOT 0
 
@@ -77,7 +93,29 @@ static bool dryrun = false;
 static bool quiet = false;
 static bool doforce = false;
 static bool no_onlcr = false;
+static bool no_pty = false;
+static bool separate_stderr = false;
+static size_t max_output = 0;
+static bool max_output_truncate = false;
+static size_t max_output_tail = 65536;
+static double output_rate = 0;
+static bool reader_thread = true;
+static size_t output_buffer_size = 0;
+static size_t event_history_size = 1 << 20;
+static size_t event_client_buffer = 4 << 20;
+static unsigned long long event_dropped_bytes = 0;
+static unsigned long long event_resyncs = 0;
+static int event_compression = Z_BEST_SPEED;
+static bool event_input = false;
+static bool event_snapshot = false;
+static unsigned long long event_deflate_in = 0;
+static unsigned long long event_deflate_out = 0;
+static unsigned long long event_bytes_written = 0;
+static std::string hubfilename;
+static std::string hubrunid;
+static int hubfd = -1;
 static long tsize[2] = {80, 25};
+static const long max_tsize[2] = {1000, 500};
 static FILE* verbosefile = stdout;
 static std::string linkdir;
 static std::string dstroot;
@@ -86,6 +124,25 @@ static std::string pidfilename;
 static std::string pidcontents;
 static int timingfd = -1;
 static std::string timingfilename;
+static bool timing_binary = false;
+static int transcriptfd = -1;
+static int transcriptindexfd = -1;
+static std::string transcriptfilename;
+static int lineindexfd = -1;
+static std::string lineindexfilename;
+struct extractspec {
+    std::string prefix;
+    std::string filename;
+    int fd = -1;
+};
+static std::vector<extractspec> extracts;
+static std::vector<std::string> stop_patterns;
+static std::string inputscriptfilename;
+static double telemetry_interval = 0;
+static int telemetryfd = -1;
+static std::string countersfilename;
+static std::string profilefilename;
+static std::string statustablefilename;
 static std::string ready_marker;
 static int eventsourcefd = -1;
 static std::string eventsourcefilename;
@@ -97,7 +154,8 @@ static int sigpipe[2];
 #endif
 
 enum jailaction {
-    do_start, do_add, do_run, do_rm, do_mv
+    do_start, do_add, do_run, do_rm, do_mv, do_hub, do_timing, do_transcript,
+    do_lines, do_attach, do_ps
 };
 
 
@@ -126,6 +184,131 @@ static int perror_fail(const char* format, const char* arg1) {
 }
 
 
+// setup profiles
+
+// `--profile FILE` writes Chrome trace events, one per setup phase, with
+// counts of the filesystem and mount operations each phase issued. The
+// main process, the supervisor, and the command's child all append to
+// FILE, so it uses the trace-event array format, whose closing `]` is
+// optional.
+enum profilecount {
+    pc_stat, pc_skip, pc_mkdir, pc_copy, pc_link, pc_symlink, pc_mknod,
+    pc_unlink, pc_chmod, pc_chown, pc_mount, pc_umount, npc
+};
+static const char* const profilecount_names[npc] = {
+    "stat", "skip", "mkdir", "copy", "link", "symlink", "mknod",
+    "unlink", "chmod", "chown", "mount", "umount"
+};
+static int profilefd = -1;
+static int profile_pid = 0;
+static int profile_tid = 0;     // 0 main, 1 supervisor, 2 command
+static unsigned long long profile_counts[npc];
+
+static inline void profile_count(profilecount c) {
+    ++profile_counts[c];
+}
+
+static long long monotonic_usec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void profile_append_string(std::string& s, const std::string& str) {
+    s.push_back('"');
+    for (unsigned char ch : str) {
+        if (ch == '"' || ch == '\\') {
+            s.push_back('\\');
+            s.push_back(ch);
+        } else if (ch < 0x20) {
+            char buf[8];
+            s.append(buf, sprintf(buf, "\\u%04x", ch));
+        } else {
+            s.push_back(ch);
+        }
+    }
+    s.push_back('"');
+}
+
+// Append one trace event. Each event is a single write to an O_APPEND
+// file, so events from different processes don't interleave.
+static void profile_event(const char* ph, const char* name,
+                          long long ts, long long dur, const std::string& args) {
+    std::string s = "{\"name\":";
+    profile_append_string(s, name);
+    char buf[160];
+    s.append(buf, sprintf(buf, ",\"cat\":\"setup\",\"ph\":\"%s\",\"ts\":%lld,", ph, ts));
+    if (ph[0] == 'X') {
+        s.append(buf, sprintf(buf, "\"dur\":%lld,", dur));
+    }
+    s.append(buf, sprintf(buf, "\"pid\":%d,\"tid\":%d", profile_pid, profile_tid));
+    if (!args.empty()) {
+        s += ",\"args\":{" + args + "}";
+    }
+    s += "},\n";
+    ssize_t w = write(profilefd, s.data(), s.size());
+    (void) w;
+}
+
+static void profile_open(int fd) {
+    profilefd = fd;
+    profile_pid = getpid();
+    std::string s = "[\n";
+    ssize_t w = write(profilefd, s.data(), s.size());
+    (void) w;
+    const char* names[] = {"pa-jail", "supervisor", "command"};
+    for (int tid = 0; tid != 3; ++tid) {
+        profile_tid = tid;
+        std::string args = "\"name\":";
+        profile_append_string(args, names[tid]);
+        profile_event("M", "thread_name", 0, 0, args);
+    }
+    profile_tid = 0;
+}
+
+// A setup phase, recorded when it ends. Phases nest.
+class profilephase {
+  public:
+    explicit profilephase(const char* name, const std::string& path = std::string())
+        : name_(name), path_(path), start_(profilefd >= 0 ? monotonic_usec() : 0) {
+        memcpy(counts_, profile_counts, sizeof(counts_));
+    }
+    ~profilephase() {
+        end();
+    }
+    void end();
+
+  private:
+    const char* name_;
+    std::string path_;
+    long long start_;
+    unsigned long long counts_[npc];
+    bool ended_ = false;
+};
+
+void profilephase::end() {
+    if (ended_ || profilefd < 0) {
+        return;
+    }
+    ended_ = true;
+    long long now = monotonic_usec();
+    std::string args;
+    if (!path_.empty()) {
+        args = "\"path\":";
+        profile_append_string(args, path_);
+    }
+    for (int i = 0; i != npc; ++i) {
+        if (profile_counts[i] != counts_[i]) {
+            char buf[64];
+            sprintf(buf, "%s\"%s\":%llu", args.empty() ? "" : ",",
+                    profilecount_names[i], profile_counts[i] - counts_[i]);
+            args += buf;
+        }
+    }
+    profile_event("X", name_, start_, now - start_, args);
+}
+
+
 // pathname helpers
 
 static std::string path_endslash(const std::string& path) {
@@ -214,6 +397,7 @@ static const char* gid_to_name(gid_t g) {
 
 
 static int v_fchmod(int fd, mode_t mode, const std::string& pathname) {
+    profile_count(pc_chmod);
     if (verbose) {
         fprintf(verbosefile, "chmod 0%o %s\n", mode, pathname.c_str());
     }
@@ -221,6 +405,7 @@ static int v_fchmod(int fd, mode_t mode, const std::string& pathname) {
 }
 
 static int x_lchown(const char* path, uid_t owner, gid_t group) {
+    profile_count(pc_chown);
     if (verbose) {
         fprintf(verbosefile, "chown -h %s:%s %s\n", uid_to_name(owner), gid_to_name(group), path);
     }
@@ -231,6 +416,7 @@ static int x_lchown(const char* path, uid_t owner, gid_t group) {
 }
 
 static int x_lchownat(int fd, const char* component, uid_t owner, gid_t group, const std::string& dirpath) {
+    profile_count(pc_chown);
     if (verbose) {
         fprintf(verbosefile, "chown -h %s:%s %s%s\n", uid_to_name(owner), gid_to_name(group), dirpath.c_str(), component);
     }
@@ -241,6 +427,7 @@ static int x_lchownat(int fd, const char* component, uid_t owner, gid_t group, c
 }
 
 static int x_fchown(int fd, uid_t owner, gid_t group, const std::string& path) {
+    profile_count(pc_chown);
     if (verbose) {
         fprintf(verbosefile, "chown -h %s:%s %s\n", uid_to_name(owner), gid_to_name(group), path.c_str());
     }
@@ -251,6 +438,7 @@ static int x_fchown(int fd, uid_t owner, gid_t group, const std::string& path) {
 }
 
 static int v_mkdir(const char* pathname, mode_t mode) {
+    profile_count(pc_mkdir);
     if (verbose) {
         fprintf(verbosefile, "mkdir -m 0%o %s\n", mode, pathname);
     }
@@ -258,6 +446,7 @@ static int v_mkdir(const char* pathname, mode_t mode) {
 }
 
 static int v_mkdirat(int dirfd, const char* component, mode_t mode, const std::string& pathname) {
+    profile_count(pc_mkdir);
     if (verbose) {
         fprintf(verbosefile, "mkdir -m 0%o %s\n", mode, pathname.c_str());
     }
@@ -271,6 +460,7 @@ static int v_ensuredir(std::string pathname, mode_t mode, bool nolink) {
         return it->second;
     }
     struct stat st;
+    profile_count(pc_stat);
     int r = (nolink ? lstat : stat)(pathname.c_str(), &st);
     if (r == 0 && !S_ISDIR(st.st_mode)) {
         errno = ENOTDIR;
@@ -289,6 +479,8 @@ static int v_ensuredir(std::string pathname, mode_t mode, bool nolink) {
 }
 
 static int x_link(const char* oldpath, const char* newpath) {
+    profile_count(pc_unlink);
+    profile_count(pc_link);
     if (verbose)
         fprintf(verbosefile, "rm -f %s\nln %s %s\n", newpath, oldpath, newpath);
     if (!dryrun) {
@@ -301,6 +493,7 @@ static int x_link(const char* oldpath, const char* newpath) {
 }
 
 static int x_chmod(const char* path, mode_t mode) {
+    profile_count(pc_chmod);
     if (verbose)
         fprintf(verbosefile, "chmod 0%o %s\n", mode, path);
     if (!dryrun && chmod(path, mode) != 0)
@@ -330,6 +523,7 @@ static const char* dev_name(mode_t m, dev_t d) {
 }
 
 static int x_mknod(const char* path, mode_t mode, dev_t dev) {
+    profile_count(pc_mknod);
     if (verbose)
         fprintf(verbosefile, "mknod -m 0%o %s %s\n", mode, path, dev_name(mode, dev));
     if (!dryrun && mknod(path, mode, dev) != 0
@@ -348,6 +542,7 @@ static bool x_symlink_eexist_ok(const char* oldpath, const char* newpath) {
 }
 
 static int x_symlink(const char* oldpath, const char* newpath) {
+    profile_count(pc_symlink);
     if (verbose)
         fprintf(verbosefile, "ln -s %s %s\n", oldpath, newpath);
     if (!dryrun
@@ -575,6 +770,7 @@ bool mountslot::mountable(std::string src, std::string dst) const {
 }
 
 int mountslot::x_mount(std::string dst, unsigned long opts) {
+    profile_count(pc_mount);
     if (verbose) {
         fprintf(verbosefile, "%s\n", debug_mount_command(dst, opts).c_str());
     }
@@ -594,6 +790,7 @@ static int populate_mount_table() {
         return 0;
     }
     mount_table_populated = true;
+    profilephase phase("populate_mount_table");
 #if __linux__
     FILE* f = setmntent("/proc/mounts", "r");
     if (!f) {
@@ -653,6 +850,7 @@ static int handle_mount(std::string src, std::string dst, bool in_child) {
     }
     dst_table[dst] = 2;
 
+    profilephase phase("mount", dst);
     if (in_child) {
         v_ensuredir(dst, 0555, true);
     }
@@ -685,6 +883,7 @@ static int handle_mount(std::string src, std::string dst, bool in_child) {
 }
 
 static int handle_umount(const mount_table_type::iterator& it) {
+    profile_count(pc_umount);
     if (verbose) {
         fprintf(verbosefile, "umount -i -n %s\n", it->first.c_str());
     }
@@ -770,6 +969,7 @@ static void handle_symlink_dst(std::string dst, std::string src,
 }
 
 static int x_rm_f(const std::string &dst) {
+    profile_count(pc_unlink);
     if (verbose) {
         fprintf(verbosefile, "rm -f %s\n", dst.c_str());
     }
@@ -787,6 +987,7 @@ static int x_cp_p(const std::string& src, const std::string& dst) {
     if (x_rm_f(dst)) {
         return 1;
     }
+    profile_count(pc_copy);
     if (verbose) {
         fprintf(verbosefile, "cp -p %s %s\n", src.c_str(), dst.c_str());
     }
@@ -826,6 +1027,7 @@ static inline int stat_mtimes_same(const struct stat& st1, const struct stat& st
 static int do_copy(const std::string& dst, const std::string& src,
                    const struct stat& ss, bool reuse_link, dev_t jaildev) {
     struct stat ds;
+    profile_count(pc_stat);
     int r = lstat(dst.c_str(), &ds);
     if (r == 0
         && ss.st_mode == ds.st_mode
@@ -841,6 +1043,7 @@ static int do_copy(const std::string& dst, const std::string& src,
             auto di = std::make_pair(ss.st_dev, ss.st_ino);
             devino_table.insert(std::make_pair(di, dst));
         }
+        profile_count(pc_skip);
         return 0;
     }
 
@@ -936,6 +1139,7 @@ static int handle_copy(std::string src, std::string subdst,
         }
     }
 
+    profile_count(pc_stat);
     if (lstat(src.c_str(), &ss) != 0) {
         return perror_fail("lstat %s: %s\n", src.c_str());
     }
@@ -1034,23 +1238,34 @@ static void fix_jail_bind_src(dev_t jaildev,
     }
 }
 
-static int construct_jail(dev_t jaildev, std::string& str, bool nomount) {
-    // prepare root
-    if (x_chmod(dstroot.c_str(), 0755)
-        || x_lchown(dstroot.c_str(), 0, 0)) {
-        return 1;
-    }
-    dst_table[dstroot + "/"] = 1;
-
-    // Mounts
-    populate_mount_table();
+// A manifest line: copy `src` to `dst` in the jail, or bind or mount it
+// there, as `flags` say.
+struct manifestentry {
+    std::string src;
+    std::string dst;
+    int flags;
+};
 
-    // Read a line at a time
-    std::string cursrcdir("/"), curdstsubdir("/");
-    std::string bind_tag, bind_files, mount_dst, mount_args;
-    int base_flags = 0;
+// Split a manifest into entries. Directory lines (`DIR:`) and the options
+// of `[bind]` and `[mount]` flags carry over to later lines.
+struct manifestparser {
+    const char* pos_;
+    const char* endpos_;
+    std::string cursrcdir_ = "/";
+    std::string curdstsubdir_ = "/";
+    std::string bind_tag_;
+    std::string bind_files_;
+    std::string mount_dst_;
+    std::string mount_args_;
+
+    manifestparser(const std::string& str)
+        : pos_(str.data()), endpos_(str.data() + str.length()) {
+    }
+    bool next(manifestentry& me);
+};
 
-    const char* pos = str.data(), *endpos = pos + str.length();
+bool manifestparser::next(manifestentry& me) {
+    const char* pos = pos_, *endpos = endpos_;
     while (pos < endpos) {
         while (pos < endpos && isspace((unsigned char) *pos)) {
             ++pos;
@@ -1070,30 +1285,30 @@ static int construct_jail(dev_t jaildev, std::string& str, bool nomount) {
         // 'directory:'
         if (endline[-1] == ':') {
             if (line + 2 == endline && line[0] == '.') {
-                cursrcdir = std::string("/");
+                cursrcdir_ = std::string("/");
             } else if (line + 2 > endline && line[0] == '.' && line[1] == '/') {
-                cursrcdir = std::string(line + 1, endline - 1);
+                cursrcdir_ = std::string(line + 1, endline - 1);
             } else {
-                cursrcdir = std::string(line, endline - 1);
+                cursrcdir_ = std::string(line, endline - 1);
             }
-            if (cursrcdir[0] != '/') {
-                cursrcdir = std::string("/") + cursrcdir;
+            if (cursrcdir_[0] != '/') {
+                cursrcdir_ = std::string("/") + cursrcdir_;
             }
-            while (cursrcdir.length() > 1
-                   && cursrcdir[cursrcdir.length() - 1] == '/'
-                   && cursrcdir[cursrcdir.length() - 2] == '/') {
-                cursrcdir = cursrcdir.substr(0, cursrcdir.length() - 1);
+            while (cursrcdir_.length() > 1
+                   && cursrcdir_[cursrcdir_.length() - 1] == '/'
+                   && cursrcdir_[cursrcdir_.length() - 2] == '/') {
+                cursrcdir_ = cursrcdir_.substr(0, cursrcdir_.length() - 1);
             }
-            if (cursrcdir[cursrcdir.length() - 1] != '/') {
-                cursrcdir += '/';
+            if (cursrcdir_[cursrcdir_.length() - 1] != '/') {
+                cursrcdir_ += '/';
             }
-            curdstsubdir = cursrcdir;
-            assert(curdstsubdir.back() == '/');
+            curdstsubdir_ = cursrcdir_;
+            assert(curdstsubdir_.back() == '/');
             continue;
         }
 
         // '[FLAGS]'
-        int flags = base_flags;
+        int flags = 0;
         if (endline[-1] == ']') {
             // skip ' [FLAGS]'
             for (--endline; line < endline && endline[-1] != '['; --endline) {
@@ -1137,21 +1352,21 @@ static int construct_jail(dev_t jaildev, std::string& str, bool nomount) {
                     }
                     const char* tagstart = opts;
                     opts = opt_wordskip(opts);
-                    bind_tag = std::string(tagstart, opts);
+                    bind_tag_ = std::string(tagstart, opts);
 
                     while (isspace((unsigned char) *opts)) {
                         ++opts;
                     }
                     tagstart = opts;
                     opts = opt_wordskip(opts);
-                    bind_files = std::string(tagstart, opts);
+                    bind_files_ = std::string(tagstart, opts);
                 } else if (want == FLAG_MOUNT) {
                     while (isspace((unsigned char) *opts)) {
                         ++opts;
                     }
                     const char* mountstart = opts;
                     opts = opt_wordskip(opts);
-                    mount_dst = std::string(mountstart, opts);
+                    mount_dst_ = std::string(mountstart, opts);
 
                     while (isspace((unsigned char) *opts)) {
                         ++opts;
@@ -1160,7 +1375,7 @@ static int construct_jail(dev_t jaildev, std::string& str, bool nomount) {
                     while (*opts != ']' && *opts != ';') {
                         ++opts;
                     }
-                    mount_args = std::string(mountstart, opts);
+                    mount_args_ = std::string(mountstart, opts);
                 }
                 // skip to next option word
                 while (*opts != ']' && *opts != ';') {
@@ -1169,19 +1384,44 @@ static int construct_jail(dev_t jaildev, std::string& str, bool nomount) {
             }
         }
 
-        std::string src, dst;
         const char* arrow = (const char*) memmem(line, endline - line, " <- ", 4);
         if (arrow) {
-            src = std::string(arrow + 4, endline);
+            me.src = std::string(arrow + 4, endline);
         } else if (line[0] == '/') {
-            src = std::string(line, endline);
+            me.src = std::string(line, endline);
         } else {
-            src = cursrcdir + std::string(line, endline);
+            me.src = cursrcdir_ + std::string(line, endline);
         }
         if (!arrow) {
             arrow = endline;
         }
-        dst = curdstsubdir + std::string(line + (line[0] == '/'), arrow);
+        me.dst = curdstsubdir_ + std::string(line + (line[0] == '/'), arrow);
+        me.flags = flags;
+        pos_ = pos;
+        return true;
+    }
+    pos_ = pos;
+    return false;
+}
+
+static int construct_jail(dev_t jaildev, std::string& str, bool nomount) {
+    // prepare root
+    if (x_chmod(dstroot.c_str(), 0755)
+        || x_lchown(dstroot.c_str(), 0, 0)) {
+        return 1;
+    }
+    dst_table[dstroot + "/"] = 1;
+
+    // Mounts
+    populate_mount_table();
+
+    // Read a line at a time
+    manifestparser mp(str);
+    manifestentry me;
+    while (mp.next(me)) {
+        const std::string& src = me.src;
+        const std::string& dst = me.dst;
+        int flags = me.flags;
 
         // act on flags
         if (flags & (FLAG_BIND | FLAG_BIND_RO)) {
@@ -1189,8 +1429,8 @@ static int construct_jail(dev_t jaildev, std::string& str, bool nomount) {
                 if (flags & FLAG_MOUNT) {
                     fprintf(stderr, "%s: [mount] option ignored\n", src.c_str());
                 }
-                if (!bind_tag.empty() && !bind_files.empty()) {
-                    fix_jail_bind_src(jaildev, src, bind_tag, bind_files);
+                if (!mp.bind_tag_.empty() && !mp.bind_files_.empty()) {
+                    fix_jail_bind_src(jaildev, src, mp.bind_tag_, mp.bind_files_);
                 }
                 mountslot ms(src.c_str(), "none",
                              flags & FLAG_BIND_RO ? "bind,rec,unbindable,ro" : "bind,rec,unbindable");
@@ -1201,7 +1441,7 @@ static int construct_jail(dev_t jaildev, std::string& str, bool nomount) {
             }
         } else if (flags & FLAG_MOUNT) {
             if (!nomount) {
-                mountslot ms(src.c_str(), mount_dst.c_str(), mount_args.c_str());
+                mountslot ms(src.c_str(), mp.mount_dst_.c_str(), mp.mount_args_.c_str());
                 ms.wanted = true;
                 mount_table[src] = ms;
                 v_ensuredir(dstroot + dst, 0555, true);
@@ -1819,6 +2059,7 @@ void jaildirinfo::remove_recursive(int parentdirfd, std::string component,
             if (verbose) {
                 fprintf(verbosefile, "rm %s%s\n", dirname.c_str(), de->d_name);
             }
+            profile_count(pc_unlink);
             if (!dryrun && unlinkat(dirfd, de->d_name, de->d_type == DT_DIR ? AT_REMOVEDIR : 0) != 0) {
                 perror_die("rm " + dirname + de->d_name);
             }
@@ -1830,12 +2071,15 @@ void jaildirinfo::remove_recursive(int parentdirfd, std::string component,
     if (verbose) {
         fprintf(verbosefile, "rmdir %s\n", dirname.c_str());
     }
+    profile_count(pc_unlink);
     if (!dryrun && unlinkat(parentdirfd, component.c_str(), AT_REMOVEDIR) != 0) {
         perror_die("rmdir " + dirname);
     }
 }
 
 
+struct spscring;
+
 struct jbuffer {
     unsigned char* buf_;
     size_t head_ = 0;
@@ -1844,6 +2088,7 @@ struct jbuffer {
     size_t bufpos_ = 0;
     bool rclosed_ = false;
     bool wclosed_ = false;
+    bool mapped_ = false;   // `buf_` is a ring mapped twice back to back
     int rerrno_ = 0;
 
     jbuffer(size_t cap)
@@ -1851,34 +2096,97 @@ struct jbuffer {
     }
     jbuffer(jbuffer&& x)
         : buf_(x.buf_), head_(x.head_), tail_(x.tail_), cap_(x.cap_),
-          bufpos_(x.bufpos_), rclosed_(x.rclosed_), wclosed_(x.wclosed_), rerrno_(x.rerrno_) {
+          bufpos_(x.bufpos_), rclosed_(x.rclosed_), wclosed_(x.wclosed_),
+          mapped_(x.mapped_), rerrno_(x.rerrno_) {
         x.buf_ = nullptr;
+        x.mapped_ = false;
     }
     jbuffer(const jbuffer&) = delete;
     jbuffer& operator=(const jbuffer&) = delete;
     jbuffer& operator=(jbuffer&&) = delete;
     ~jbuffer() {
-        delete[] buf_;
+        release();
     }
 
+    bool map_ring(size_t cap);
+    void release();
+
     inline void append(char ch);
     void append(const unsigned char* first, const unsigned char* last);
     inline void append(const char* first, const char* last);
     inline void append(const char* first, size_t n);
     const unsigned char* append_json_chars(const unsigned char* first, const unsigned char* last);
     void reserve(size_t n);
-    bool read(int from);
+    bool read(int from, size_t max = -1);
+    bool read(spscring& from, size_t max = -1);
     bool write(int to, size_t& to_off);
     void consume_to(size_t off);
 
+    inline size_t space() const;
     inline bool empty() const;
     inline bool can_read() const;
     inline bool can_write() const;
     inline bool done() const;
 };
 
+// Switch to a fixed-capacity ring backed by a memfd mapped twice, back to
+// back. Data between `head_` and `tail_` is always contiguous, so reads
+// and writes never wrap, and consume_to never has to memmove.
+bool jbuffer::map_ring(size_t cap) {
+#if __linux__ && defined(MFD_CLOEXEC)
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    cap = (cap + pagesize - 1) & ~(pagesize - 1);
+    if (cap < tail_ - head_) {
+        return false;
+    }
+    int fd = memfd_create("pa-jail-jbuffer", MFD_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    void* base = MAP_FAILED;
+    if (ftruncate(fd, cap) == 0) {
+        base = mmap(nullptr, 2 * cap, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (base != MAP_FAILED
+        && (mmap(base, cap, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+            || mmap((char*) base + cap, cap, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)) {
+        munmap(base, 2 * cap);
+        base = MAP_FAILED;
+    }
+    close(fd);
+    if (base == MAP_FAILED) {
+        return false;
+    }
+    memcpy(base, &buf_[head_], tail_ - head_);
+    release();
+    buf_ = reinterpret_cast<unsigned char*>(base);
+    tail_ -= head_;
+    bufpos_ += head_;
+    head_ = 0;
+    cap_ = cap;
+    mapped_ = true;
+    return true;
+#else
+    (void) cap;
+    return false;
+#endif
+}
+
+void jbuffer::release() {
+#if __linux__
+    if (mapped_) {
+        munmap(buf_, 2 * cap_);
+        buf_ = nullptr;
+        mapped_ = false;
+    }
+#endif
+    delete[] buf_;
+}
+
 void jbuffer::append(char ch) {
-    if (tail_ == cap_) {
+    if (space() == 0) {
         reserve(0);
     }
     buf_[tail_] = ch;
@@ -1887,7 +2195,7 @@ void jbuffer::append(char ch) {
 
 void jbuffer::append(const unsigned char* first, const unsigned char* last) {
     size_t n = last - first;
-    if (cap_ - tail_ < n) {
+    if (space() < n) {
         reserve(n);
     }
     memcpy(buf_ + tail_, first, n);
@@ -1904,10 +2212,176 @@ void jbuffer::append(const char* buf, size_t len) {
            reinterpret_cast<const unsigned char*>(buf + len));
 }
 
+// JSON string scanning. `json_scan(first, last)` returns the first byte in
+// [first, last) that `append_json_chars` must examine one at a time: a
+// control character, quote, backslash, or the start of a UTF-8 sequence it
+// could not validate in bulk. Everything before that point is copied as is.
+
+typedef const unsigned char* (*json_scan_function)(const unsigned char*,
+                                                   const unsigned char*);
+
+static inline bool json_plain_char(unsigned char ch) {
+    return ch >= 32 && ch < 0x80 && ch != '\\' && ch != '\"';
+}
+
+static const unsigned char* json_scan_scalar(const unsigned char* first,
+                                             const unsigned char* last) {
+    while (first != last && json_plain_char(*first)) {
+        ++first;
+    }
+    return first;
+}
+
+#if PA_JAIL_X86_SIMD
+static const unsigned char* json_scan_sse2(const unsigned char* first,
+                                           const unsigned char* last) {
+    const __m128i space = _mm_set1_epi8(32);
+    const __m128i quote = _mm_set1_epi8('\"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    while (last - first >= 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(first));
+        // signed compare: catches both controls and bytes >= 0x80
+        __m128i x = _mm_or_si128(_mm_cmplt_epi8(v, space),
+                                 _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                                              _mm_cmpeq_epi8(v, backslash)));
+        if (unsigned mask = _mm_movemask_epi8(x)) {
+            return first + __builtin_ctz(mask);
+        }
+        first += 16;
+    }
+    return json_scan_scalar(first, last);
+}
+
+// Bulk UTF-8 validation after Keiser & Lemire, "Validating UTF-8 in less
+// than one instruction per byte" (2021). `v` must start on a character
+// boundary. Sequences cut off at the end of `v` are not reported.
+__attribute__((target("avx2")))
+static inline bool json_utf8_valid_avx2(__m256i v) {
+    enum {
+        too_short = 1 << 0, too_long = 1 << 1, overlong_3 = 1 << 2,
+        too_large = 1 << 3, surrogate = 1 << 4, overlong_2 = 1 << 5,
+        too_large_1000 = 1 << 6, overlong_4 = 1 << 6, two_conts = 1 << 7,
+        carry = too_short | too_long | two_conts
+    };
+#define LOOKUP16(...) _mm256_setr_epi8(__VA_ARGS__, __VA_ARGS__)
+    const __m256i byte_1_high_table = LOOKUP16(
+        too_long, too_long, too_long, too_long,
+        too_long, too_long, too_long, too_long,
+        two_conts, two_conts, two_conts, two_conts,
+        too_short | overlong_2,
+        too_short,
+        too_short | overlong_3 | surrogate,
+        too_short | too_large | too_large_1000 | overlong_4);
+    const __m256i byte_1_low_table = LOOKUP16(
+        carry | overlong_3 | overlong_2 | overlong_4,
+        carry | overlong_2,
+        carry,
+        carry,
+        carry | too_large,
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000 | surrogate,
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000);
+    const __m256i byte_2_high_table = LOOKUP16(
+        too_short, too_short, too_short, too_short,
+        too_short, too_short, too_short, too_short,
+        too_long | overlong_2 | two_conts | overlong_3 | too_large_1000 | overlong_4,
+        too_long | overlong_2 | two_conts | overlong_3 | too_large,
+        too_long | overlong_2 | two_conts | surrogate | too_large,
+        too_long | overlong_2 | two_conts | surrogate | too_large,
+        too_short, too_short, too_short, too_short);
+#undef LOOKUP16
+    const __m256i low_nibble = _mm256_set1_epi8(0x0F);
+    // bytes before `v` are treated as ASCII
+    __m256i before = _mm256_permute2x128_si256(_mm256_setzero_si256(), v, 0x21);
+    __m256i prev1 = _mm256_alignr_epi8(v, before, 15);
+    __m256i prev2 = _mm256_alignr_epi8(v, before, 14);
+    __m256i prev3 = _mm256_alignr_epi8(v, before, 13);
+    __m256i sc = _mm256_and_si256(
+        _mm256_shuffle_epi8(byte_1_high_table,
+                            _mm256_and_si256(_mm256_srli_epi16(prev1, 4), low_nibble)),
+        _mm256_and_si256(
+            _mm256_shuffle_epi8(byte_1_low_table,
+                                _mm256_and_si256(prev1, low_nibble)),
+            _mm256_shuffle_epi8(byte_2_high_table,
+                                _mm256_and_si256(_mm256_srli_epi16(v, 4), low_nibble))));
+    // high bit set where the byte must be a third or fourth continuation
+    __m256i must23 = _mm256_or_si256(
+        _mm256_subs_epu8(prev2, _mm256_set1_epi8(char(0xE0 - 0x80))),
+        _mm256_subs_epu8(prev3, _mm256_set1_epi8(char(0xF0 - 0x80))));
+    __m256i error = _mm256_xor_si256(
+        _mm256_and_si256(must23, _mm256_set1_epi8(char(0x80))), sc);
+    return _mm256_testz_si256(error, error);
+}
+
+__attribute__((target("avx2")))
+static const unsigned char* json_scan_avx2(const unsigned char* first,
+                                           const unsigned char* last) {
+    const __m256i space = _mm256_set1_epi8(32);
+    const __m256i quote = _mm256_set1_epi8('\"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    while (last - first >= 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(first));
+        __m256i x = _mm256_or_si256(_mm256_cmpgt_epi8(space, v),
+                                    _mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                                                    _mm256_cmpeq_epi8(v, backslash)));
+        unsigned mask = _mm256_movemask_epi8(x);
+        if (mask == 0) {
+            first += 32;
+            continue;
+        }
+        unsigned nonascii = _mm256_movemask_epi8(v);
+        if ((mask & ~nonascii) == 0 && json_utf8_valid_avx2(v)) {
+            // stop before a sequence that continues past this block
+            if (first[31] >= 0xC0) {
+                first += 31;
+            } else if (first[30] >= 0xE0) {
+                first += 30;
+            } else if (first[29] >= 0xF0) {
+                first += 29;
+            } else {
+                first += 32;
+            }
+            continue;
+        }
+        return first + __builtin_ctz(mask);
+    }
+    return json_scan_sse2(first, last);
+}
+
+static const unsigned char* json_scan_select(const unsigned char* first,
+                                             const unsigned char* last);
+static json_scan_function json_scan = json_scan_select;
+
+static const unsigned char* json_scan_select(const unsigned char* first,
+                                             const unsigned char* last) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        json_scan = json_scan_avx2;
+    } else {
+        json_scan = json_scan_sse2;
+    }
+    return json_scan(first, last);
+}
+#else
+static json_scan_function json_scan = json_scan_scalar;
+#endif
+
 const unsigned char* jbuffer::append_json_chars(const unsigned char* first, const unsigned char* last) {
     const unsigned char* stop = first;
     const char hex[] = "0123456789ABCDEF";
     while (first != last) {
+        first = json_scan(first, last);
+        if (first == last) {
+            break;
+        }
         if (*first == 0) {
         skip:
             append(stop, first);
@@ -1971,10 +2445,98 @@ const unsigned char* jbuffer::append_json_chars(const unsigned char* first, cons
     return first;
 }
 
+#if 0
+struct json_chars_tester {
+    static const unsigned char* scan_none(const unsigned char* first,
+                                          const unsigned char*) {
+        return first;
+    }
+    static std::string run(json_scan_function scan, const std::string& in,
+                           size_t* consumed) {
+        json_scan_function old_scan = json_scan;
+        json_scan = scan;
+        jbuffer jb(16);
+        const unsigned char* first = reinterpret_cast<const unsigned char*>(in.data());
+        *consumed = jb.append_json_chars(first, first + in.size()) - first;
+        json_scan = old_scan;
+        return std::string(reinterpret_cast<char*>(jb.buf_ + jb.head_),
+                           jb.tail_ - jb.head_);
+    }
+    json_chars_tester() {
+        static const char* const pieces[] = {
+            "a", "hello, world ", "\"", "\\", "\n", "\t", "\x01", "\x1F",
+            "" /* NUL */, "\x7F", "\xC3\xA9", "\xE2\x82\xAC",
+            "\xF0\x9F\x98\x80", "\xED\x9F\xBF", "\xF4\x8F\xBF\xBF",
+            "\xC0\xAF", "\xC1\xBF", "\xE0\x80\xAF", "\xED\xA0\x80",
+            "\xF0\x80\x80\xAF", "\xF4\x90\x80\x80", "\xF5\x80\x80\x80",
+            "\xFF", "\x80", "\xBF", "\xC3", "\xE2\x82", "\xF0\x9F\x98"
+        };
+        std::vector<json_scan_function> scans = {json_scan_scalar};
+#if PA_JAIL_X86_SIMD
+        scans.push_back(json_scan_sse2);
+        if (__builtin_cpu_supports("avx2")) {
+            scans.push_back(json_scan_avx2);
+        }
+#endif
+        srandom(1);
+        for (int trial = 0; trial != 20000; ++trial) {
+            std::string in;
+            int npieces = random() % 40;
+            for (int i = 0; i != npieces; ++i) {
+                int which = random() % (sizeof(pieces) / sizeof(pieces[0]));
+                if (which == 8) {
+                    in.push_back('\0');
+                } else if (random() % 4 == 0) {
+                    in.append(std::string(random() % 40, 'x'));
+                } else {
+                    in.append(pieces[which]);
+                }
+            }
+            size_t want_consumed;
+            std::string want = run(scan_none, in, &want_consumed);
+            for (auto scan : scans) {
+                for (size_t n = in.size() > 40 ? in.size() - 40 : 0;
+                     n <= in.size(); ++n) {
+                    std::string prefix = in.substr(0, n);
+                    size_t c1, c2;
+                    std::string a = run(scan_none, prefix, &c1);
+                    std::string b = run(scan, prefix, &c2);
+                    assert(a == b && c1 == c2);
+                }
+                size_t consumed;
+                assert(run(scan, in, &consumed) == want
+                       && consumed == want_consumed);
+            }
+        }
+    }
+};
+static json_chars_tester json_tester;
+#endif
+
 void jbuffer::reserve(size_t n) {
     if (n == 0) {
         n = std::min(cap_, size_t(131072));
     }
+    if (mapped_) {
+        // a ring can't grow in place: map a bigger one, or failing that,
+        // move straight to an ordinary buffer of the new size
+        size_t ncap = 2 * cap_;
+        while (tail_ - head_ + n > ncap) {
+            ncap *= 2;
+        }
+        if (map_ring(ncap)) {
+            return;
+        }
+        unsigned char* nbuf = new unsigned char[ncap];
+        memcpy(nbuf, &buf_[head_], tail_ - head_);
+        release();
+        buf_ = nbuf;
+        tail_ -= head_;
+        bufpos_ += head_;
+        head_ = 0;
+        cap_ = ncap;
+        return;
+    }
     size_t ncap = cap_;
     while (tail_ + n > ncap) {
         ncap = std::min(ncap * 2, ncap + 131072);
@@ -1986,10 +2548,10 @@ void jbuffer::reserve(size_t n) {
     cap_ = ncap;
 }
 
-bool jbuffer::read(int from) {
+bool jbuffer::read(int from, size_t max) {
     bool any = false;
-    if (from >= 0 && !rclosed_ && tail_ != cap_) {
-        ssize_t nr = ::read(from, &buf_[tail_], cap_ - tail_);
+    if (from >= 0 && !rclosed_ && space() != 0 && max != 0) {
+        ssize_t nr = ::read(from, &buf_[tail_], std::min(space(), max));
         if (nr != 0 && nr != -1) {
             tail_ += nr;
             any = true;
@@ -2021,7 +2583,13 @@ bool jbuffer::write(int to, size_t& off) {
 void jbuffer::consume_to(size_t off) {
     assert(off >= bufpos_ + head_ && off <= bufpos_ + tail_);
     head_ = off - bufpos_;
-    if (tail_ >= 3 * cap_ / 4) {
+    if (mapped_) {
+        if (head_ >= cap_) {
+            head_ -= cap_;
+            tail_ -= cap_;
+            bufpos_ += cap_;
+        }
+    } else if (tail_ >= 3 * cap_ / 4) {
         memmove(buf_, &buf_[head_], tail_ - head_);
         tail_ -= head_;
         bufpos_ += head_;
@@ -2029,12 +2597,16 @@ void jbuffer::consume_to(size_t off) {
     }
 }
 
+size_t jbuffer::space() const {
+    return (mapped_ ? head_ + cap_ : cap_) - tail_;
+}
+
 bool jbuffer::empty() const {
     return head_ == tail_;
 }
 
 bool jbuffer::can_read() const {
-    return !rclosed_ && !wclosed_ && tail_ != cap_;
+    return !rclosed_ && !wclosed_ && space() != 0;
 }
 
 bool jbuffer::can_write() const {
@@ -2046,602 +2618,4032 @@ bool jbuffer::done() const {
 }
 
 
-struct esfd {
-    int fd_;
-    jbuffer jbuf_;
-    size_t output_off_;
-    size_t off_ = 0;
+// Single-producer, single-consumer byte ring. A reader thread drains the
+// pty into the ring, so the jailed program's output speed doesn't depend
+// on how quickly the main loop writes the log and event sources.
+struct spscring {
+    unsigned char* buf_;
+    size_t cap_;                        // power of 2
+    std::atomic<size_t> head_{0};       // advanced by consumer
+    std::atomic<size_t> tail_{0};       // advanced by producer
+    std::atomic<bool> closed_{false};
+    std::atomic<bool> producer_waiting_{false};
+    int rerrno_ = 0;
+    int wakefd_[2];                     // producer -> consumer
+    int spacefd_[2];                    // consumer -> producer
+
+    spscring(size_t cap);
+    spscring(const spscring&) = delete;
+    spscring& operator=(const spscring&) = delete;
 
-    esfd(int fd, size_t output_off)
-        : fd_(fd), jbuf_(4096), output_off_(output_off) {
+    void start(int from);
+    void produce(int from);
+    size_t read(unsigned char* buf, size_t n);
+    int wakefd() const {
+        return wakefd_[0];
+    }
+    bool done() const {
+        return closed_.load(std::memory_order_acquire)
+            && head_.load(std::memory_order_relaxed) == tail_.load(std::memory_order_acquire);
     }
-    void write_header();
-    void write_event(jbuffer& jbuf);
 };
 
-void esfd::write_header() {
-    const char message[] = "HTTP/1.1 200 OK\r\nCache-Control: no-store\r\nContent-Type: text/event-stream\r\nX-Accel-Buffering: no\r\n\r\n";
-    write(fd_, message, sizeof(message) - 1);
+static void make_nonblocking(int fd);
+
+static void signal_pipe(int fd) {
+    char c = 0;
+    ssize_t w = write(fd, &c, 1);
+    (void) w;
 }
 
-void esfd::write_event(jbuffer& jbuf) {
-    char xbuf[2048];
-    size_t n = sprintf(xbuf, "data:{\"offset\":%zu,\"data\":\"", output_off_);
-    jbuf_.append(xbuf, n);
-    const unsigned char* stop = jbuf_.append_json_chars(jbuf.buf_ + output_off_ - jbuf.bufpos_, jbuf.buf_ + jbuf.tail_);
-    size_t newoff = jbuf.bufpos_ + (stop - jbuf.buf_);
-    n = sprintf(xbuf, "\",\"end_offset\":%zu}\nid:%zu\n\n", newoff, newoff);
-    jbuf_.append(xbuf, n);
-    output_off_ = newoff;
+static void drain_pipe(int fd) {
+    char buf[128];
+    while (read(fd, buf, sizeof(buf)) > 0) {
+        /* skip */
+    }
 }
 
+spscring::spscring(size_t cap)
+    : buf_(new unsigned char[cap]), cap_(cap) {
+    assert((cap & (cap - 1)) == 0);
+    if (pipe(wakefd_) != 0 || pipe(spacefd_) != 0) {
+        perror_die("pipe");
+    }
+    for (int fd : {wakefd_[0], wakefd_[1], spacefd_[0], spacefd_[1]}) {
+        make_nonblocking(fd);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+}
 
-class jailownerinfo {
-  public:
-    uid_t owner_ = ROOT;
-    gid_t group_ = ROOT;
-    std::string owner_home_;
-    std::string owner_sh_;
+void spscring::start(int from) {
+    std::thread t(&spscring::produce, this, from);
+    t.detach();
+}
 
-    jailownerinfo();
-    ~jailownerinfo();
+void spscring::produce(int from) {
+    while (true) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        size_t head = head_.load(std::memory_order_acquire);
+        if (tail - head == cap_) {
+            // full: wait for the consumer. `producer_waiting_` and `head_`
+            // are sequentially consistent so a wakeup can't be missed.
+            producer_waiting_.store(true);
+            if (tail - head_.load() == cap_) {
+                struct pollfd p = {spacefd_[0], POLLIN, 0};
+                (void) poll(&p, 1, -1);
+            }
+            producer_waiting_.store(false);
+            drain_pipe(spacefd_[0]);
+            continue;
+        }
+        size_t off = tail & (cap_ - 1);
+        size_t n = std::min(cap_ - (tail - head), cap_ - off);
+        ssize_t nr = ::read(from, &buf_[off], n);
+        if (nr > 0) {
+            tail_.store(tail + nr, std::memory_order_release);
+            signal_pipe(wakefd_[1]);
+        } else if (nr == -1 && errno == EAGAIN) {
+            struct pollfd p = {from, POLLIN, 0};
+            (void) poll(&p, 1, -1);
+        } else if (nr == 0 || errno != EINTR) {
+            rerrno_ = nr == 0 ? 0 : errno;
+            closed_.store(true, std::memory_order_release);
+            signal_pipe(wakefd_[1]);
+            return;
+        }
+    }
+}
 
-    void init(const char* owner_name);
-    void set_inputfd(int inputfd);
-    void set_timeout(double timeout, double idle_timeout);
-    void set_foreground(bool foreground);
-    void exec(int argc, char** argv, jaildirinfo& jaildir);
-    int exec_go();
+size_t spscring::read(unsigned char* buf, size_t n) {
+    drain_pipe(wakefd_[0]);
+    bool closed = closed_.load(std::memory_order_acquire);
+    size_t head = head_.load(std::memory_order_relaxed);
+    size_t tail = tail_.load(std::memory_order_acquire);
+    n = std::min(n, tail - head);
+    size_t off = head & (cap_ - 1);
+    size_t n1 = std::min(n, cap_ - off);
+    memcpy(buf, &buf_[off], n1);
+    memcpy(buf + n1, buf_, n - n1);
+    head_.store(head + n);
+    if (n != 0 && producer_waiting_.load()) {
+        signal_pipe(spacefd_[1]);
+    }
+    // stay readable if data remains or the producer is finished
+    if (n != tail - head || closed) {
+        signal_pipe(wakefd_[1]);
+    }
+    return n;
+}
 
-  private:
-    std::vector<const char*> newenv_;
-    char** argv_ = nullptr;
-    jaildirinfo* jaildir_;
-    int inputfd_ = -1;
-    double timeout_ = -1.0;
-    double idle_timeout_ = -1.0;
-    bool foreground_= false;
-    struct timeval start_time_;
-    struct timeval expiry_;
-    struct timeval active_time_;
-    struct timeval idle_expiry_;
-    jbuffer to_slave_;
-    size_t to_slave_off_ = 0;
-    jbuffer from_slave_;
-    size_t from_slave_off_ = 0;
-    std::list<esfd> esfds_;
-    bool stdin_tty_;
-    bool stdout_tty_;
-    bool stderr_tty_;
-    int ttyfd_;
-    struct termios ttyfd_termios_;
-    int child_status_ = -1;
-    bool has_blocked_;
-    unsigned long long timing_msec_ = 0;
-    unsigned long long timing_offset_ = 0;
-    size_t timing_count_ = 0;
+bool jbuffer::read(spscring& from, size_t max) {
+    size_t n = 0;
+    if (!rclosed_ && space() != 0 && max != 0) {
+        n = from.read(&buf_[tail_], std::min(space(), max));
+        tail_ += n;
+        if (n == 0 && from.done()) {
+            rclosed_ = true;
+            rerrno_ = from.rerrno_;
+        }
+    }
+    return n != 0;
+}
 
-    void start_sigpipe();
-    void block(int ptymaster);
-    int check_child_timeout(pid_t child, bool waitpid);
-    void wait_background(pid_t child, int ptymaster);
-    void write_timing();
-    void exec_go_pty(int ptymaster, const char* ptyslavename, pid_t child);
-    [[noreturn]] void exec_done(pid_t child, int exit_status);
+
+// An encoded event. Output is encoded once and the result is shared by
+// every event-source client.
+typedef std::shared_ptr<const jbuffer> essegment;
+
+static essegment make_essegment(const char* s, size_t n) {
+    auto seg = std::make_shared<jbuffer>(n);
+    seg->append(s, n);
+    return seg;
+}
+
+struct esfd {
+    struct item {
+        essegment seg;
+        size_t end_off;         // output offset after this item
+        bool keep;              // never dropped (the HTTP header, replay)
+        bool resync;            // a resync notice, not output
+    };
+
+    int fd_;
+    std::deque<item> segs_;
+    size_t seg_off_ = 0;        // bytes of `segs_.front()` already written
+    size_t queued_ = 0;         // bytes in `segs_` not yet written
+    size_t written_off_ = 0;    // output offset through which events are written
+    size_t metric_off_ = 0;     // output offset through which latency is recorded
+    unsigned long long dropped_ = 0;
+    bool wclosed_ = false;
+    std::string request_;
+    struct timeval request_expiry_;
+    size_t request_off_;        // output offset when connected
+    z_stream* zs_ = nullptr;    // compressor, if the client accepts one
+    bool zfinish_ = false;      // end the compressed stream after `segs_`
+    std::string zout_;          // compressed bytes not yet written
+    size_t zout_off_ = 0;
+    bool ws_ = false;           // a WebSocket client
+    bool ws_closing_ = false;   // close frame queued; push nothing more
+    bool ws_readable_ = false;  // poll reported input
+    int pollidx_ = -1;
+    bool close_on_overflow_ = false;
+    std::string wsin_;          // unparsed frames from the client
+    std::string wsmsg_;         // fragmented message so far
+    int wsmsg_opcode_ = 0;
+
+    esfd(int fd)
+        : fd_(fd) {
+    }
+    esfd(const esfd&) = delete;
+    esfd& operator=(const esfd&) = delete;
+    ~esfd();
+    bool start_deflate(int window_bits);
+    void push(essegment seg, size_t end_off, bool keep = false);
+    void resync(size_t off);
+    bool droppable() const;
+    bool can_write() const {
+        return !wclosed_ && (!segs_.empty() || zout_off_ != zout_.size());
+    }
+    size_t queued_end() const {
+        return segs_.empty() ? written_off_ : segs_.back().end_off;
+    }
+    void close() {
+        // a WebSocket client may have sent frames we never read; read
+        // them so closing doesn't reset the connection
+        char buf[4096];
+        while (ws_ && read(fd_, buf, sizeof(buf)) > 0) {
+            /* skip */
+        }
+        ::close(fd_);
+    }
+    bool write();
+  private:
+    void deflate_some();
 };
 
-jailownerinfo::jailownerinfo()
-    : to_slave_(4096), from_slave_(8192) {
-    stdin_tty_ = isatty(STDIN_FILENO);
-    stdout_tty_ = isatty(STDOUT_FILENO);
-    stderr_tty_ = isatty(STDERR_FILENO);
-    // Assume all tty-opened fds are to the same tty.
-    if (stdin_tty_ || stdout_tty_ || stderr_tty_) {
-        ttyfd_ = stdin_tty_ ? STDIN_FILENO : (stdout_tty_ ? STDOUT_FILENO : STDERR_FILENO);
-        tcgetattr(ttyfd_, &ttyfd_termios_);
-    } else {
-        ttyfd_ = -1;
+esfd::~esfd() {
+    if (zs_) {
+        deflateEnd(zs_);
+        delete zs_;
     }
-    auto stdout_off = lseek(STDOUT_FILENO, 0, SEEK_CUR);
-    from_slave_.bufpos_ = from_slave_off_ = stdout_off < 0 ? 0 : stdout_off;
 }
 
-jailownerinfo::~jailownerinfo() {
-    delete[] argv_;
+bool esfd::start_deflate(int window_bits) {
+    zs_ = new z_stream;
+    memset(zs_, 0, sizeof(*zs_));
+    if (deflateInit2(zs_, event_compression, Z_DEFLATED, window_bits,
+                     8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        delete zs_;
+        zs_ = nullptr;
+    }
+    return zs_ != nullptr;
 }
 
-void jailownerinfo::set_inputfd(int inputfd) {
-    assert(inputfd_ < 0);
-    inputfd_ = inputfd;
+void esfd::push(essegment seg, size_t end_off, bool keep) {
+    if (ws_closing_) {
+        return;
+    }
+    // A client with no output to drop takes the next segment even if it
+    // exceeds `event_client_buffer`; otherwise a segment larger than the
+    // buffer could never be sent.
+    size_t n = seg->tail_ - seg->head_;
+    if (!keep
+        && event_client_buffer > 0
+        && queued_ + n > event_client_buffer
+        && droppable()) {
+        if (close_on_overflow_) {
+            wclosed_ = true;
+            return;
+        }
+        resync(end_off);
+    } else {
+        queued_ += n;
+        segs_.push_back({std::move(seg), end_off, keep, false});
+    }
 }
 
-static bool check_shell(const char* shell) {
-    bool found = false;
-    char* sh;
-    while (!found && (sh = getusershell())) {
-        found = strcmp(sh, shell) == 0;
+// WebSocket clients get binary frames whose payload starts with a type
+// byte and big-endian 64-bit output offsets:
+//   'o' OFFSET DATA          output bytes starting at OFFSET
+//   's' OFFSET DROPPED       skipped ahead to OFFSET (see `resync`)
+//   'd' OFFSET DROPPED       output is complete; a close frame follows
+//   'x' JSON                 an extracted marker line (see `encode_extract`)
+//   't' JSON                 a resource telemetry sample
+// With --event-input, clients may send binary frames 'i' DATA (input for
+// the jail) and 'w' COLS ROWS (16 bits each, to resize the terminal).
+// Text frames are input. Otherwise the socket is read-only.
+static void ws_frame_header(jbuffer& jb, int opcode, size_t n) {
+    unsigned char h[10];
+    size_t hlen = 2;
+    h[0] = 0x80 | opcode;
+    if (n < 126) {
+        h[1] = n;
+    } else if (n < 65536) {
+        h[1] = 126;
+        h[2] = n >> 8;
+        h[3] = n;
+        hlen = 4;
+    } else {
+        h[1] = 127;
+        for (int i = 0; i != 8; ++i) {
+            h[2 + i] = uint64_t(n) >> (56 - 8 * i);
+        }
+        hlen = 10;
     }
-    endusershell();
-    return found;
+    jb.append(h, h + hlen);
 }
 
-void jailownerinfo::init(const char* owner_name) {
-    if (strlen(owner_name) >= 1024) {
-        die("%s: Username too long\n", owner_name);
+static void ws_append_be64(jbuffer& jb, uint64_t x) {
+    unsigned char b[8];
+    for (int i = 0; i != 8; ++i) {
+        b[i] = x >> (56 - 8 * i);
     }
+    jb.append(b, b + 8);
+}
 
-    struct passwd* pwnam = getpwnam(owner_name);
-    if (!pwnam) {
-        die("%s: No such user\n", owner_name);
+static essegment make_ws_message(char type, uint64_t off, uint64_t x) {
+    auto jb = std::make_shared<jbuffer>(32);
+    ws_frame_header(*jb, 2, 17);
+    jb->append(type);
+    ws_append_be64(*jb, off);
+    ws_append_be64(*jb, x);
+    return jb;
+}
+
+static essegment make_ws_control(int opcode, const char* payload, size_t n) {
+    auto jb = std::make_shared<jbuffer>(n + 2);
+    ws_frame_header(*jb, opcode, n);
+    jb->append(payload, n);
+    return jb;
+}
+
+// Return true if `resync` would drop queued output: some segment other
+// than kept ones and the one being written.
+bool esfd::droppable() const {
+    for (size_t i = 0; i != segs_.size(); ++i) {
+        if (!segs_[i].keep && (i != 0 || seg_off_ == 0)) {
+            return true;
+        }
     }
+    return false;
+}
 
-    owner_ = pwnam->pw_uid;
-    group_ = pwnam->pw_gid;
-    if (strcmp(pwnam->pw_dir, "/") == 0) {
-        owner_home_ = "/home/nobody";
-    } else if (strncmp(pwnam->pw_dir, "/home/", 6) == 0) {
-        owner_home_ = pwnam->pw_dir;
+// The client has fallen too far behind. Drop its queued events, except
+// what must be sent whole, and tell it to continue at `off`.
+void esfd::resync(size_t off) {
+    size_t keep = 0;
+    while (keep != segs_.size()
+           && (segs_[keep].keep || (keep == 0 && seg_off_ != 0))) {
+        ++keep;
+    }
+    // Count output not yet reported as dropped: erased data events and
+    // everything up to `off`. Erased resync notices were counted already.
+    size_t prev = keep ? segs_[keep - 1].end_off : written_off_;
+    size_t drop = 0;
+    for (size_t i = keep; i != segs_.size(); ++i) {
+        queued_ -= segs_[i].seg->tail_ - segs_[i].seg->head_;
+        if (!segs_[i].resync) {
+            drop += segs_[i].end_off - prev;
+        }
+        prev = segs_[i].end_off;
+    }
+    drop += off - prev;
+    segs_.erase(segs_.begin() + keep, segs_.end());
+    dropped_ += drop;
+    event_dropped_bytes += drop;
+    ++event_resyncs;
+    essegment seg;
+    if (ws_) {
+        seg = make_ws_message('s', off, dropped_);
     } else {
-        die("%s: Home directory %s not under /home\n", owner_name, pwnam->pw_dir);
+        char buf[256];
+        int n = sprintf(buf, "event:resync\ndata:{\"offset\":%zu,\"dropped\":%llu}\nid:%zu\n\n",
+                        off, dropped_, off);
+        seg = make_essegment(buf, n);
     }
+    queued_ += seg->tail_ - seg->head_;
+    segs_.push_back({std::move(seg), off, false, true});
+}
 
-    if (strcmp(pwnam->pw_shell, "/bin/bash") == 0
-        || strcmp(pwnam->pw_shell, "/bin/sh") == 0
-        || check_shell(pwnam->pw_shell)) {
-        owner_sh_ = pwnam->pw_shell;
+// Encode output bytes [first, last), which begin at output offset `off`,
+// as one event. Returns the offset where encoding stopped: before an
+// incomplete UTF-8 character, unless `flush` is set, in which case such a
+// character is encoded as invalid bytes. Events for hub connections that
+// carry several runs name their `run` and have no `id`.
+static size_t encode_event(size_t off, const unsigned char* first,
+                           const unsigned char* last, essegment& seg,
+                           bool flush = false, const char* run = nullptr) {
+    auto jb = std::make_shared<jbuffer>(last - first + 192);
+    char xbuf[192];
+    size_t n;
+    if (run) {
+        n = sprintf(xbuf, "data:{\"run\":\"%s\",\"offset\":%zu,\"data\":\"", run, off);
     } else {
-        die("%s: Shell %s not allowed by /etc/shells\n", owner_name, pwnam->pw_shell);
+        n = sprintf(xbuf, "data:{\"offset\":%zu,\"data\":\"", off);
     }
-
-    if (owner_ == ROOT) {
-        die("%s: Jail user cannot be root\n", owner_name);
+    jb->append(xbuf, n);
+    const unsigned char* stop = jb->append_json_chars(first, last);
+    while (flush && stop != last) {
+        jb->append('\x7F');
+        ++stop;
+    }
+    size_t newoff = off + (stop - first);
+    if (run) {
+        n = sprintf(xbuf, "\",\"end_offset\":%zu}\n\n", newoff);
+    } else {
+        n = sprintf(xbuf, "\",\"end_offset\":%zu}\nid:%zu\n\n", newoff, newoff);
     }
+    jb->append(xbuf, n);
+    seg = std::move(jb);
+    return newoff;
 }
 
-#if __linux__
-extern "C" {
-static int exec_clone_function(void* arg) {
-    jailownerinfo* jailowner = static_cast<jailownerinfo*>(arg);
-    return jailowner->exec_go();
+// Return the end of [first, last) without any incomplete UTF-8 character
+// at its end. This is where `append_json_chars` stops, so WebSocket
+// output frames end where event-source events do.
+static const unsigned char* utf8_complete_end(const unsigned char* first,
+                                              const unsigned char* last) {
+    const unsigned char* p = last;
+    while (p != first && last - p < 3 && *(p - 1) >= 0x80 && *(p - 1) <= 0xBF) {
+        --p;
+    }
+    if (p == first || *(p - 1) < 0xC2 || *(p - 1) > 0xF4) {
+        return last;
+    }
+    --p;
+    size_t have = last - p;
+    size_t need = *p < 0xE0 ? 2 : (*p < 0xF0 ? 3 : 4);
+    if (have >= need
+        || (have >= 2
+            && ((*p == 0xE0 && p[1] < 0xA0)
+                || (*p == 0xED && p[1] > 0x9F)
+                || (*p == 0xF0 && p[1] < 0x90)
+                || (*p == 0xF4 && p[1] > 0x8F)))) {
+        return last;
+    }
+    return p;
 }
+
+// Encode output bytes [first, last), which begin at output offset `off`,
+// as one WebSocket output frame.
+static void encode_ws_output(size_t off, const unsigned char* first,
+                             const unsigned char* last, essegment& seg) {
+    auto jb = std::make_shared<jbuffer>(last - first + 24);
+    ws_frame_header(*jb, 2, last - first + 9);
+    jb->append('o');
+    ws_append_be64(*jb, off);
+    jb->append(first, last);
+    seg = std::move(jb);
 }
-#endif
 
-static void write_pid(int p) {
-    if (pidfd < 0) {
-        return;
+// terminal screen
+//
+// A VT100/xterm state machine fed with pty output, so an event-source
+// client can start from a picture of the screen rather than replaying
+// the output history. It covers what shells and curses programs use:
+// cursor motion, erasing, scroll regions, insert and delete, SGR
+// attributes and colors, the alternate screen, and the DEC line-drawing
+// set. Combining characters are dropped.
+
+struct vtcell {
+    char32_t ch = ' ';          // 0: right half of a wide character
+    uint32_t fg = 0;            // 0 default, vtcolor_index|N, or vtcolor_rgb|RGB
+    uint32_t bg = 0;
+    uint16_t attr = 0;          // SGR 1-9 as bits 1-9
+
+    bool same_style(const vtcell& x) const {
+        return fg == x.fg && bg == x.bg && attr == x.attr;
     }
-    lseek(pidfd, 0, SEEK_SET);
-    char buf[1024], *sx = buf;
-    if (p > 0) {
-        const char* s0 = pidcontents.data(), *s1 = s0 + pidcontents.length();
-        while (s0 != s1 && sx != buf + 1024) {
-            if (*s0 == '$' && s0 + 1 != s1 && s0[1] == '$') {
-                int l = snprintf(sx, buf + 1024 - sx, "%d", p);
-                sx += std::min(ssize_t(l), buf + 1024 - sx);
-                s0 += 2;
-            } else {
-                *sx++ = *s0++;
-            }
-        }
-    } else {
-        *sx++ = '*';
+};
+
+static const uint32_t vtcolor_index = 1U << 24;
+static const uint32_t vtcolor_rgb = 2U << 24;
+
+class vtscreen {
+  public:
+    vtscreen(int cols, int rows);
+
+    int cols() const {
+        return cols_;
     }
-    if (sx != buf && sx != buf + 1024 && sx[-1] != '\n') {
-        *sx++ = '\n';
+    int rows() const {
+        return rows_;
     }
-    ssize_t w = write(pidfd, buf, sx - buf);
-    if (w != ssize_t(sx - buf) || ftruncate(pidfd, w) != 0) {
-        perror_die(pidfilename);
+    void resize(int cols, int rows);
+    void feed(const unsigned char* first, const unsigned char* last);
+    std::string snapshot() const;
+
+  private:
+    typedef std::vector<vtcell> line;
+    struct cursor {
+        int x = 0;
+        int y = 0;
+        vtcell pen;
+        bool wrapnext = false;
+        bool origin = false;
+        int gl = 0;             // 0: G0 in use, 1: G1 (after SO)
+        char g[2] = {'B', 'B'};
+    };
+
+    int cols_;
+    int rows_;
+    std::vector<line> screens_[2];
+    bool alt_ = false;
+    cursor cur_;
+    cursor saved_[2];
+    int top_ = 0;
+    int bot_;
+    bool autowrap_ = true;
+    bool insert_ = false;
+    bool cursor_visible_ = true;
+    std::vector<int> modes_;    // other DEC private modes that are set
+    std::vector<bool> tabs_;
+    char32_t last_ = ' ';       // last printed character, for REP
+
+    enum { s_ground, s_esc, s_esc_inter, s_csi, s_string, s_string_esc };
+    int state_ = s_ground;
+    std::string params_;
+    char inter_ = 0;
+
+    std::vector<line>& lines() {
+        return screens_[alt_];
+    }
+    vtcell blank() const;
+    void reset();
+    void print(char32_t ch);
+    void execute(unsigned char ch);
+    void esc_dispatch(unsigned char ch);
+    void csi_dispatch(unsigned char ch);
+    void set_mode(bool priv, int mode, bool on);
+    void sgr(const std::vector<int>& p);
+    void move_to(int x, int y);
+    void linefeed();
+    void reverse_index();
+    void scroll_up(int n);
+    void scroll_down(int n);
+    void erase(int y, int x0, int x1);
+    void fix_wide(int y, int x);
+    void split_wide(int y, int x);
+    void insert_blanks(int y, int x, int n);
+    void switch_screen(bool alt, bool clear);
+    void render_lines(std::string& out, const std::vector<line>& ls) const;
+    static bool saveable(const cursor& c);
+    void render_saved(std::string& out, const cursor& c, const line& l,
+                      const char* save) const;
+};
+
+static void append_utf8(std::string& s, char32_t ch) {
+    if (ch < 0x80) {
+        s += char(ch);
+    } else if (ch < 0x800) {
+        s += char(0xC0 | (ch >> 6));
+        s += char(0x80 | (ch & 0x3F));
+    } else if (ch < 0x10000) {
+        s += char(0xE0 | (ch >> 12));
+        s += char(0x80 | ((ch >> 6) & 0x3F));
+        s += char(0x80 | (ch & 0x3F));
+    } else {
+        s += char(0xF0 | (ch >> 18));
+        s += char(0x80 | ((ch >> 12) & 0x3F));
+        s += char(0x80 | ((ch >> 6) & 0x3F));
+        s += char(0x80 | (ch & 0x3F));
     }
 }
 
-static struct timeval timer_add_delay(struct timeval tv, double delay) {
-    struct timeval delta;
-    double sec, usec;
-    usec = modf(delay, &sec);
-    delta.tv_sec = (long) sec;
-    delta.tv_usec = (long) (usec * 1'000'000);
-    timeradd(&tv, &delta, &tv);
-    return tv;
+// Decode the UTF-8 character at `p`. Invalid bytes decode as U+FFFD, one
+// at a time.
+static const unsigned char* decode_utf8(const unsigned char* p,
+                                        const unsigned char* last,
+                                        char32_t& ch) {
+    unsigned char c = *p;
+    int n = c < 0xC2 ? 0 : (c < 0xE0 ? 1 : (c < 0xF0 ? 2 : (c < 0xF5 ? 3 : 0)));
+    if (n == 0 || last - p <= n) {
+        ch = 0xFFFD;
+        return p + 1;
+    }
+    char32_t x = c & (0x3F >> n);
+    for (int i = 1; i <= n; ++i) {
+        if ((p[i] & 0xC0) != 0x80) {
+            ch = 0xFFFD;
+            return p + 1;
+        }
+        x = (x << 6) | (p[i] & 0x3F);
+    }
+    if ((n == 2 && (x < 0x800 || (x >= 0xD800 && x <= 0xDFFF)))
+        || (n == 3 && (x < 0x10000 || x > 0x10FFFF))) {
+        ch = 0xFFFD;
+        return p + 1;
+    }
+    ch = x;
+    return p + n + 1;
 }
 
-static int timer_difference_ms(const struct timeval& lhs, struct timeval rhs) {
-    timersub(&lhs, &rhs, &rhs);
-    return rhs.tv_sec * 1000 + rhs.tv_usec / 1000;
+// Columns a character occupies: 0 for combining marks, 2 for East Asian
+// wide characters and emoji.
+static int vt_char_width(char32_t ch) {
+    if (ch < 0x300) {
+        return 1;
+    } else if ((ch <= 0x36F)
+               || (ch >= 0x483 && ch <= 0x489)
+               || (ch >= 0x591 && ch <= 0x5BD)
+               || (ch >= 0x200B && ch <= 0x200F)
+               || (ch >= 0x20D0 && ch <= 0x20FF)
+               || (ch >= 0xFE00 && ch <= 0xFE0F)
+               || (ch >= 0xFE20 && ch <= 0xFE2F)
+               || (ch >= 0xE0100 && ch <= 0xE01EF)) {
+        return 0;
+    } else if ((ch >= 0x1100 && ch <= 0x115F)
+               || (ch >= 0x2E80 && ch <= 0x303E)
+               || (ch >= 0x3041 && ch <= 0x33FF)
+               || (ch >= 0x3400 && ch <= 0x4DBF)
+               || (ch >= 0x4E00 && ch <= 0x9FFF)
+               || (ch >= 0xA000 && ch <= 0xA4CF)
+               || (ch >= 0xAC00 && ch <= 0xD7A3)
+               || (ch >= 0xF900 && ch <= 0xFAFF)
+               || (ch >= 0xFE30 && ch <= 0xFE4F)
+               || (ch >= 0xFF00 && ch <= 0xFF60)
+               || (ch >= 0xFFE0 && ch <= 0xFFE6)
+               || (ch >= 0x1F300 && ch <= 0x1F64F)
+               || (ch >= 0x1F900 && ch <= 0x1F9FF)
+               || (ch >= 0x20000 && ch <= 0x3FFFD)) {
+        return 2;
+    } else {
+        return 1;
+    }
 }
 
-void jailownerinfo::set_timeout(double timeout, double idle_timeout) {
-    this->timeout_ = timeout;
-    this->idle_timeout_ = idle_timeout;
+// DEC special graphics for 0x5F-0x7E.
+static const char32_t vt_line_drawing[] = {
+    0x20, 0x25C6, 0x2592, 0x2409, 0x240C, 0x240D, 0x240A, 0xB0,
+    0xB1, 0x2424, 0x240B, 0x2518, 0x2510, 0x250C, 0x2514, 0x253C,
+    0x23BA, 0x23BB, 0x2500, 0x23BC, 0x23BD, 0x251C, 0x2524, 0x2534,
+    0x252C, 0x2502, 0x2264, 0x2265, 0x3C0, 0x2260, 0xA3, 0xB7
+};
+
+vtscreen::vtscreen(int cols, int rows)
+    : cols_(cols), rows_(rows), bot_(rows - 1) {
+    reset();
 }
 
-void jailownerinfo::set_foreground(bool foreground) {
-    this->foreground_ = foreground;
+void vtscreen::reset() {
+    cur_ = cursor();
+    saved_[0] = saved_[1] = cursor();
+    alt_ = false;
+    for (auto& ls : screens_) {
+        ls.assign(rows_, line(cols_, vtcell()));
+    }
+    top_ = 0;
+    bot_ = rows_ - 1;
+    autowrap_ = true;
+    insert_ = false;
+    cursor_visible_ = true;
+    modes_.clear();
+    tabs_.assign(cols_, false);
+    for (int x = 8; x < cols_; x += 8) {
+        tabs_[x] = true;
+    }
 }
 
-void jailownerinfo::exec(int argc, char** argv, jaildirinfo& jaildir) {
-    // adjust environment; make sure we have a PATH
-    char homebuf[8192];
-    sprintf(homebuf, "HOME=%s", owner_home_.c_str());
-    const char* path = "PATH=/usr/local/bin:/bin:/usr/bin";
-    const char* lang = "LANG=C";
-    const char* term = nullptr;
-    const char* ld_library_path = nullptr;
-    {
-        extern char** environ;
-        for (char** eptr = environ; *eptr; ++eptr) {
-            if (strncmp(*eptr, "PATH=", 5) == 0) {
-                path = *eptr;
-            } else if (strncmp(*eptr, "LANG=", 5) == 0) {
-                lang = *eptr;
-            } else if (strncmp(*eptr, "TERM=", 5) == 0) {
-                term = *eptr;
-            } else if (strncmp(*eptr, "LD_LIBRARY_PATH=", 16) == 0) {
-                ld_library_path = *eptr;
+// Erased cells take the current background color, as in xterm.
+vtcell vtscreen::blank() const {
+    vtcell c;
+    c.bg = cur_.pen.bg;
+    return c;
+}
+
+void vtscreen::resize(int cols, int rows) {
+    if (cols == cols_ && rows == rows_) {
+        return;
+    }
+    for (int s = 0; s != 2; ++s) {
+        auto& ls = screens_[s];
+        // when shrinking, drop lines above the cursor first
+        int cy = s == alt_ ? cur_.y : 0;
+        int drop = std::min(std::max(cy - rows + 1, 0), rows_ - rows);
+        if (drop > 0) {
+            ls.erase(ls.begin(), ls.begin() + drop);
+        }
+        ls.resize(rows, line(cols, vtcell()));
+        for (auto& l : ls) {
+            l.resize(cols, vtcell());
+            // a wide character can't start in the last column
+            if (l.back().ch != 0 && vt_char_width(l.back().ch) == 2) {
+                l.back() = vtcell();
             }
         }
+        if (s == alt_) {
+            cur_.y = std::max(cur_.y - std::max(drop, 0), 0);
+        }
     }
-    newenv_.push_back(path);
-    newenv_.push_back(lang);
-    if (term) {
-        newenv_.push_back(term);
-    }
-    if (ld_library_path) {
-        newenv_.push_back(ld_library_path);
+    tabs_.resize(cols, false);
+    for (int x = (cols_ + 7) & ~7; x < cols; x += 8) {
+        tabs_[x] = true;
     }
-    newenv_.push_back(homebuf);
-    while (argc > 0) {
-        const char* arg = argv[0];
-        const char* argpos = arg;
-        while (*argpos && (isalnum((unsigned char) *argpos) || *argpos == '_')) {
-            ++argpos;
-        }
-        if (arg == argpos || *argpos != '=') {
-            break;
-        }
-        std::vector<const char*>::size_type i = 0;
-        while (i < newenv_.size() && strncmp(newenv_[i], arg, argpos - arg) != 0) {
-            ++i;
-        }
-        if (i < newenv_.size()) {
-            newenv_[i] = arg;
-        } else {
-            newenv_.push_back(arg);
-        }
-        --argc, ++argv;
+    cols_ = cols;
+    rows_ = rows;
+    top_ = 0;
+    bot_ = rows - 1;
+    cur_.x = std::min(cur_.x, cols - 1);
+    cur_.y = std::min(cur_.y, rows - 1);
+    cur_.wrapnext = false;
+    for (auto& sc : saved_) {
+        sc.x = std::min(sc.x, cols - 1);
+        sc.y = std::min(sc.y, rows - 1);
+        sc.wrapnext = false;
     }
-    newenv_.push_back(nullptr);
+}
 
-    // create command
-    delete[] argv_;
-    argv_ = new char*[5 + argc];
-    if (!argv_) {
-        die("Out of memory\n");
-    }
-    int newargvpos = 0;
-    std::string command;
-    argv_[newargvpos++] = (char*) owner_sh_.c_str();
-    argv_[newargvpos++] = (char*) "-l";
-    if (argc == 0) {
-        // just a login shell
-    } else {
-        argv_[newargvpos++] = (char*) "-c";
-        if (argc == 1) {
-            command = argv[0];
-        } else {
-            command = shell_quote(argv[0]);
-            for (int i = 0; i < argc; ++i) {
-                command += std::string(" ") + shell_quote(argv[i]);
+void vtscreen::feed(const unsigned char* first, const unsigned char* last) {
+    while (first != last) {
+        unsigned char ch = *first;
+        if (state_ == s_ground && ch >= 0x20) {
+            char32_t c = ch;
+            if (ch >= 0x80) {
+                first = decode_utf8(first, last, c);
+            } else {
+                ++first;
+                if (ch == 0x7F) {
+                    continue;
+                }
+                if (cur_.g[cur_.gl] == '0' && ch >= 0x5F) {
+                    c = vt_line_drawing[ch - 0x5F];
+                }
+            }
+            print(c);
+            continue;
+        }
+        ++first;
+        if (ch == 0x18 || ch == 0x1A) {
+            // CAN, SUB: abandon any sequence
+            state_ = s_ground;
+        } else if (ch == 0x1B) {
+            state_ = state_ == s_string ? s_string_esc : s_esc;
+            params_.clear();
+            inter_ = 0;
+        } else if (state_ == s_string || state_ == s_string_esc) {
+            // OSC, DCS, and friends end with BEL or ST
+            if (ch == 0x07 || (state_ == s_string_esc && ch == '\\')) {
+                state_ = s_ground;
+            } else {
+                state_ = s_string;
+            }
+        } else if (ch < 0x20) {
+            execute(ch);
+        } else if (state_ == s_esc || state_ == s_esc_inter) {
+            if (ch >= 0x20 && ch <= 0x2F) {
+                inter_ = ch;
+                state_ = s_esc_inter;
+            } else if (ch == '[' && state_ == s_esc) {
+                state_ = s_csi;
+            } else if ((ch == ']' || ch == 'P' || ch == 'X' || ch == '^' || ch == '_')
+                       && state_ == s_esc) {
+                state_ = s_string;
+            } else {
+                state_ = s_ground;
+                esc_dispatch(ch);
+            }
+        } else if (state_ == s_csi) {
+            if (ch >= 0x40 && ch <= 0x7E) {
+                state_ = s_ground;
+                csi_dispatch(ch);
+            } else if (ch >= 0x20 && ch <= 0x2F) {
+                inter_ = ch;
+            } else if (params_.size() < 64) {
+                params_ += char(ch);
             }
         }
-        argv_[newargvpos++] = const_cast<char*>(command.c_str());
     }
-    argv_[newargvpos++] = nullptr;
+}
 
-    // store other arguments
-    this->jaildir_ = &jaildir;
-    gettimeofday(&this->start_time_, nullptr);
-    if (this->timeout_ > 0) {
-        this->expiry_ = timer_add_delay(this->start_time_, this->timeout_);
-    } else {
-        timerclear(&this->expiry_);
-    }
-    if (this->idle_timeout_ > 0) {
-        this->active_time_ = this->start_time_;
-        this->idle_expiry_ = timer_add_delay(this->active_time_, this->idle_timeout_);
+void vtscreen::print(char32_t ch) {
+    int w = vt_char_width(ch);
+    if (w == 0) {
+        return;
     }
-
-    // enter the jail
-#if __linux__
-    char* new_stack = (char*) malloc(256 * 1024);
-    if (!new_stack) {
-        die("Out of memory\n");
+    if (cur_.wrapnext && autowrap_) {
+        cur_.x = 0;
+        linefeed();
     }
-    if (verbose) {
-        fprintf(verbosefile, "-clone-\n");
+    cur_.wrapnext = false;
+    if (w == 2 && cur_.x == cols_ - 1) {
+        if (!autowrap_ || cols_ < 2) {
+            return;
+        }
+        erase(cur_.y, cur_.x, cols_);
+        cur_.x = 0;
+        linefeed();
     }
-    int child;
-    if (!dryrun) {
-        child = clone(exec_clone_function, new_stack + 256 * 1024,
-                      CLONE_NEWIPC | CLONE_NEWNS | CLONE_NEWPID | SIGCHLD, this);
-    } else {
-        exec_clone_function(this);
-        exit(0);
+    if (insert_) {
+        insert_blanks(cur_.y, cur_.x, w);
     }
-    if (child == -1) {
-        perror_die("clone");
+    line& l = lines()[cur_.y];
+    fix_wide(cur_.y, cur_.x);
+    if (w == 2) {
+        fix_wide(cur_.y, cur_.x + 1);
     }
-#else
-    int child = fork();
-    if (child == 0) {
-        exit(exec_go());
+    l[cur_.x] = cur_.pen;
+    l[cur_.x].ch = ch;
+    if (w == 2) {
+        l[cur_.x + 1] = cur_.pen;
+        l[cur_.x + 1].ch = 0;
     }
-#endif
-    if (child == -1) {
-        perror_die("fork");
+    last_ = ch;
+    cur_.x += w;
+    if (cur_.x >= cols_) {
+        cur_.x = cols_ - 1;
+        cur_.wrapnext = autowrap_;
     }
-    write_pid(child);
-
-    // we don't need file descriptors any more
-    close(STDIN_FILENO);
-    close(STDOUT_FILENO);
-    close(STDERR_FILENO);
+}
 
-    int exit_status = 0;
-    if (foreground_) {
-        int r = setresgid(caller_group, caller_group, caller_group);
-        (void) r;
-        r = setresuid(caller_owner, caller_owner, caller_owner);
-        (void) r;
+// About to overwrite cell (`x`, `y`): don't leave half a wide character.
+void vtscreen::fix_wide(int y, int x) {
+    split_wide(y, x);
+    split_wide(y, x + 1);
+}
 
-        exit_status = x_waitpid(child, 0).second;
+// About to separate cells `x - 1` and `x` of row `y`: blank a wide
+// character that spans them.
+void vtscreen::split_wide(int y, int x) {
+    line& l = lines()[y];
+    if (x > 0 && x < cols_ && l[x].ch == 0) {
+        l[x - 1] = vtcell();
+        l[x] = vtcell();
+    }
+}
 
-        if (ttyfd_ >= 0) {
-            tcsetattr(ttyfd_, TCSANOW, &ttyfd_termios_);
-        }
-    } else {
-        pidfd = -1;
+void vtscreen::insert_blanks(int y, int x, int n) {
+    line& l = lines()[y];
+    split_wide(y, x);
+    l.insert(l.begin() + x, n, blank());
+    l.resize(cols_);
+    if (l.back().ch != 0 && vt_char_width(l.back().ch) == 2) {
+        l.back() = blank();
     }
-    exit(exit_status);
 }
 
-int jailownerinfo::exec_go() {
-    std::string jdir = jaildir_->dir;
-    assert(jdir.back() == '/');
-    std::string unmounted_jdir = unmounted(jdir);
-    if (unmounted_jdir.back() != '/') {
-        unmounted_jdir += '/';
+void vtscreen::execute(unsigned char ch) {
+    if (ch == '\b') {
+        cur_.x = std::max(cur_.x - 1, 0);
+        cur_.wrapnext = false;
+    } else if (ch == '\t') {
+        int x = cur_.x + 1;
+        while (x < cols_ - 1 && !tabs_[x]) {
+            ++x;
+        }
+        cur_.x = std::min(x, cols_ - 1);
+    } else if (ch == '\n' || ch == '\v' || ch == '\f') {
+        linefeed();
+    } else if (ch == '\r') {
+        cur_.x = 0;
+        cur_.wrapnext = false;
+    } else if (ch == 0x0E || ch == 0x0F) {
+        cur_.gl = ch == 0x0E;
     }
+}
 
-#if __linux__
-    mount_status = 2;
+void vtscreen::esc_dispatch(unsigned char ch) {
+    if (inter_ == '(' || inter_ == ')') {
+        cur_.g[inter_ == ')'] = ch == '0' ? '0' : 'B';
+    } else if (inter_ == '#' && ch == '8') {
+        // DECALN: fill the screen with E
+        for (auto& l : lines()) {
+            for (auto& c : l) {
+                c = vtcell();
+                c.ch = 'E';
+            }
+        }
+        move_to(0, 0);
+    } else if (inter_ != 0) {
+        /* ignore */
+    } else if (ch == '7') {
+        saved_[alt_] = cur_;
+    } else if (ch == '8') {
+        cur_ = saved_[alt_];
+    } else if (ch == 'D') {
+        linefeed();
+    } else if (ch == 'E') {
+        cur_.x = 0;
+        linefeed();
+    } else if (ch == 'M') {
+        reverse_index();
+    } else if (ch == 'H') {
+        tabs_[cur_.x] = true;
+    } else if (ch == 'c') {
+        reset();
+    }
+}
 
-    std::string parent_mnt = jdir + "mnt/.parent";
-    std::string unmounted_parent_mnt = unmounted_jdir + "mnt/.parent";
-    if (v_ensuredir(unmounted_parent_mnt, 0777, true) < 0) {
-        perror_die("mkdir -p " + unmounted_parent_mnt);
+void vtscreen::csi_dispatch(unsigned char ch) {
+    char priv = 0;
+    const char* s = params_.c_str();
+    if (*s == '?' || *s == '>' || *s == '<' || *s == '=') {
+        priv = *s++;
+    }
+    std::vector<int> p;
+    while (*s) {
+        char* end;
+        long v = strtol(s, &end, 10);
+        p.push_back(end == s ? -1 : int(std::min(v, 65535L)));
+        s = *end ? end + 1 : end;
+    }
+    if (!params_.empty() && (params_.back() == ';' || params_.back() == ':')) {
+        p.push_back(-1);
+    }
+    auto arg = [&p] (size_t i, int dflt) {
+        return i < p.size() && p[i] > 0 ? p[i] : dflt;
+    };
+    int n = arg(0, 1);
+    if (priv == '?' && (ch == 'h' || ch == 'l')) {
+        for (int m : p) {
+            set_mode(true, m, ch == 'h');
+        }
+        return;
+    } else if (priv != 0 || (inter_ != 0 && !(inter_ == '!' && ch == 'p'))) {
+        return;
+    }
+    int top = cur_.origin ? top_ : 0;
+    int bot = cur_.origin ? bot_ : rows_ - 1;
+    switch (ch) {
+    case 'A':
+        move_to(cur_.x, std::max(cur_.y - n, cur_.y >= top_ ? top_ : 0));
+        break;
+    case 'B':
+        move_to(cur_.x, std::min(cur_.y + n, cur_.y <= bot_ ? bot_ : rows_ - 1));
+        break;
+    case 'C':
+    case 'a':
+        move_to(cur_.x + n, cur_.y);
+        break;
+    case 'D':
+        move_to(cur_.x - n, cur_.y);
+        break;
+    case 'E':
+        move_to(0, std::min(cur_.y + n, cur_.y <= bot_ ? bot_ : rows_ - 1));
+        break;
+    case 'F':
+        move_to(0, std::max(cur_.y - n, cur_.y >= top_ ? top_ : 0));
+        break;
+    case 'G':
+    case '`':
+        move_to(n - 1, cur_.y);
+        break;
+    case 'd':
+        move_to(cur_.x, std::min(top + n - 1, bot));
+        break;
+    case 'H':
+    case 'f':
+        move_to(arg(1, 1) - 1, std::min(top + n - 1, bot));
+        break;
+    case 'I':
+        for (int i = 0; i != n; ++i) {
+            execute('\t');
+        }
+        break;
+    case 'Z':
+        for (int i = 0; i != n && cur_.x > 0; ++i) {
+            do {
+                --cur_.x;
+            } while (cur_.x > 0 && !tabs_[cur_.x]);
+        }
+        cur_.wrapnext = false;
+        break;
+    case 'J': {
+        int mode = arg(0, 0);
+        if (mode == 0) {
+            erase(cur_.y, cur_.x, cols_);
+            for (int y = cur_.y + 1; y < rows_; ++y) {
+                erase(y, 0, cols_);
+            }
+        } else if (mode == 1) {
+            for (int y = 0; y < cur_.y; ++y) {
+                erase(y, 0, cols_);
+            }
+            erase(cur_.y, 0, cur_.x + 1);
+        } else {
+            for (int y = 0; y < rows_; ++y) {
+                erase(y, 0, cols_);
+            }
+        }
+        break;
+    }
+    case 'K': {
+        int mode = arg(0, 0);
+        erase(cur_.y, mode == 0 ? cur_.x : 0, mode == 1 ? cur_.x + 1 : cols_);
+        break;
+    }
+    case 'X':
+        erase(cur_.y, cur_.x, std::min(cur_.x + n, cols_));
+        break;
+    case '@':
+    case 'P': {
+        line& l = lines()[cur_.y];
+        n = std::min(n, cols_ - cur_.x);
+        if (ch == '@') {
+            insert_blanks(cur_.y, cur_.x, n);
+        } else {
+            split_wide(cur_.y, cur_.x);
+            split_wide(cur_.y, cur_.x + n);
+            l.erase(l.begin() + cur_.x, l.begin() + cur_.x + n);
+            l.resize(cols_, blank());
+        }
+        cur_.wrapnext = false;
+        break;
+    }
+    case 'L':
+    case 'M':
+        if (cur_.y >= top_ && cur_.y <= bot_) {
+            int save = top_;
+            top_ = cur_.y;
+            ch == 'L' ? scroll_down(n) : scroll_up(n);
+            top_ = save;
+            cur_.wrapnext = false;
+        }
+        break;
+    case 'S':
+        scroll_up(n);
+        break;
+    case 'T':
+        if (p.size() <= 1) {
+            scroll_down(n);
+        }
+        break;
+    case 'b':
+        for (int i = 0; i != std::min(n, cols_ * rows_); ++i) {
+            print(last_);
+        }
+        break;
+    case 'g':
+        if (arg(0, 0) == 0) {
+            tabs_[cur_.x] = false;
+        } else if (arg(0, 0) == 3) {
+            tabs_.assign(cols_, false);
+        }
+        break;
+    case 'h':
+    case 'l':
+        for (int m : p) {
+            set_mode(false, m, ch == 'h');
+        }
+        break;
+    case 'm':
+        sgr(p);
+        break;
+    case 'r': {
+        int t = arg(0, 1) - 1, b = std::min(arg(1, rows_), rows_) - 1;
+        if (t < b) {
+            top_ = t;
+            bot_ = b;
+            move_to(0, cur_.origin ? top_ : 0);
+        }
+        break;
+    }
+    case 's':
+        saved_[alt_] = cur_;
+        break;
+    case 'u':
+        cur_ = saved_[alt_];
+        break;
+    case 'p':
+        if (inter_ != '!') {
+            break;
+        }
+        // DECSTR soft reset
+        top_ = 0;
+        bot_ = rows_ - 1;
+        autowrap_ = true;
+        insert_ = false;
+        cursor_visible_ = true;
+        cur_.pen = vtcell();
+        cur_.origin = false;
+        cur_.gl = 0;
+        cur_.g[0] = cur_.g[1] = 'B';
+        saved_[alt_] = cursor();
+        break;
     }
+}
 
-    // ensure we truly have a private mount namespace: no shared mounts
-    // (some Linux distros, such as Ubuntu 15.10, have / a shared mount
-    // by default, which means mount changes propagate despite CLONE_NEWNS.
-    // This undoes the shared mount)
-    if (verbose) {
-        fprintf(verbosefile, "mount --make-rslave /\n");
+void vtscreen::set_mode(bool priv, int mode, bool on) {
+    if (!priv) {
+        if (mode == 4) {
+            insert_ = on;
+        }
+    } else if (mode == 6) {
+        cur_.origin = on;
+        move_to(0, on ? top_ : 0);
+    } else if (mode == 7) {
+        autowrap_ = on;
+    } else if (mode == 25) {
+        cursor_visible_ = on;
+    } else if (mode == 47 || mode == 1047) {
+        switch_screen(on, mode == 1047 && !on);
+    } else if (mode == 1048) {
+        if (on) {
+            saved_[0] = cur_;
+        } else {
+            cur_ = saved_[0];
+        }
+    } else if (mode == 1049) {
+        if (on && !alt_) {
+            saved_[0] = cur_;
+            switch_screen(true, false);
+            for (int y = 0; y < rows_; ++y) {
+                erase(y, 0, cols_);
+            }
+        } else if (!on && alt_) {
+            switch_screen(false, false);
+            cur_ = saved_[0];
+        }
+    } else if (mode > 0) {
+        auto it = std::find(modes_.begin(), modes_.end(), mode);
+        if (on && it == modes_.end()) {
+            modes_.push_back(mode);
+        } else if (!on && it != modes_.end()) {
+            modes_.erase(it);
+        }
     }
-    if (mount("none", "/", nullptr, MS_REC | MS_SLAVE, nullptr) != 0) {
-        perror_die("mount --make-rslave /");
+}
+
+void vtscreen::switch_screen(bool alt, bool clear) {
+    if (clear && alt_) {
+        for (int y = 0; y < rows_; ++y) {
+            erase(y, 0, cols_);
+        }
     }
+    alt_ = alt;
+}
 
-    populate_mount_table();     // ensure we know how to mount /proc
-    for (size_t i = 0; i != delayed_mounts.size(); i += 2) {
-        handle_mount(delayed_mounts[i], delayed_mounts[i+1], true);
+static bool sgr_color(const std::vector<int>& p, size_t& i, uint32_t& color) {
+    if (i + 2 < p.size() && p[i + 1] == 5) {
+        color = vtcolor_index | (p[i + 2] & 255);
+        i += 2;
+        return true;
+    } else if (i + 4 < p.size() && p[i + 1] == 2) {
+        color = vtcolor_rgb | ((p[i + 2] & 255) << 16) | ((p[i + 3] & 255) << 8) | (p[i + 4] & 255);
+        i += 4;
+        return true;
+    }
+    return false;
+}
+
+void vtscreen::sgr(const std::vector<int>& p) {
+    vtcell& pen = cur_.pen;
+    if (p.empty()) {
+        pen = vtcell();
+    }
+    for (size_t i = 0; i < p.size(); ++i) {
+        int v = std::max(p[i], 0);
+        if (v == 0) {
+            pen = vtcell();
+        } else if (v <= 9) {
+            pen.attr |= 1 << v;
+        } else if (v == 21 || v == 22) {
+            pen.attr &= ~((1 << 1) | (1 << 2));
+        } else if (v >= 23 && v <= 29) {
+            pen.attr &= ~(1 << (v - 20));
+        } else if (v >= 30 && v <= 37) {
+            pen.fg = vtcolor_index | (v - 30);
+        } else if (v == 38) {
+            sgr_color(p, i, pen.fg);
+        } else if (v == 39) {
+            pen.fg = 0;
+        } else if (v >= 40 && v <= 47) {
+            pen.bg = vtcolor_index | (v - 40);
+        } else if (v == 48) {
+            sgr_color(p, i, pen.bg);
+        } else if (v == 49) {
+            pen.bg = 0;
+        } else if (v >= 90 && v <= 97) {
+            pen.fg = vtcolor_index | (v - 90 + 8);
+        } else if (v >= 100 && v <= 107) {
+            pen.bg = vtcolor_index | (v - 100 + 8);
+        }
     }
-    handle_mount("/proc", jdir + "proc", true);
-    handle_mount("/dev/pts", jdir + "dev/pts", true);
-    handle_mount("/tmp", jdir + "tmp", true);
-    handle_mount("/run", jdir + "run", true);
-#endif
+}
 
-    // chroot
-#if __linux__
-    if (unmounted_jdir == jdir) {
-        if (verbose) {
-            fprintf(verbosefile, "mount --bind %s\n", jdir.c_str());
+void vtscreen::move_to(int x, int y) {
+    cur_.x = std::max(std::min(x, cols_ - 1), 0);
+    cur_.y = std::max(std::min(y, rows_ - 1), 0);
+    cur_.wrapnext = false;
+}
+
+void vtscreen::linefeed() {
+    if (cur_.y == bot_) {
+        scroll_up(1);
+    } else if (cur_.y < rows_ - 1) {
+        ++cur_.y;
+    }
+    cur_.wrapnext = false;
+}
+
+void vtscreen::reverse_index() {
+    if (cur_.y == top_) {
+        scroll_down(1);
+    } else if (cur_.y > 0) {
+        --cur_.y;
+    }
+    cur_.wrapnext = false;
+}
+
+void vtscreen::scroll_up(int n) {
+    auto& ls = lines();
+    n = std::min(n, bot_ - top_ + 1);
+    std::rotate(ls.begin() + top_, ls.begin() + top_ + n, ls.begin() + bot_ + 1);
+    for (int y = bot_ - n + 1; y <= bot_; ++y) {
+        erase(y, 0, cols_);
+    }
+}
+
+void vtscreen::scroll_down(int n) {
+    auto& ls = lines();
+    n = std::min(n, bot_ - top_ + 1);
+    std::rotate(ls.begin() + top_, ls.begin() + bot_ + 1 - n, ls.begin() + bot_ + 1);
+    for (int y = top_; y < top_ + n; ++y) {
+        erase(y, 0, cols_);
+    }
+}
+
+void vtscreen::erase(int y, int x0, int x1) {
+    line& l = lines()[y];
+    if (x0 < x1) {
+        split_wide(y, x0);
+        split_wide(y, x1);
+        std::fill(l.begin() + x0, l.begin() + x1, blank());
+    }
+}
+
+static void append_sgr(std::string& out, const vtcell& c) {
+    out += "\x1b[0";
+    for (int v = 1; v <= 9; ++v) {
+        if (c.attr & (1 << v)) {
+            out += ';';
+            out += char('0' + v);
+        }
+    }
+    char buf[32];
+    for (int bg = 0; bg != 2; ++bg) {
+        uint32_t color = bg ? c.bg : c.fg;
+        int idx = color & 0xFFFFFF;
+        if (color >= vtcolor_rgb) {
+            sprintf(buf, ";%d;2;%d;%d;%d", bg ? 48 : 38, idx >> 16, (idx >> 8) & 255, idx & 255);
+        } else if (color >= vtcolor_index && idx < 8) {
+            sprintf(buf, ";%d", (bg ? 40 : 30) + idx);
+        } else if (color >= vtcolor_index && idx < 16) {
+            sprintf(buf, ";%d", (bg ? 100 : 90) + idx - 8);
+        } else if (color >= vtcolor_index) {
+            sprintf(buf, ";%d;5;%d", bg ? 48 : 38, idx);
+        } else {
+            continue;
         }
-        if (!dryrun
-            && mount(jdir.c_str(), jdir.c_str(), nullptr, MS_BIND | MS_REC, nullptr) != 0) {
-            perror_die("mount --bind " + jdir);
+        out += buf;
+    }
+    out += 'm';
+}
+
+void vtscreen::render_lines(std::string& out, const std::vector<line>& ls) const {
+    char buf[32];
+    vtcell style;
+    out += "\x1b[0m";
+    for (int y = 0; y != rows_; ++y) {
+        const line& l = ls[y];
+        int end = cols_;
+        while (end > 0 && l[end - 1].ch == ' ' && l[end - 1].same_style(vtcell())) {
+            --end;
+        }
+        if (end == 0) {
+            continue;
+        }
+        sprintf(buf, "\x1b[%dH", y + 1);
+        out += buf;
+        for (int x = 0; x != end; ++x) {
+            if (l[x].ch == 0) {
+                continue;
+            }
+            if (!l[x].same_style(style)) {
+                append_sgr(out, l[x]);
+                style = l[x];
+            }
+            append_utf8(out, l[x].ch);
         }
     }
-    if (verbose) {
-        fprintf(verbosefile, "pivot_root %s %s\n", jdir.c_str(), parent_mnt.c_str());
+}
+
+// Return whether a saved cursor differs from a reset terminal's.
+bool vtscreen::saveable(const cursor& c) {
+    return c.x != 0 || c.y != 0 || c.wrapnext || c.origin || c.gl != 0
+        || c.g[0] != 'B' || c.g[1] != 'B' || !c.pen.same_style(vtcell());
+}
+
+// Output `save`, which saves the cursor, with cursor `c` on row `l`, then
+// reset DECOM and the character sets. The scroll region must be the whole
+// screen, so DECOM can reach any row. A pending wrap is set by reprinting
+// the character before the cursor.
+void vtscreen::render_saved(std::string& out, const cursor& c, const line& l,
+                            const char* save) const {
+    char buf[64];
+    int wx = l[c.x].ch == 0 ? c.x - 1 : c.x;
+    bool wrap = c.wrapnext && wx >= 0;
+    sprintf(buf, "%s\x1b[%d;%dH", c.origin ? "\x1b[?6h" : "", c.y + 1, (wrap ? wx : c.x) + 1);
+    out += buf;
+    if (wrap) {
+        append_sgr(out, l[wx]);
+        append_utf8(out, l[wx].ch);
+    }
+    append_sgr(out, c.pen);
+    for (int g = 0; g != 2; ++g) {
+        if (c.g[g] == '0') {
+            out += g ? "\x1b)0" : "\x1b(0";
+        }
+    }
+    if (c.gl) {
+        out += "\x0e";
+    }
+    out += save;
+    if (c.origin) {
+        out += "\x1b[?6l";
+    }
+    if (c.g[0] == '0' || c.g[1] == '0' || c.gl) {
+        out += "\x1b(B\x1b)B\x0f";
     }
-    if (!dryrun
-        && syscall(SYS_pivot_root, jdir.c_str(), parent_mnt.c_str()) != 0) {
-        perror_die("pivot_root " + jdir + " " + parent_mnt);
+}
+
+// Return output that draws this screen on a freshly reset terminal of the
+// same size and leaves it in the same state.
+std::string vtscreen::snapshot() const {
+    std::string out = "\x1b" "c";
+    char buf[64];
+    render_lines(out, screens_[0]);
+    if (!alt_ && saveable(saved_[1])) {
+        // the alternate screen's saved cursor; its contents are cleared
+        // when it is next shown. Switching saves a default main cursor.
+        out += "\x1b[H\x1b[0m\x1b[?1049h";
+        render_saved(out, saved_[1], screens_[1][saved_[1].y], "\x1b" "7");
+        out += "\x1b[?1049l";
+    }
+    if (alt_) {
+        // switching saves the main screen's cursor and clears the
+        // alternate screen in that cursor's colors
+        render_saved(out, saved_[0], screens_[0][saved_[0].y], "\x1b[?1049h");
+        out += "\x1b[0m\x1b[2J";
+        render_lines(out, screens_[1]);
+    }
+    bool default_tabs = true;
+    for (int x = 0; x != cols_; ++x) {
+        default_tabs = default_tabs && tabs_[x] == (x != 0 && x % 8 == 0);
+    }
+    if (!default_tabs) {
+        out += "\x1b[3g";
+        for (int x = 0; x != cols_; ++x) {
+            if (tabs_[x]) {
+                sprintf(buf, "\x1b[1;%dH\x1bH", x + 1);
+                out += buf;
+            }
+        }
     }
-    if (verbose) {
-        fprintf(verbosefile, "cd /\n");
+    // the saved cursor, while the scroll region is still the whole screen
+    const cursor& sc = saved_[alt_];
+    if (saveable(sc)) {
+        render_saved(out, sc, screens_[alt_][sc.y], "\x1b" "7");
+    }
+    if (top_ != 0 || bot_ != rows_ - 1) {
+        sprintf(buf, "\x1b[%d;%dr", top_ + 1, bot_ + 1);
+        out += buf;
+    }
+    for (int m : modes_) {
+        sprintf(buf, "\x1b[?%dh", m);
+        out += buf;
+    }
+    // DECOM makes rows relative to the scroll region, so it can't reach
+    // a cursor that DECRC left outside the region; keep the position
+    bool origin = false;
+    auto position = [&] (const cursor& c, int x) {
+        bool o = c.origin && c.y >= top_ && c.y <= bot_;
+        if (o != origin) {
+            out += o ? "\x1b[?6h" : "\x1b[?6l";
+            origin = o;
+        }
+        sprintf(buf, "\x1b[%d;%dH", c.y + 1 - (origin ? top_ : 0), x + 1);
+        out += buf;
+    };
+    const line& l = screens_[alt_][cur_.y];
+    int wx = l[cur_.x].ch == 0 ? cur_.x - 1 : cur_.x;
+    if (cur_.wrapnext && wx >= 0) {
+        // reprint the last character, before any DECAWM reset, to set
+        // the pending wrap
+        position(cur_, wx);
+        append_sgr(out, l[wx]);
+        append_utf8(out, l[wx].ch);
+    } else {
+        position(cur_, cur_.x);
     }
-    if (!dryrun && chdir("/") != 0) {
-        perror_die("cd");
+    if (!autowrap_) {
+        out += "\x1b[?7l";
     }
-    std::string new_parent_mnt = parent_mnt.substr(jdir.size() - 1);
-    if (verbose) {
-        fprintf(verbosefile, "umount %s\n", new_parent_mnt.c_str());
+    append_sgr(out, cur_.pen);
+    if (insert_) {
+        out += "\x1b[4h";
     }
-    if (!dryrun
-        && umount2(new_parent_mnt.c_str(), MNT_DETACH) != 0) {
-        perror_die("umount " + new_parent_mnt);
+    for (int g = 0; g != 2; ++g) {
+        if (cur_.g[g] == '0') {
+            out += g ? "\x1b)0" : "\x1b(0";
+        }
     }
-#else
-    if (verbose) {
-        fprintf(verbosefile, "cd %s\n", jdir.c_str());
+    if (cur_.gl) {
+        out += "\x0e";
     }
-    if (!dryrun && chdir(jdir.c_str()) != 0) {
-        perror_die(jdir);
+    if (!cursor_visible_) {
+        out += "\x1b[?25l";
     }
-    if (verbose) {
-        fprintf(verbosefile, "chroot .\n");
+    return out;
+}
+
+// Encode a snapshot of `screen`, which reflects output through `off`, as
+// an event or a WebSocket frame. The snapshot is output that draws the
+// screen on a freshly reset terminal of the given size.
+static essegment encode_snapshot(size_t off, const vtscreen& screen, bool ws) {
+    std::string data = screen.snapshot();
+    const unsigned char* first = reinterpret_cast<const unsigned char*>(data.data());
+    auto jb = std::make_shared<jbuffer>(data.size() + 128);
+    if (ws) {
+        ws_frame_header(*jb, 2, data.size() + 13);
+        jb->append('S');
+        ws_append_be64(*jb, off);
+        unsigned char size[4] = {
+            (unsigned char) (screen.cols() >> 8), (unsigned char) screen.cols(),
+            (unsigned char) (screen.rows() >> 8), (unsigned char) screen.rows()
+        };
+        jb->append(size, size + 4);
+        jb->append(first, first + data.size());
+    } else {
+        char buf[128];
+        size_t n = sprintf(buf, "event:snapshot\ndata:{\"offset\":%zu,\"cols\":%d,\"rows\":%d,\"data\":\"",
+                           off, screen.cols(), screen.rows());
+        jb->append(buf, n);
+        jb->append_json_chars(first, first + data.size());
+        n = sprintf(buf, "\"}\nid:%zu\n\n", off);
+        jb->append(buf, n);
+    }
+    return jb;
+}
+
+constexpr size_t extract_max_line = 1 << 16;
+
+// Encode an output line beginning with an `--extract` prefix, which
+// starts at output offset `off` and ends before `end_off`, as JSON:
+// {"offset":N,"end_offset":N,"prefix":STR,"data":STR}, where `data` is
+// the rest of the line.
+static std::string encode_extract(size_t off, size_t end_off,
+                                  const std::string& prefix,
+                                  const std::string& payload) {
+    jbuffer jb(payload.size() + prefix.size() + 128);
+    char buf[128];
+    size_t n = sprintf(buf, "{\"offset\":%zu,\"end_offset\":%zu,\"prefix\":\"", off, end_off);
+    jb.append(buf, n);
+    auto append_string = [&] (const std::string& str) {
+        auto first = reinterpret_cast<const unsigned char*>(str.data());
+        auto last = first + str.size();
+        for (auto stop = jb.append_json_chars(first, last); stop != last; ++stop) {
+            jb.append('\x7F');
+        }
+    };
+    append_string(prefix);
+    jb.append("\",\"data\":\"", 10);
+    append_string(payload);
+    jb.append("\"}", 2);
+    return std::string(reinterpret_cast<const char*>(jb.buf_ + jb.head_), jb.tail_ - jb.head_);
+}
+
+// Return the value of query parameter `name` in an event-source request's
+// target, or nullptr.
+static const char* event_request_query(const std::string& req, const char* name) {
+    const char* s = req.c_str();
+    const char* eol = strchr(s, '\n');
+    const char* target = strchr(s, ' ');
+    const char* query = target ? strchr(target, '?') : nullptr;
+    size_t namelen = strlen(name);
+    while (query && query < eol && *query != ' ') {
+        if (strncmp(query + 1, name, namelen) == 0 && query[namelen + 1] == '=') {
+            return query + namelen + 2;
+        }
+        query = strpbrk(query + 1, "& \n");
+        if (query && *query != '&') {
+            break;
+        }
     }
-    if (!dryrun && chroot(".") != 0) {
-        perror_die("chroot");
+    return nullptr;
+}
+
+// Return the output offset an event-source request asks to start from:
+// its `Last-Event-ID` header (sent by reconnecting browsers), or else an
+// `offset` query parameter.
+static bool event_request_offset(const std::string& req, size_t& off) {
+    const char* s = req.c_str();
+    const char* eol = strchr(s, '\n');
+    for (const char* h = eol; h && h[1]; h = strchr(h + 1, '\n')) {
+        if (strncasecmp(h + 1, "last-event-id:", 14) == 0) {
+            char* end;
+            unsigned long long x = strtoull(h + 15, &end, 10);
+            if (end != h + 15 && (*end == '\r' || *end == '\n' || *end == '\0')) {
+                off = x;
+                return true;
+            }
+        }
     }
-#endif
+    const char* v = event_request_query(req, "offset");
+    if (v && isdigit((unsigned char) *v)) {
+        off = strtoull(v, nullptr, 10);
+        return true;
+    }
+    return false;
+}
 
-    // upgrade privileges
-    if (verbose) {
-        fprintf(verbosefile, "su %s\n", uid_to_name(owner_));
+// Return whether an event-source request asks to start with a screen
+// snapshot (`?snapshot=1`, with --event-snapshot) rather than at an
+// offset.
+static bool event_request_snapshot(const std::string& req) {
+    const char* v = event_request_query(req, "snapshot");
+    size_t off;
+    return v && *v == '1' && !event_request_offset(req, off);
+}
+
+static bool event_request_complete(const std::string& req) {
+    return req.find("\r\n\r\n") != std::string::npos
+        || req.find("\n\n") != std::string::npos;
+}
+
+// Return an event-source request's target path, without its query.
+static std::string event_request_path(const std::string& req) {
+    size_t first = req.find(' ');
+    if (first == std::string::npos) {
+        return std::string();
     }
-    if (!dryrun) {
-        // change effective uid/gid, but save root for later
-        if (setresgid(group_, group_, ROOT) != 0) {
-            perror_die("setresgid");
+    size_t last = req.find_first_of(" ?\r\n", first + 1);
+    return req.substr(first + 1, last == std::string::npos ? last : last - first - 1);
+}
+
+// SHA-1, for the WebSocket handshake.
+static void sha1(const unsigned char* data, size_t n, unsigned char out[20]) {
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    std::string msg(reinterpret_cast<const char*>(data), n);
+    msg += '\x80';
+    while (msg.size() % 64 != 56) {
+        msg += '\0';
+    }
+    for (int i = 7; i >= 0; --i) {
+        msg += char((uint64_t(n) * 8) >> (8 * i));
+    }
+    auto rol = [] (uint32_t x, int k) { return (x << k) | (x >> (32 - k)); };
+    const unsigned char* m = reinterpret_cast<const unsigned char*>(msg.data());
+    for (size_t b = 0; b != msg.size(); b += 64) {
+        uint32_t w[80];
+        for (int i = 0; i != 16; ++i) {
+            w[i] = (uint32_t(m[b + 4 * i]) << 24) | (m[b + 4 * i + 1] << 16)
+                | (m[b + 4 * i + 2] << 8) | m[b + 4 * i + 3];
+        }
+        for (int i = 16; i != 80; ++i) {
+            w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+        uint32_t a = h[0], bb = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i != 80; ++i) {
+            uint32_t f, k;
+            if (i < 20) {
+                f = (bb & c) | (~bb & d), k = 0x5A827999;
+            } else if (i < 40) {
+                f = bb ^ c ^ d, k = 0x6ED9EBA1;
+            } else if (i < 60) {
+                f = (bb & c) | (bb & d) | (c & d), k = 0x8F1BBCDC;
+            } else {
+                f = bb ^ c ^ d, k = 0xCA62C1D6;
+            }
+            uint32_t t = rol(a, 5) + f + e + k + w[i];
+            e = d, d = c, c = rol(bb, 30), bb = a, a = t;
         }
-        if (setresuid(owner_, owner_, ROOT) != 0) {
-            perror_die("setresuid");
+        h[0] += a, h[1] += bb, h[2] += c, h[3] += d, h[4] += e;
+    }
+    for (int i = 0; i != 20; ++i) {
+        out[i] = h[i / 4] >> (24 - 8 * (i % 4));
+    }
+}
+
+static std::string base64_encode(const unsigned char* s, size_t n) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    for (size_t i = 0; i < n; i += 3) {
+        unsigned v = (s[i] << 16) | (i + 1 < n ? s[i + 1] << 8 : 0)
+            | (i + 2 < n ? s[i + 2] : 0);
+        out += alphabet[(v >> 18) & 63];
+        out += alphabet[(v >> 12) & 63];
+        out += i + 1 < n ? alphabet[(v >> 6) & 63] : '=';
+        out += i + 2 < n ? alphabet[v & 63] : '=';
+    }
+    return out;
+}
+
+// If an event-source request asks to upgrade to a WebSocket, set `accept`
+// to its `Sec-WebSocket-Accept` response and return true.
+static bool event_request_websocket(const std::string& req, std::string& accept) {
+    const char* s = req.c_str();
+    bool upgrade = false;
+    std::string key;
+    for (const char* h = strchr(s, '\n'); h && h[1]; h = strchr(h + 1, '\n')) {
+        const char* v;
+        if (strncasecmp(h + 1, "upgrade:", 8) == 0) {
+            v = h + 9;
+        } else if (strncasecmp(h + 1, "sec-websocket-key:", 18) == 0) {
+            v = h + 19;
+        } else {
+            continue;
+        }
+        v += strspn(v, " \t");
+        std::string value(v, strcspn(v, " \t\r\n"));
+        if (h[1] == 'u' || h[1] == 'U') {
+            upgrade = strcasecmp(value.c_str(), "websocket") == 0;
+        } else {
+            key = value;
         }
     }
+    if (!upgrade || key.empty()) {
+        return false;
+    }
+    key += "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    unsigned char digest[20];
+    sha1(reinterpret_cast<const unsigned char*>(key.data()), key.size(), digest);
+    accept = base64_encode(digest, 20);
+    return true;
+}
 
-    // create a pty
-    int ptymaster = -1;
-    char* ptyslavename = nullptr;
-    if (verbose) {
-        fprintf(verbosefile, "make-pty\n");
+// Return the zlib window bits for the best encoding in an event-source
+// request's `Accept-Encoding` header: 31 for gzip, 15 for deflate, or 0
+// to send the stream uncompressed.
+static int event_request_encoding(const std::string& req) {
+    if (event_compression <= 0) {
+        return 0;
     }
-    if (!dryrun) {
-        // create pty
-        if ((ptymaster = posix_openpt(O_RDWR | O_NOCTTY)) == -1) {
-            perror_die("posix_openpt");
+    const char* s = req.c_str();
+    int bits = 0;
+    for (const char* h = strchr(s, '\n'); h && h[1]; h = strchr(h + 1, '\n')) {
+        if (strncasecmp(h + 1, "accept-encoding:", 16) != 0) {
+            continue;
         }
-        struct termios tty;
-        if (tcgetattr(ptymaster, &tty) >= 0) {
-            tty.c_iflag |= BRKINT | IGNPAR | IMAXBEL;
-#ifdef IUTF8
-            tty.c_iflag |= IUTF8;
-#endif
-            tcsetattr(ptymaster, TCSANOW, &tty);
+        const char* t = h + 17;
+        while (*t != '\r' && *t != '\n' && *t != '\0') {
+            t += strspn(t, " \t,");
+            size_t len = strcspn(t, " \t,;\r\n");
+            const char* params = t + len;
+            const char* end = params + strcspn(params, ",\r\n");
+            const char* q = strstr(params, "q=");
+            bool refused = q && q < end && strtod(q + 2, nullptr) <= 0;
+            if (refused) {
+                // skip
+            } else if (len == 4 && strncasecmp(t, "gzip", 4) == 0) {
+                bits = 31;
+            } else if (len == 7 && strncasecmp(t, "deflate", 7) == 0
+                       && bits == 0) {
+                bits = 15;
+            }
+            t = end;
+        }
+    }
+    return bits;
+}
+
+// Compress queued events into `zout_`, flushing at the last event so the
+// client can decode everything sent so far.
+void esfd::deflate_some() {
+    zout_.clear();
+    zout_off_ = 0;
+    size_t nin = 0;
+    while (!segs_.empty() && nin < 65536) {
+        const jbuffer& seg = *segs_.front().seg;
+        size_t n = seg.tail_ - seg.head_;
+        zs_->next_in = seg.buf_ + seg.head_;
+        zs_->avail_in = n;
+        nin += n;
+        int flush = Z_NO_FLUSH;
+        if (segs_.size() == 1 || nin >= 65536) {
+            flush = segs_.size() == 1 && zfinish_ ? Z_FINISH : Z_SYNC_FLUSH;
+        }
+        do {
+            unsigned char out[16384];
+            zs_->next_out = out;
+            zs_->avail_out = sizeof(out);
+            deflate(zs_, flush);
+            zout_.append(reinterpret_cast<char*>(out), sizeof(out) - zs_->avail_out);
+        } while (zs_->avail_out == 0);
+        queued_ -= n;
+        written_off_ = segs_.front().end_off;
+        segs_.pop_front();
+    }
+    event_deflate_in += nin;
+    event_deflate_out += zout_.size();
+}
+
+bool esfd::write() {
+    if (zs_ || zout_off_ != zout_.size()) {
+        if (zout_off_ == zout_.size() && !segs_.empty()) {
+            deflate_some();
+        }
+        if (wclosed_ || zout_off_ == zout_.size()) {
+            return false;
         }
-        if (grantpt(ptymaster) == -1) {
-            perror_die("grantpt");
+        ssize_t nw = ::write(fd_, zout_.data() + zout_off_, zout_.size() - zout_off_);
+        if (nw == 0 || nw == -1) {
+            if (errno != EINTR && errno != EAGAIN) {
+                wclosed_ = true;
+            }
+            return false;
         }
-        if (unlockpt(ptymaster) == -1) {
-            perror_die("unlockpt");
+        zout_off_ += nw;
+        event_bytes_written += nw;
+        return true;
+    }
+    struct iovec iov[64];
+    int niov = 0;
+    size_t off = seg_off_;
+    for (auto it = segs_.begin(); it != segs_.end() && niov != 64; ++it) {
+        const jbuffer& seg = *it->seg;
+        iov[niov].iov_base = seg.buf_ + seg.head_ + off;
+        iov[niov].iov_len = seg.tail_ - seg.head_ - off;
+        ++niov;
+        off = 0;
+    }
+    if (wclosed_ || niov == 0) {
+        return false;
+    }
+    ssize_t nw = writev(fd_, iov, niov);
+    if (nw == 0 || nw == -1) {
+        if (errno != EINTR && errno != EAGAIN) {
+            wclosed_ = true;
         }
-        if ((ptyslavename = ptsname(ptymaster)) == nullptr) {
-            perror_die("ptsname");
+        return false;
+    }
+    size_t n = nw;
+    queued_ -= n;
+    event_bytes_written += n;
+    while (n != 0) {
+        const jbuffer& seg = *segs_.front().seg;
+        size_t left = seg.tail_ - seg.head_ - seg_off_;
+        if (n < left) {
+            seg_off_ += n;
+            break;
         }
+        n -= left;
+        written_off_ = segs_.front().end_off;
+        segs_.pop_front();
+        seg_off_ = 0;
     }
+    return true;
+}
 
-    // change into their home directory
-    if (verbose) {
-        fprintf(verbosefile, "cd %s\n", owner_home_.c_str());
+
+// timing files
+//
+// A text timing file (the default) has a line per record, `MS,OFFSET`:
+// milliseconds since the start and output bytes so far. Every record but
+// each 128th is instead `+MS,+OFFSET`, relative to the previous record.
+//
+// A binary timing file (`--timing-format binary`) starts with the magic
+// "PATIMB1\n". Each record is two LEB128 varints, the microseconds and
+// output bytes since the previous record; the first record is relative to
+// (0, 0). Records are written in blocks of at most `timing_block` bytes.
+// At close, an index follows the records: for each block, the time and
+// output offset before its first record and the file position of that
+// record, as little-endian 64-bit values; then the number of index entries
+// as a 64-bit value and the magic "PATIMIX\n". A reader can binary search
+// the index and decode a single block to find any point in the run.
+
+static const char timing_magic[] = "PATIMB1\n";
+static const char timing_index_magic[] = "PATIMIX\n";
+constexpr size_t timing_block = 4096;
+
+static void write_fully(int fd, const void* data, size_t len, const char* what) {
+    const char* s = reinterpret_cast<const char*>(data);
+    while (len != 0) {
+        ssize_t nw = write(fd, s, len);
+        if (nw < 0 && errno != EINTR) {
+            perror_die(what);
+        } else if (nw > 0) {
+            s += nw;
+            len -= nw;
+        }
     }
-    if (!dryrun && chdir(owner_home_.c_str()) != 0) {
-        perror_die(owner_home_);
+}
+
+static void append_varint(std::string& s, unsigned long long x) {
+    while (x >= 0x80) {
+        s += char(x | 0x80);
+        x >>= 7;
     }
+    s += char(x);
+}
 
-    // check that shell exists
-    if (!dryrun && access(owner_sh_.c_str(), R_OK | X_OK) != 0) {
-        perror_die(owner_sh_);
+static void append_le64(std::string& s, unsigned long long x) {
+    for (int i = 0; i != 8; ++i) {
+        s += char(x >> (8 * i));
     }
+}
 
-    // print ready marker
-    if (!ready_marker.empty()) {
-        if (verbose) {
-            bool nl = ready_marker.back() == '\n';
-            fprintf(verbosefile, "echo %s%s%s", nl ? "" : "-n ", ready_marker.c_str(), nl ? "" : "\n");
-        }
-        if (!dryrun) {
-            fputs(ready_marker.c_str(), stdout);
-            fflush(stdout);
+static unsigned long long read_le64(const unsigned char* s) {
+    unsigned long long x = 0;
+    for (int i = 7; i >= 0; --i) {
+        x = (x << 8) | s[i];
+    }
+    return x;
+}
+
+class timingwriter {
+  public:
+    timingwriter(int fd, bool binary);
+
+    // Record output offset `off` at `usec` microseconds into the run.
+    void add(unsigned long long usec, unsigned long long off);
+    // Write buffered records and, for binary files, the index.
+    void finish();
+
+  private:
+    int fd_;
+    bool binary_;
+    std::string buf_;
+    unsigned long long usec_ = 0;
+    unsigned long long off_ = 0;
+    size_t count_ = 0;
+    unsigned long long filepos_ = 0;    // file position of `buf_`
+    std::string index_;
+};
+
+timingwriter::timingwriter(int fd, bool binary)
+    : fd_(fd), binary_(binary) {
+    if (binary_) {
+        write_fully(fd_, timing_magic, 8, "Timing file");
+        filepos_ = 8;
+    }
+}
+
+void timingwriter::add(unsigned long long usec, unsigned long long off) {
+    usec = std::max(usec, usec_);
+    off = std::max(off, off_);
+    if (binary_) {
+        if (buf_.size() + 20 > timing_block) {
+            write_fully(fd_, buf_.data(), buf_.size(), "Timing file");
+            filepos_ += buf_.size();
+            buf_.clear();
+        }
+        if (buf_.empty()) {
+            append_le64(index_, usec_);
+            append_le64(index_, off_);
+            append_le64(index_, filepos_);
+        }
+        append_varint(buf_, usec - usec_);
+        append_varint(buf_, off - off_);
+    } else {
+        char line[64];
+        size_t len;
+        if (count_ % 128 == 0) {
+            len = sprintf(line, "%llu,%llu\n", usec / 1000, off);
+        } else {
+            len = sprintf(line, "+%llu,+%llu\n", usec / 1000 - usec_ / 1000, off - off_);
         }
+        write_fully(fd_, line, len, "Timing file");
     }
+    usec_ = usec;
+    off_ = off;
+    ++count_;
+}
 
-    // run command
-    if (verbose) {
-        for (int i = 0; newenv_[i]; ++i) {
-            fprintf(verbosefile, "%s ", newenv_[i]);
+void timingwriter::finish() {
+    if (binary_) {
+        buf_ += index_;
+        append_le64(buf_, index_.size() / 24);
+        buf_.append(timing_index_magic, 8);
+        write_fully(fd_, buf_.data(), buf_.size(), "Timing file");
+        filepos_ += buf_.size();
+        buf_.clear();
+        index_.clear();
+    }
+}
+
+class timingreader {
+  public:
+    timingreader(int fd, const char* name);
+
+    // Read the next record, returning false at the end.
+    bool next(unsigned long long& usec, unsigned long long& off);
+    // Find the last record at or before `usec`, or (0, 0) if none.
+    void find(unsigned long long usec, unsigned long long& rusec,
+              unsigned long long& roff);
+
+  private:
+    int fd_;
+    const char* name_;
+    unsigned long long end_;            // end of records
+    unsigned long long nindex_ = 0;
+    std::vector<unsigned char> buf_;
+    size_t head_ = 0;
+    unsigned long long bufpos_ = 8;     // file position of `buf_`
+    unsigned long long usec_ = 0;
+    unsigned long long off_ = 0;
+
+    void read_at(void* buf, size_t n, unsigned long long pos);
+    void seek_index(unsigned long long i);
+    bool read_varint(unsigned long long& x);
+};
+
+timingreader::timingreader(int fd, const char* name)
+    : fd_(fd), name_(name) {
+    struct stat st;
+    unsigned char x[16];
+    if (fstat(fd_, &st) != 0) {
+        perror_die(name_);
+    }
+    end_ = st.st_size;
+    if (end_ < 8) {
+        die("%s: Not a binary timing file\n", name_);
+    }
+    read_at(x, 8, 0);
+    if (memcmp(x, timing_magic, 8) != 0) {
+        die("%s: Not a binary timing file\n", name_);
+    }
+    // a run that did not exit cleanly has no index
+    if (end_ >= 24) {
+        read_at(x, 16, end_ - 16);
+        unsigned long long n = read_le64(x);
+        if (memcmp(x + 8, timing_index_magic, 8) == 0
+            && n <= (end_ - 24) / 24) {
+            nindex_ = n;
+            end_ -= 16 + n * 24;
         }
-        for (int i = 0; argv_[i]; ++i) {
-            fprintf(verbosefile, i ? " %s" : "%s", shell_quote(argv_[i]).c_str());
+    }
+}
+
+void timingreader::read_at(void* buf, size_t n, unsigned long long pos) {
+    ssize_t nr = pread(fd_, buf, n, pos);
+    if (nr != ssize_t(n)) {
+        if (nr >= 0) {
+            errno = EIO;
         }
-        fprintf(verbosefile, "\n");
+        perror_die(name_);
     }
+}
 
-    if (!dryrun) {
-        start_sigpipe();
-        pid_t child = fork();
-        if (child < 0) {
-            perror_die("fork");
-        } else if (child == 0) {
-            child = getpid();
-#if __linux__
-            // sigfd is close-on-exec, but need to unblock signals
-            sigset_t mask;
-            sigemptyset(&mask);
-            if (sigprocmask(SIG_SETMASK, &mask, nullptr) == -1) {
-                perror_die("sigprocmask");
+void timingreader::seek_index(unsigned long long i) {
+    unsigned char x[24];
+    read_at(x, 24, end_ + 24 * i);
+    usec_ = read_le64(x);
+    off_ = read_le64(x + 8);
+    bufpos_ = read_le64(x + 16);
+    buf_.clear();
+    head_ = 0;
+}
+
+bool timingreader::read_varint(unsigned long long& x) {
+    x = 0;
+    for (int shift = 0; true; shift += 7) {
+        if (head_ == buf_.size()) {
+            unsigned long long pos = bufpos_ + buf_.size();
+            if (pos >= end_) {
+                return false;
             }
-#else
-            close(sigpipe[0]);
-            close(sigpipe[1]);
-#endif
+            size_t n = std::min(end_ - pos, (unsigned long long) 4 * timing_block);
+            buf_.resize(n);
+            read_at(buf_.data(), n, pos);
+            bufpos_ = pos;
+            head_ = 0;
+        }
+        unsigned char ch = buf_[head_];
+        ++head_;
+        if (shift < 64) {
+            x |= (unsigned long long) (ch & 0x7F) << shift;
+        }
+        if (!(ch & 0x80)) {
+            return true;
+        }
+    }
+}
 
-            // reduce privileges permanently
-            if (setresgid(group_, group_, group_) != 0) {
-                perror_die("setresgid");
+bool timingreader::next(unsigned long long& usec, unsigned long long& off) {
+    unsigned long long dusec, doff;
+    if (!read_varint(dusec) || !read_varint(doff)) {
+        return false;
+    }
+    usec = usec_ += dusec;
+    off = off_ += doff;
+    return true;
+}
+
+void timingreader::find(unsigned long long usec, unsigned long long& rusec,
+                        unsigned long long& roff) {
+    // binary search for the last block starting at or before `usec`
+    unsigned long long lo = 0, hi = nindex_;
+    while (hi - lo > 1) {
+        unsigned long long mid = lo + (hi - lo) / 2;
+        unsigned char x[8];
+        read_at(x, 8, end_ + 24 * mid);
+        if (read_le64(x) <= usec) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    if (nindex_ != 0) {
+        seek_index(lo);
+    } else {
+        usec_ = off_ = 0;
+        bufpos_ = 8;
+        buf_.clear();
+        head_ = 0;
+    }
+    rusec = usec_;
+    roff = off_;
+    unsigned long long u, o;
+    while (next(u, o) && u <= usec) {
+        rusec = u;
+        roff = o;
+    }
+}
+
+// `pa-jail timing [--at MS] INFILE [OUTFILE]`: convert a timing file to the
+// other format, or print the last record at or before MS milliseconds.
+[[noreturn]] static void run_timing(const char* infile, const char* outfile,
+                                    long long at_msec) {
+    int fd = open(infile, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror_die(infile);
+    }
+    char magic[8];
+    bool binary = pread(fd, magic, 8, 0) == 8 && memcmp(magic, timing_magic, 8) == 0;
+    unsigned long long at_usec = at_msec * 1000ULL;
+    unsigned long long usec = 0, off = 0, rusec = 0, roff = 0;
+
+    timingwriter* w = nullptr;
+    if (at_msec < 0) {
+        int ofd = STDOUT_FILENO;
+        if (outfile) {
+            ofd = open(outfile, O_WRONLY | O_CLOEXEC | O_CREAT | O_TRUNC, 0666);
+            if (ofd == -1) {
+                perror_die(outfile);
             }
-            if (setresuid(owner_, owner_, owner_) != 0) {
-                perror_die("setresuid");
+        }
+        w = new timingwriter(ofd, !binary);
+    }
+    auto record = [&] (unsigned long long u, unsigned long long o) {
+        if (w) {
+            w->add(u, o);
+        } else if (u <= at_usec) {
+            rusec = u;
+            roff = o;
+        }
+    };
+
+    if (binary && !w) {
+        timingreader(fd, infile).find(at_usec, rusec, roff);
+    } else if (binary) {
+        timingreader r(fd, infile);
+        while (r.next(usec, off)) {
+            record(usec, off);
+        }
+    } else {
+        std::string text = file_get_contents(infile, 2);
+        const char* s = text.c_str();
+        while (*s) {
+            char* end;
+            bool rel = *s == '+';
+            if (!isdigit((unsigned char) s[rel])) {
+                die("%s: Bad timing record\n", infile);
             }
-            if (setsid() == -1) {
-                perror_die("setsid");
+            unsigned long long t = strtoull(s + rel, &end, 10);
+            bool orel = end[0] == ',' && end[1] == '+';
+            if (end[0] != ',' || !isdigit((unsigned char) end[1 + orel])) {
+                die("%s: Bad timing record\n", infile);
             }
-            if (ptyslavename) {
-                exec_go_pty(ptymaster, ptyslavename, child);
+            unsigned long long o = strtoull(end + 1 + orel, &end, 10);
+            if (*end != '\n' && *end != '\0') {
+                die("%s: Bad timing record\n", infile);
             }
+            usec = rel ? usec + t * 1000 : t * 1000;
+            off = orel ? off + o : o;
+            record(usec, off);
+            s = *end ? end + 1 : end;
+        }
+    }
 
-            // restore all signals to their default actions
-            // (e.g., PHP may have ignored SIGPIPE; don't want that
-            // to propagate to student code!)
-            for (int sig = 1; sig < NSIG; ++sig) {
-                signal(sig, SIG_DFL);
+    if (w) {
+        w->finish();
+    } else {
+        printf("%llu,%llu\n", rusec / 1000, roff);
+    }
+    exit(0);
+}
+
+// transcripts
+//
+// `--transcript FILE` writes output to FILE, instead of to stdout, as
+// independent gzip members, or frames, each holding at most
+// `transcript_frame` bytes of output;
+// `zcat FILE` prints the whole output. FILE.idx has an entry per frame,
+// written as the frame starts: the output offset of its first byte and
+// its position in FILE, as little-endian 64-bit values. A reader finds the
+// frame holding any offset by binary search and inflates only from there.
+// Offsets count from the start of the transcript.
+// While the jail runs, the current frame is flushed whenever we wait for
+// output, so readers see everything written so far.
+
+constexpr size_t transcript_frame = 64 << 10;
+
+class transcriptwriter {
+  public:
+    transcriptwriter(int fd, int indexfd);
+
+    void write(const unsigned char* first, const unsigned char* last);
+    // Make all output written so far readable.
+    void flush();
+    // End the current frame.
+    void finish();
+
+  private:
+    int fd_;
+    int indexfd_;
+    z_stream zs_;
+    bool in_frame_ = false;
+    bool dirty_ = false;                // output since the last flush
+    size_t frame_size_ = 0;
+    unsigned long long off_ = 0;        // output offset
+    unsigned long long pos_ = 0;        // file position
+
+    void deflate_out(int flush);
+};
+
+transcriptwriter::transcriptwriter(int fd, int indexfd)
+    : fd_(fd), indexfd_(indexfd) {
+    memset(&zs_, 0, sizeof(zs_));
+    if (deflateInit2(&zs_, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16,
+                     8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        die("Transcript: %s\n", zs_.msg ? zs_.msg : "deflateInit2 failed");
+    }
+}
+
+void transcriptwriter::deflate_out(int flush) {
+    unsigned char buf[16384];
+    do {
+        zs_.next_out = buf;
+        zs_.avail_out = sizeof(buf);
+        deflate(&zs_, flush);
+        size_t n = sizeof(buf) - zs_.avail_out;
+        write_fully(fd_, buf, n, "Transcript");
+        pos_ += n;
+    } while (zs_.avail_out == 0);
+}
+
+void transcriptwriter::write(const unsigned char* first, const unsigned char* last) {
+    while (first != last) {
+        if (!in_frame_) {
+            std::string entry;
+            append_le64(entry, off_);
+            append_le64(entry, pos_);
+            write_fully(indexfd_, entry.data(), entry.size(), "Transcript index");
+            deflateReset(&zs_);
+            in_frame_ = true;
+            frame_size_ = 0;
+        }
+        size_t n = std::min(size_t(last - first), transcript_frame - frame_size_);
+        zs_.next_in = const_cast<unsigned char*>(first);
+        zs_.avail_in = n;
+        deflate_out(Z_NO_FLUSH);
+        first += n;
+        off_ += n;
+        frame_size_ += n;
+        dirty_ = true;
+        if (frame_size_ == transcript_frame) {
+            finish();
+        }
+    }
+}
+
+void transcriptwriter::flush() {
+    if (in_frame_ && dirty_) {
+        deflate_out(Z_SYNC_FLUSH);
+        dirty_ = false;
+    }
+}
+
+void transcriptwriter::finish() {
+    if (in_frame_) {
+        deflate_out(Z_FINISH);
+        in_frame_ = dirty_ = false;
+    }
+}
+
+// Read output from the transcript `fd`, indexed by `indexfd`, starting at
+// output offset `offset`, and pass it to `f(data, n)` until `f` returns
+// false or the transcript ends. Returns 0 on success, -1 on a read error
+// (see errno), and -2 if the transcript is corrupt.
+template <typename F>
+static int read_transcript(int fd, int indexfd, size_t offset, F f) {
+    // find the last frame starting at or before `offset`
+    unsigned long long off = 0, pos = 0;
+    struct stat st;
+    if (indexfd != -1 && fstat(indexfd, &st) == 0 && st.st_size >= 16) {
+        unsigned long long lo = 0, hi = st.st_size / 16;
+        unsigned char x[16];
+        while (hi - lo > 1) {
+            unsigned long long mid = lo + (hi - lo) / 2;
+            if (pread(indexfd, x, 8, mid * 16) != 8) {
+                return -1;
+            }
+            if (read_le64(x) <= offset) {
+                lo = mid;
+            } else {
+                hi = mid;
             }
+        }
+        if (pread(indexfd, x, 16, lo * 16) != 16) {
+            return -1;
+        }
+        off = read_le64(x);
+        pos = read_le64(x + 8);
+    }
 
-            int r = execve(argv_[0], (char* const*) argv_,
-                           (char* const*) newenv_.data());
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, 15 + 16) != Z_OK) {
+        return -2;
+    }
+    unsigned char in[16384], out[65536];
+    int result = 0;
+    while (true) {
+        if (zs.avail_in == 0) {
+            ssize_t nr = pread(fd, in, sizeof(in), pos);
+            if (nr <= 0) {
+                // end of file, or the end of a live frame
+                result = nr < 0 ? -1 : 0;
+                break;
+            }
+            pos += nr;
+            zs.next_in = in;
+            zs.avail_in = nr;
+        }
+        zs.next_out = out;
+        zs.avail_out = sizeof(out);
+        int r = inflate(&zs, Z_NO_FLUSH);
+        if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR) {
+            result = -2;
+            break;
+        }
+        size_t n = sizeof(out) - zs.avail_out;
+        if (off + n > offset) {
+            size_t skip = offset > off ? offset - off : 0;
+            if (!f(out + skip, n - skip)) {
+                break;
+            }
+        }
+        off += n;
+        if (r == Z_STREAM_END) {
+            inflateReset(&zs);
+        }
+    }
+    inflateEnd(&zs);
+    return result;
+}
 
-            assert(r < 0);
-            fprintf(stderr, "exec %s: %s\n", owner_sh_.c_str(), strerror(errno));
-            exit(126);
+// `pa-jail transcript [--offset N] [--length N] FILE`: print output from
+// the transcript FILE, starting at output offset N.
+[[noreturn]] static void run_transcript(const char* filename, size_t offset,
+                                        size_t length) {
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror_die(filename);
+    }
+    std::string indexname = std::string(filename) + ".idx";
+    int indexfd = open(indexname.c_str(), O_RDONLY | O_CLOEXEC);
+    int r = read_transcript(fd, indexfd, offset, [&] (const unsigned char* data, size_t n) {
+        size_t w = std::min(n, length);
+        fwrite(data, 1, w, stdout);
+        length -= w;
+        return length != 0;
+    });
+    if (r == -1) {
+        perror_die(filename);
+    } else if (r == -2) {
+        die("%s: Corrupt transcript\n", filename);
+    }
+    fflush(stdout);
+    exit(0);
+}
+
+// line indexes
+//
+// `--line-index FILE` maintains an index of output lines in FILE, so
+// readers can find the last N lines, or lines X through Y, of the stdout
+// log without scanning it. FILE starts with a header, rewritten whenever
+// we wait for output: `line_index_magic`, then as little-endian 64-bit
+// values the line interval K, the log offset of the first output byte,
+// the number of newlines, the log offset just past the last newline, and
+// the log offset just past the last output byte. After the header comes
+// an entry per K newlines: the log offset just past the (iK)th newline.
+
+constexpr char line_index_magic[] = "PALIDX1\n";
+constexpr size_t line_index_header = 48;
+constexpr size_t line_index_every = 1024;
+
+class lineindexwriter {
+  public:
+    lineindexwriter(int fd, size_t base);
+
+    void add(const unsigned char* first, const unsigned char* last);
+    // Write entries and header for all output added so far.
+    void flush();
+
+  private:
+    int fd_;
+    bool dirty_ = true;
+    unsigned long long base_;
+    unsigned long long lines_ = 0;
+    unsigned long long line_end_;       // offset past the last newline
+    unsigned long long off_;            // offset past the last byte
+    std::string buf_;                   // entries not yet written
+};
+
+lineindexwriter::lineindexwriter(int fd, size_t base)
+    : fd_(fd), base_(base), line_end_(base), off_(base) {
+    std::string hdr(line_index_magic, 8);
+    hdr.resize(line_index_header, '\0');
+    write_fully(fd_, hdr.data(), hdr.size(), "Line index");
+}
+
+void lineindexwriter::add(const unsigned char* first, const unsigned char* last) {
+    for (auto p = first;
+         (p = reinterpret_cast<const unsigned char*>(memchr(p, '\n', last - p)));
+         ++p) {
+        ++lines_;
+        line_end_ = off_ + (p + 1 - first);
+        if (lines_ % line_index_every == 0) {
+            append_le64(buf_, line_end_);
+        }
+    }
+    off_ += last - first;
+    dirty_ = true;
+}
+
+void lineindexwriter::flush() {
+    if (!dirty_) {
+        return;
+    }
+    write_fully(fd_, buf_.data(), buf_.size(), "Line index");
+    buf_.clear();
+    std::string hdr(line_index_magic, 8);
+    append_le64(hdr, line_index_every);
+    append_le64(hdr, base_);
+    append_le64(hdr, lines_);
+    append_le64(hdr, line_end_);
+    append_le64(hdr, off_);
+    if (pwrite(fd_, hdr.data(), hdr.size(), 0) != ssize_t(hdr.size())) {
+        perror_die("Line index");
+    }
+    dirty_ = false;
+}
+
+// Return the log offset past the `n`th newline at or after `off`.
+static size_t skip_lines(int fd, const char* filename, size_t off, size_t n) {
+    unsigned char buf[65536];
+    while (n != 0) {
+        ssize_t nr = pread(fd, buf, sizeof(buf), off);
+        if (nr < 0) {
+            perror_die(filename);
+        } else if (nr == 0) {
+            die("%s: Shorter than its line index\n", filename);
         }
+        auto p = buf, last = buf + nr;
+        while (n != 0
+               && (p = reinterpret_cast<unsigned char*>(memchr(p, '\n', last - p)))) {
+            ++p;
+            --n;
+        }
+        off += (n == 0 ? p : last) - buf;
+    }
+    return off;
+}
 
-        wait_background(child, ptymaster);
+// `pa-jail lines [--from X] [--to Y | --tail N] INDEX LOG`: print lines
+// X through Y (counting from 1), or the last N lines, of the stdout log
+// LOG, using its line index INDEX.
+[[noreturn]] static void run_lines(const char* indexname, const char* logname,
+                                   size_t from, size_t to, size_t tail) {
+    int indexfd = open(indexname, O_RDONLY | O_CLOEXEC);
+    if (indexfd == -1) {
+        perror_die(indexname);
+    }
+    int logfd = open(logname, O_RDONLY | O_CLOEXEC);
+    if (logfd == -1) {
+        perror_die(logname);
+    }
+    unsigned char hdr[line_index_header];
+    ssize_t nr = pread(indexfd, hdr, sizeof(hdr), 0);
+    if (nr < 0) {
+        perror_die(indexname);
+    } else if (nr != ssize_t(sizeof(hdr))
+               || memcmp(hdr, line_index_magic, 8) != 0
+               || read_le64(hdr + 8) == 0) {
+        die("%s: Not a line index\n", indexname);
+    }
+    size_t every = read_le64(hdr + 8), base = read_le64(hdr + 16),
+        lines = read_le64(hdr + 24), line_end = read_le64(hdr + 32),
+        end = read_le64(hdr + 40);
+
+    // a final line without a newline counts as a line
+    size_t nlines = lines + (end > line_end);
+    if (tail != SIZE_MAX) {
+        from = nlines > tail ? nlines - tail + 1 : 1;
+    }
+    to = std::min(to, nlines);
+    from = std::max(from, size_t(1));
+    if (from > to) {
+        exit(0);
     }
 
-    return 0;
+    // return the log offset where line `n + 1` starts
+    auto line_offset = [&] (size_t n) -> size_t {
+        if (n >= nlines) {
+            return end;
+        } else if (n == lines) {
+            return line_end;
+        }
+        size_t k = n / every, off = base;
+        if (k != 0) {
+            unsigned char x[8];
+            if (pread(indexfd, x, 8, line_index_header + (k - 1) * 8) != 8) {
+                die("%s: Truncated line index\n", indexname);
+            }
+            off = read_le64(x);
+        }
+        return skip_lines(logfd, logname, off, n - k * every);
+    };
+    size_t off = line_offset(from - 1), stop = line_offset(to);
+
+    unsigned char buf[65536];
+    while (off < stop) {
+        nr = pread(logfd, buf, std::min(stop - off, sizeof(buf)), off);
+        if (nr < 0) {
+            perror_die(logname);
+        } else if (nr == 0) {
+            break;
+        }
+        fwrite(buf, 1, nr, stdout);
+        off += nr;
+    }
+    fflush(stdout);
+    exit(0);
 }
 
-void jailownerinfo::exec_go_pty(int ptymaster, const char* ptyslavename, pid_t child) {
-    int ptyslave = open(ptyslavename, O_RDWR);
-    if (ptyslave == -1) {
-        perror_die(ptyslavename);
+
+// stop patterns
+//
+// `--stop-on PATTERN` ends the run as soon as output contains the literal
+// PATTERN. All patterns are matched at once by an Aho-Corasick automaton,
+// compiled to a full transition table so each output byte costs one
+// lookup. The automaton's state carries across reads, so matches may span
+// them.
+
+class patternmatcher {
+  public:
+    void add(const std::string& pattern);
+    void build();
+    bool empty() const {
+        return npatterns_ == 0;
     }
-    close(ptymaster);
-#ifdef TIOCSCTTY
-    ioctl(ptyslave, TIOCSCTTY, 0);
-#endif
-    tcsetpgrp(ptyslave, child);
-#ifdef TIOCGWINSZ
-    if (tsize[0] > 0) {
-        struct winsize ws;
-        ioctl(ptyslave, TIOCGWINSZ, &ws);
-        ws.ws_row = tsize[1];
-        ws.ws_col = tsize[0];
-        ioctl(ptyslave, TIOCSWINSZ, &ws);
+    // Scan [first, last). Return the index of the first pattern that
+    // ends there, setting `first` just past it, or -1.
+    int find(const unsigned char*& first, const unsigned char* last);
+
+  private:
+    std::vector<int> next_ = std::vector<int>(256, -1); // [state * 256 + byte]
+    std::vector<int> match_ = {-1}; // [state]: a pattern ending there, or -1
+    int npatterns_ = 0;
+    int state_ = 0;
+};
+
+void patternmatcher::add(const std::string& pattern) {
+    int s = 0;
+    for (unsigned char ch : pattern) {
+        if (next_[s * 256 + ch] < 0) {
+            next_[s * 256 + ch] = match_.size();
+            match_.push_back(-1);
+            next_.resize(next_.size() + 256, -1);
+        }
+        s = next_[s * 256 + ch];
+    }
+    if (match_[s] < 0) {
+        match_[s] = npatterns_;
+    }
+    ++npatterns_;
+}
+
+// Fill in failure transitions, breadth first, so that every state has a
+// transition on every byte.
+void patternmatcher::build() {
+    std::vector<int> fail(match_.size(), 0);
+    std::deque<int> q;
+    for (int ch = 0; ch != 256; ++ch) {
+        if (next_[ch] < 0) {
+            next_[ch] = 0;
+        } else {
+            q.push_back(next_[ch]);
+        }
+    }
+    while (!q.empty()) {
+        int s = q.front();
+        q.pop_front();
+        if (match_[s] < 0) {
+            match_[s] = match_[fail[s]];
+        }
+        for (int ch = 0; ch != 256; ++ch) {
+            int& t = next_[s * 256 + ch];
+            if (t < 0) {
+                t = next_[fail[s] * 256 + ch];
+            } else {
+                fail[t] = next_[fail[s] * 256 + ch];
+                q.push_back(t);
+            }
+        }
+    }
+}
+
+int patternmatcher::find(const unsigned char*& first, const unsigned char* last) {
+    int s = state_;
+    while (first != last) {
+        s = next_[s * 256 + *first];
+        ++first;
+        if (match_[s] >= 0) {
+            break;
+        }
+    }
+    state_ = s;
+    return match_[s];
+}
+
+
+// input scripts
+//
+// `--input-script FILE` drives an interactive run from FILE, one step per
+// line, instead of a process writing to the input FIFO. Blank lines and
+// lines starting with `#` are ignored.
+//
+//   wait REGEX          wait until output since the previous match
+//                       matches the POSIX extended REGEX
+//   timeout SECONDS     give later waits SECONDS to match [10]
+//   send TEXT           send TEXT, with \n, \r, \t, \e, \\, and \xHH escapes
+//   eof                 end input (Control-D on a terminal)
+//   resize COLSxROWS    resize the terminal, up to 1000x500
+//
+// A wait that times out ends the run with status 121.
+
+struct inputstep {
+    enum { wait, send, eof, resize } type;
+    std::string text;               // regex or bytes to send
+    double timeout = 10;
+    int cols = 0;
+    int rows = 0;
+};
+
+constexpr size_t input_script_window = 1 << 16;
+
+static std::string unescape_input(const char* s, const char* filename, int lineno) {
+    std::string out;
+    while (*s) {
+        if (*s != '\\') {
+            out += *s;
+            ++s;
+            continue;
+        }
+        char ch = s[1];
+        if (ch == 'n') {
+            out += '\n';
+        } else if (ch == 'r') {
+            out += '\r';
+        } else if (ch == 't') {
+            out += '\t';
+        } else if (ch == 'e') {
+            out += '\x1b';
+        } else if (ch == '\\') {
+            out += '\\';
+        } else if (ch == 'x' && isxdigit((unsigned char) s[2])
+                   && isxdigit((unsigned char) s[3])) {
+            out += char(strtol(std::string(s + 2, 2).c_str(), nullptr, 16));
+            s += 2;
+        } else {
+            die("%s:%d: Bad escape in `send`\n", filename, lineno);
+        }
+        s += 2;
+    }
+    return out;
+}
+
+static std::vector<inputstep> read_input_script(const char* filename) {
+    FILE* f = fopen(filename, "r");
+    if (!f) {
+        perror_die(filename);
+    }
+    std::vector<inputstep> steps;
+    double timeout = 10;
+    char* line = nullptr;
+    size_t cap = 0;
+    ssize_t len;
+    for (int lineno = 1; (len = getline(&line, &cap, f)) >= 0; ++lineno) {
+        if (len > 0 && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        char* arg = line + strcspn(line, " \t");
+        std::string cmd(line, arg - line);
+        arg += strspn(arg, " \t");
+        inputstep step;
+        char* end;
+        if (cmd.empty() || cmd[0] == '#') {
+            continue;
+        } else if (cmd == "wait" && *arg) {
+            regex_t re;
+            int r = regcomp(&re, arg, REG_EXTENDED);
+            if (r != 0) {
+                char buf[256];
+                regerror(r, &re, buf, sizeof(buf));
+                die("%s:%d: %s\n", filename, lineno, buf);
+            }
+            regfree(&re);
+            step.type = inputstep::wait;
+            step.text = arg;
+            step.timeout = timeout;
+        } else if (cmd == "timeout") {
+            timeout = strtod(arg, &end);
+            if (end == arg || *end || !(timeout > 0)) {
+                die("%s:%d: Bad timeout\n", filename, lineno);
+            }
+            continue;
+        } else if (cmd == "send") {
+            step.type = inputstep::send;
+            step.text = unescape_input(arg, filename, lineno);
+        } else if (cmd == "eof" && !*arg) {
+            step.type = inputstep::eof;
+        } else if (cmd == "resize"
+                   && sscanf(arg, "%dx%d", &step.cols, &step.rows) == 2
+                   && step.cols > 0 && step.rows > 0
+                   && step.cols <= max_tsize[0] && step.rows <= max_tsize[1]) {
+            step.type = inputstep::resize;
+        } else {
+            die("%s:%d: Bad input script step\n", filename, lineno);
+        }
+        steps.push_back(std::move(step));
+    }
+    free(line);
+    fclose(f);
+    return steps;
+}
+
+// loop metrics
+//
+// With `--event-source`, `GET /metrics` on the socket returns counters and
+// histograms for the supervisor loop as JSON: poll wakeups, output read
+// sizes, event-client queue depths, the latency from reading input to
+// writing it to the jail, and the latency from reading output to writing
+// it to each event client.
+
+// An HDR-style histogram. Values below 16 are counted exactly; above that,
+// each power of two is split into 16 buckets, so a recorded value is known
+// within about 6%.
+class loghistogram {
+  public:
+    void add(unsigned long long v);
+    std::string json() const;
+
+  private:
+    enum { nbuckets = 16 + 60 * 16 };
+    std::vector<unsigned long long> counts_;
+    unsigned long long n_ = 0;
+    unsigned long long min_ = 0;
+    unsigned long long max_ = 0;
+    unsigned long long sum_ = 0;
+
+    static int bucket(unsigned long long v) {
+        if (v < 16) {
+            return v;
+        }
+        int e = 63 - __builtin_clzll(v);
+        return 16 + (e - 4) * 16 + ((v >> (e - 4)) & 15);
+    }
+    static unsigned long long bucket_low(int i) {
+        if (i < 16) {
+            return i;
+        }
+        int e = (i - 16) / 16 + 4;
+        return (16ULL + (i - 16) % 16) << (e - 4);
+    }
+    unsigned long long percentile(double p) const;
+};
+
+void loghistogram::add(unsigned long long v) {
+    if (counts_.empty()) {
+        counts_.resize(nbuckets);
+    }
+    ++counts_[bucket(v)];
+    min_ = n_ == 0 ? v : std::min(min_, v);
+    max_ = std::max(max_, v);
+    sum_ += v;
+    ++n_;
+}
+
+// Return the highest value equivalent to the `p`th percentile.
+unsigned long long loghistogram::percentile(double p) const {
+    unsigned long long want = std::max(1ULL, (unsigned long long) ceil(p / 100 * n_));
+    unsigned long long seen = 0;
+    for (int i = 0; i != nbuckets; ++i) {
+        seen += counts_[i];
+        if (seen >= want) {
+            return std::min(max_, i + 1 == nbuckets ? max_ : bucket_low(i + 1) - 1);
+        }
+    }
+    return max_;
+}
+
+std::string loghistogram::json() const {
+    if (n_ == 0) {
+        return "{\"count\":0}";
+    }
+    char buf[512];
+    std::string s(buf, sprintf(buf, "{\"count\":%llu,\"min\":%llu,\"max\":%llu,\"mean\":%.1f,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"buckets\":[",
+                               n_, min_, max_, double(sum_) / n_,
+                               percentile(50), percentile(90),
+                               percentile(99), percentile(99.9)));
+    bool first = true;
+    for (int i = 0; i != nbuckets; ++i) {
+        if (counts_[i] != 0) {
+            s.append(buf, sprintf(buf, "%s[%llu,%llu]", first ? "" : ",",
+                                  bucket_low(i), counts_[i]));
+            first = false;
+        }
+    }
+    s += "]}";
+    return s;
+}
+
+
+// resource telemetry
+//
+// `--telemetry SECONDS` samples the jail's resource use every SECONDS and
+// sends it to event clients as `telemetry` events; with `-t FILE`, samples
+// are also appended to FILE.telemetry as JSON lines. The jail has its own
+// PID namespace and /proc, so every process there but us belongs to it.
+
+struct jailusage {
+    unsigned procs = 0;
+    unsigned threads = 0;
+    unsigned long long rss = 0;         // bytes
+    double cpu = 0;                     // seconds, including exited processes
+};
+
+static jailusage sample_jail_usage() {
+    jailusage u;
+#if __linux__
+    static long ticks = sysconf(_SC_CLK_TCK);
+    static long pagesize = sysconf(_SC_PAGESIZE);
+    unsigned long long cputicks = 0;
+    pid_t self = getpid();
+    if (DIR* dir = opendir("/proc")) {
+        while (auto de = readdir(dir)) {
+            char* end;
+            long pid = strtol(de->d_name, &end, 10);
+            if (!isdigit((unsigned char) de->d_name[0]) || *end || pid == self) {
+                continue;
+            }
+            char path[64], buf[1024];
+            snprintf(path, sizeof(path), "/proc/%ld/stat", pid);
+            int fd = open(path, O_RDONLY | O_CLOEXEC);
+            ssize_t nr = fd >= 0 ? read(fd, buf, sizeof(buf) - 1) : -1;
+            if (fd >= 0) {
+                close(fd);
+            }
+            // fields after the command name, which may contain `)`
+            char* p = nr > 0 ? (buf[nr] = '\0', strrchr(buf, ')')) : nullptr;
+            unsigned long long ut, st, cut, cst, threads, rss;
+            if (p && sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %llu %llu %*d %*d %llu %*d %*u %*u %llu",
+                            &ut, &st, &cut, &cst, &threads, &rss) == 6) {
+                ++u.procs;
+                u.threads += threads;
+                u.rss += rss * pagesize;
+                cputicks += ut + st + cut + cst;
+            }
+        }
+        closedir(dir);
+    }
+    struct rusage ru;
+    getrusage(RUSAGE_CHILDREN, &ru);
+    u.cpu = double(cputicks) / ticks
+        + ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+        + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+#endif
+    return u;
+}
+
+// Output published to a hub, transcript, or line index, or scanned for
+// `--extract` markers or `--stop-on` patterns, must be read into memory.
+static bool inspect_output() {
+    return hubfd >= 0 || transcriptfd >= 0 || lineindexfd >= 0
+        || !extracts.empty() || !stop_patterns.empty();
+}
+
+// That output, and output limited by `--max-output` or `--output-rate`,
+// must pass through us.
+static bool capture_output() {
+    return inspect_output() || max_output > 0 || output_rate > 0;
+}
+
+
+// performance counters
+//
+// `--perf-counters LIST` counts the events named in LIST, separated by
+// commas, over every process the command starts. The totals are written
+// to the `--counters-file` at exit as one JSON object; counts
+// are scaled up if the kernel had to multiplex counters, and task-clock
+// is in nanoseconds. The counters are opened on the supervisor before it
+// forks the command, disabled, with `inherit` and `enable_on_exec`, so
+// they count from the command's exec on. Hardware counters are often
+// missing in virtual machines. Those that can't be opened are reported as
+// null, and task-clock, a software event, is always counted.
+
+struct perfcounter {
+    int def;                        // index into `perfcounterdefs`
+    int fd = -1;
+};
+
+static std::vector<perfcounter> perf_counters;
+static int perfcountersfd = -1;
+
+#if __linux__
+struct perfcounterdef {
+    const char* name;
+    uint32_t type;
+    uint64_t config;
+};
+
+static const perfcounterdef perfcounterdefs[] = {
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "branches", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+    { "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { "cache-references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES },
+    { "cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { "task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+    { "page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+    { "minor-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MIN },
+    { "major-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MAJ },
+    { "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+    { "cpu-migrations", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS }
+};
+
+static const int perfcounter_task_clock = 6;
+#endif
+
+static bool parse_perf_counters(const char* list) {
+#if __linux__
+    while (*list) {
+        const char* comma = strchrnul(list, ',');
+        size_t len = comma - list;
+        int def = 0, ndefs = sizeof(perfcounterdefs) / sizeof(perfcounterdefs[0]);
+        while (def != ndefs
+               && (strlen(perfcounterdefs[def].name) != len
+                   || memcmp(perfcounterdefs[def].name, list, len) != 0)) {
+            ++def;
+        }
+        if (def == ndefs) {
+            return false;
+        }
+        perfcounter pc;
+        pc.def = def;
+        perf_counters.push_back(pc);
+        list = *comma ? comma + 1 : comma;
+    }
+    if (!std::any_of(perf_counters.begin(), perf_counters.end(),
+                     [] (const perfcounter& pc) { return pc.def == perfcounter_task_clock; })) {
+        perfcounter pc;
+        pc.def = perfcounter_task_clock;
+        perf_counters.push_back(pc);
+    }
+    return true;
+#else
+    (void) list;
+    die("--perf-counters requires Linux\n");
+#endif
+}
+
+// Open the counters on this process, to be inherited by the command.
+static void open_perf_counters() {
+#if __linux__
+    for (auto& pc : perf_counters) {
+        const perfcounterdef& d = perfcounterdefs[pc.def];
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = d.type;
+        attr.config = d.config;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.enable_on_exec = 1;
+        attr.exclude_hv = 1;
+        pc.fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (pc.fd < 0 && verbose) {
+            fprintf(stderr, "perf counter %s: %s\n", d.name, strerror(errno));
+        }
+    }
+#endif
+}
+
+// Write the counts to `perfcountersfd`. A process's counts are added to
+// ours only when it exits, so every counted process must have exited.
+static void write_perf_counters() {
+#if __linux__
+    std::string json = "{";
+    for (auto& pc : perf_counters) {
+        json += json.size() > 1 ? ",\"" : "\"";
+        json += perfcounterdefs[pc.def].name;
+        json += "\":";
+        uint64_t v[3];          // value, time enabled, time running
+        if (pc.fd >= 0 && read(pc.fd, v, sizeof(v)) == (ssize_t) sizeof(v)) {
+            if (v[2] != 0 && v[2] < v[1]) {
+                v[0] = (uint64_t) ((double) v[0] * v[1] / v[2]);
+            }
+            json += std::to_string(v[0]);
+        } else {
+            json += "null";
+        }
+    }
+    json += "}\n";
+    write_fully(perfcountersfd, json.data(), json.size(), "Counters file");
+#endif
+}
+
+
+// status tables
+//
+// `--status-table FILE` maps FILE, which all runs on a host may share, and
+// keeps this run's state in one of its fixed-size slots, so a reader
+// (`pa-jail ps FILE`, or the queue) can snapshot every run in one read
+// instead of probing pid files. A slot's `owner` is the host PID of the
+// process that claimed it: first the setup process, then the supervisor.
+// Only the owner writes the other fields, under a seqlock. When the run
+// exits, its owner is negated: the slot may then be claimed again, and
+// `pa-jail ps` still shows the PID. A slot whose owner died without
+// exiting cleanly may also be claimed again.
+
+static const char status_table_magic[8] = {'P', 'A', 'S', 'T', 'A', 'T', '1', '\n'};
+static const uint32_t status_table_slots = 1024;
+
+enum statusstate {
+    ss_free, ss_constructing, ss_running, ss_waiting, ss_exited
+};
+static const char* const statusstate_names[] = {
+    "free", "constructing", "running", "waiting", "exited"
+};
+
+struct statusheader {
+    char magic[8];
+    uint32_t nslots;
+    uint32_t slot_size;
+    char padding[48];
+};
+
+struct statusslot {
+    std::atomic<int32_t> owner;
+    std::atomic<uint32_t> seq;          // odd while being written
+    std::atomic<uint32_t> state;
+    std::atomic<int32_t> exit_status;
+    std::atomic<uint64_t> offset;       // output offset
+    std::atomic<uint64_t> start_usec;   // Unix time
+    std::atomic<uint64_t> active_usec;  // Unix time of last input or output
+    std::atomic<uint64_t> tag[11];      // PIDFILE, NUL-padded
+};
+static_assert(sizeof(statusheader) == 64 && sizeof(statusslot) == 128,
+              "status table layout");
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "status table needs lock-free atomics");
+
+struct statussnapshot {
+    int32_t owner;
+    uint32_t state;
+    int32_t exit_status;
+    uint64_t offset;
+    uint64_t start_usec;
+    uint64_t active_usec;
+    char tag[sizeof(statusslot::tag) + 1];
+};
+
+static statusslot* status_slots = nullptr;
+static uint32_t status_nslots = 0;
+static statusslot* status_slot = nullptr;   // this run's slot
+
+static uint64_t unix_usec() {
+    struct timeval tv;
+    gettimeofday(&tv, nullptr);
+    return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+// Map the status table `filename`, creating it if `create` is set.
+static void map_status_table(const std::string& filename, bool create) {
+    size_t size = sizeof(statusheader) + status_table_slots * sizeof(statusslot);
+    int fd = open(filename.c_str(), (create ? O_RDWR | O_CREAT : O_RDONLY) | O_CLOEXEC, 0666);
+    struct stat st;
+    if (fd == -1
+        || flock(fd, create ? LOCK_EX : LOCK_SH) != 0
+        || fstat(fd, &st) != 0) {
+        perror_die(filename);
+    }
+    if (create && st.st_size == 0) {
+        statusheader h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, status_table_magic, sizeof(h.magic));
+        h.nslots = status_table_slots;
+        h.slot_size = sizeof(statusslot);
+        if (ftruncate(fd, size) != 0) {
+            perror_die(filename);
+        }
+        write_fully(fd, &h, sizeof(h), filename.c_str());
+        st.st_size = size;
+    }
+    statusheader h;
+    if (pread(fd, &h, sizeof(h), 0) != ssize_t(sizeof(h))
+        || memcmp(h.magic, status_table_magic, sizeof(h.magic)) != 0
+        || h.slot_size != sizeof(statusslot)
+        || size_t(st.st_size) < sizeof(statusheader) + size_t(h.nslots) * sizeof(statusslot)) {
+        die("%s: Not a status table\n", filename.c_str());
+    }
+    size = sizeof(statusheader) + size_t(h.nslots) * sizeof(statusslot);
+    void* m = mmap(nullptr, size, create ? PROT_READ | PROT_WRITE : PROT_READ,
+                   MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED) {
+        perror_die(filename);
+    }
+    // the mapping keeps the file open, so unlock explicitly
+    flock(fd, LOCK_UN);
+    close(fd);
+    status_slots = reinterpret_cast<statusslot*>(static_cast<char*>(m) + sizeof(statusheader));
+    status_nslots = h.nslots;
+}
+
+// Write this run's slot.
+static void publish_status(statusstate state, int exit_status,
+                           uint64_t offset, uint64_t active_usec) {
+    statusslot* slot = status_slot;
+    if (!slot) {
+        return;
+    }
+    // a claimed slot's previous owner may have died mid-write
+    uint32_t seq = (slot->seq.load(std::memory_order_relaxed) + 1) & ~1U;
+    slot->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot->state.store(state, std::memory_order_relaxed);
+    slot->exit_status.store(exit_status, std::memory_order_relaxed);
+    slot->offset.store(offset, std::memory_order_relaxed);
+    slot->active_usec.store(active_usec, std::memory_order_relaxed);
+    slot->seq.store(seq + 2, std::memory_order_release);
+    if (state == ss_exited) {
+        int32_t owner = slot->owner.load(std::memory_order_relaxed);
+        if (owner > 0) {
+            slot->owner.compare_exchange_strong(owner, -owner, std::memory_order_release);
+        }
+    }
+}
+
+// Claim a free slot, or else one whose run has exited or whose owner has
+// died, for this process and mark it constructing. Runs go on without a
+// slot if the table is full.
+static void claim_status_slot(const std::string& tag) {
+    int32_t self = getpid();
+    for (int pass = 0; pass != 2 && !status_slot; ++pass) {
+        for (uint32_t i = 0; i != status_nslots && !status_slot; ++i) {
+            statusslot& slot = status_slots[i];
+            int32_t owner = slot.owner.load(std::memory_order_relaxed);
+            if ((pass == 0 && owner == 0)
+                || (pass == 1 && owner < 0)
+                || (pass == 1 && owner > 0
+                    && kill(owner, 0) == -1 && errno == ESRCH)) {
+                if (slot.owner.compare_exchange_strong(owner, self)) {
+                    status_slot = &slot;
+                }
+            }
+        }
+    }
+    if (!status_slot) {
+        fprintf(stderr, "%s: status table full\n", statustablefilename.c_str());
+        return;
+    }
+    uint64_t now = unix_usec();
+    uint32_t seq = (status_slot->seq.load(std::memory_order_relaxed) + 1) & ~1U;
+    status_slot->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    status_slot->start_usec.store(now, std::memory_order_relaxed);
+    // keep the end of long names
+    char buf[sizeof(statusslot::tag)] = {};
+    size_t n = std::min(tag.length(), sizeof(buf) - 1);
+    memcpy(buf, tag.data() + tag.length() - n, n);
+    for (size_t w = 0; w != sizeof(buf) / 8; ++w) {
+        uint64_t x;
+        memcpy(&x, buf + w * 8, 8);
+        status_slot->tag[w].store(x, std::memory_order_relaxed);
+    }
+    status_slot->seq.store(seq + 2, std::memory_order_release);
+    publish_status(ss_constructing, -1, 0, now);
+}
+
+// Hand this run's slot to `pid`.
+static void transfer_status_slot(pid_t pid) {
+    if (status_slot) {
+        int32_t self = getpid();
+        status_slot->owner.compare_exchange_strong(self, pid);
+    }
+}
+
+// Copy a consistent snapshot of `slot`. Fails if a writer holds it too long.
+static bool read_status(const statusslot& slot, statussnapshot& snap) {
+    for (int tries = 0; tries != 10000; ++tries) {
+        uint32_t seq = slot.seq.load(std::memory_order_acquire);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        snap.owner = slot.owner.load(std::memory_order_relaxed);
+        snap.state = slot.state.load(std::memory_order_relaxed);
+        snap.exit_status = slot.exit_status.load(std::memory_order_relaxed);
+        snap.offset = slot.offset.load(std::memory_order_relaxed);
+        snap.start_usec = slot.start_usec.load(std::memory_order_relaxed);
+        snap.active_usec = slot.active_usec.load(std::memory_order_relaxed);
+        for (size_t w = 0; w != sizeof(statusslot::tag) / 8; ++w) {
+            uint64_t x = slot.tag[w].load(std::memory_order_relaxed);
+            memcpy(snap.tag + w * 8, &x, 8);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) == seq) {
+            snap.tag[sizeof(snap.tag) - 1] = '\0';
+            return true;
+        }
+    }
+    return false;
+}
+
+// Print every claimed slot in the status table `filename`, including
+// exited runs whose slots haven't been reused. A run that died without
+// exiting cleanly is shown as `lost`.
+[[noreturn]] static void run_ps(const char* filename) {
+    map_status_table(filename, false);
+    uint64_t now = unix_usec();
+    printf("%-8s %-12s %12s %8s %8s %5s %s\n",
+           "PID", "STATE", "OFFSET", "TIME", "IDLE", "EXIT", "PIDFILE");
+    for (uint32_t i = 0; i != status_nslots; ++i) {
+        statussnapshot snap;
+        int32_t owner = status_slots[i].owner.load(std::memory_order_relaxed);
+        if (owner == 0) {
+            continue;
+        } else if (!read_status(status_slots[i], snap)) {
+            printf("%-8d %-12s\n", std::abs(owner), "busy");
+            continue;
+        }
+        const char* state = snap.state <= ss_exited ? statusstate_names[snap.state] : "?";
+        if (snap.owner > 0
+            && snap.state != ss_exited
+            && kill(snap.owner, 0) == -1 && errno == ESRCH) {
+            state = "lost";
+        }
+        char exitbuf[16] = "-";
+        if (snap.state == ss_exited) {
+            snprintf(exitbuf, sizeof(exitbuf), "%d", snap.exit_status);
+        }
+        printf("%-8d %-12s %12llu %8.1f %8.1f %5s %s\n",
+               std::abs(snap.owner), state, (unsigned long long) snap.offset,
+               (now - std::min(now, snap.start_usec)) / 1e6,
+               (now - std::min(now, snap.active_usec)) / 1e6,
+               exitbuf, snap.tag);
+    }
+    exit(0);
+}
+
+
+class jailownerinfo {
+  public:
+    uid_t owner_ = ROOT;
+    gid_t group_ = ROOT;
+    std::string owner_home_;
+    std::string owner_sh_;
+
+    jailownerinfo();
+    ~jailownerinfo();
+
+    void init(const char* owner_name);
+    void set_inputfd(int inputfd);
+    void set_input_script(std::vector<inputstep> script);
+    void set_timeout(double timeout, double idle_timeout);
+    void set_foreground(bool foreground);
+    void set_attach(pid_t pid, int pidfd);
+    void exec(int argc, char** argv, jaildirinfo& jaildir);
+    int exec_go();
+
+  private:
+    std::vector<const char*> newenv_;
+    char** argv_ = nullptr;
+    jaildirinfo* jaildir_;
+    pid_t attach_pid_ = -1;
+    int attach_pidfd_ = -1;         // pidfd for `attach_pid_` (Linux)
+    int inputfd_ = -1;
+    double timeout_ = -1.0;
+    double idle_timeout_ = -1.0;
+    bool foreground_= false;
+    struct timeval start_time_;
+    struct timeval expiry_;
+    struct timeval active_time_;
+    struct timeval idle_expiry_;
+    jbuffer to_slave_;
+    size_t to_slave_off_ = 0;
+    jbuffer from_slave_;
+    size_t from_slave_off_ = 0;
+    jbuffer from_slave_err_;
+    size_t from_slave_err_off_ = 0;
+    int to_slave_fd_ = -1;
+    int from_slave_fd_ = -1;
+    int from_slave_err_fd_ = -1;
+    int slave_pipes_[3] = {-1, -1, -1};
+    bool splice_ok_ = false;
+    int splice_fd_ = -1;            // stdout, or our own description of it
+    spscring* reader_ = nullptr;
+    size_t output_limit_off_ = -1;
+    bool output_exceeded_ = false;
+    unsigned long long output_dropped_ = 0;
+    unsigned long long output_err_dropped_ = 0; // stderr past --max-output
+    std::vector<unsigned char> output_tail_;
+    size_t output_tail_pos_ = 0;
+    double rate_tokens_ = 0;
+    size_t hub_off_ = 0;            // output offset sent to the hub
+    struct timeval rate_time_;
+    std::list<esfd> esfds_;
+    std::list<esfd> espending_;     // clients still sending their request
+    std::list<esfd> esreplies_;     // `/metrics` responses being written
+    size_t es_off_ = 0;
+    std::vector<unsigned char> es_history_;
+    size_t es_history_start_ = 0;
+    size_t es_history_end_ = 0;
+    vtscreen* screen_ = nullptr;    // the terminal as output has left it
+    size_t screen_off_ = 0;         // output offset fed to `screen_`
+    int output_log_fd_ = -1;        // stdout log file, opened for reading
+    off_t output_log_base_ = 0;     // its position minus output offsets
+    unsigned long long metric_wakeups_ = 0;
+    unsigned long long metric_timeouts_ = 0;
+    long long input_time_ = 0;      // when input not yet written arrived
+    uint64_t status_active_usec_ = 0;   // last input or output, for `status_slot`
+    std::deque<std::pair<size_t, long long>> read_times_; // output end offset, read time
+    loghistogram read_sizes_;
+    loghistogram input_latency_;
+    loghistogram output_latency_;
+    loghistogram queue_depths_;
+    bool stdin_tty_;
+    bool stdout_tty_;
+    bool stderr_tty_;
+    int ttyfd_;
+    struct termios ttyfd_termios_;
+    int child_status_ = -1;
+    bool has_blocked_;
+    long long profile_fork_ = 0;    // when the command was forked, until output
+    timingwriter* timing_ = nullptr;
+    struct timespec timing_start_;
+    transcriptwriter* transcript_ = nullptr;
+    size_t transcript_off_ = 0;     // output offset written to `transcript_`
+    lineindexwriter* line_index_ = nullptr;
+    size_t line_index_off_ = 0;     // output offset added to `line_index_`
+    size_t extract_off_ = 0;        // output offset scanned for markers
+    size_t extract_line_off_ = 0;   // output offset of the current line
+    int extract_match_ = -1;        // its `extracts` index; -1 unknown, -2 none
+    std::string extract_line_;      // its text so far, if it may match
+    std::vector<std::string> extracted_; // markers not yet sent to clients
+    patternmatcher stop_matcher_;
+    size_t stop_off_ = 0;           // output offset scanned for patterns
+    int stopped_on_ = -1;           // index of the matched stop pattern
+    std::vector<inputstep> script_;
+    size_t script_step_ = 0;        // next step of `script_`
+    size_t script_off_ = 0;         // output offset added to `script_output_`
+    std::string script_output_;     // output since the last wait matched
+    bool script_waiting_ = false;
+    regex_t script_regex_;
+    struct timeval script_expiry_;
+    bool script_timed_out_ = false;
+    bool script_eof_ = false;       // close the input pipe once drained
+    struct timeval telemetry_next_;
+
+    void start_sigpipe();
+    void block();
+    int check_child_timeout(pid_t child, bool waitpid);
+    void wait_background(pid_t child);
+    bool splice_from_slave(size_t max);
+    size_t output_allowance(int* wait_ms);
+    bool read_from_slave();
+    bool read_from_slave_err();
+    void limit_output();
+    void flush_truncated_output();
+    void broadcast_events();
+    bool write_hub();
+    void record_history();
+    void update_screen();
+    void write_transcript();
+    bool write_output();
+    void write_line_index();
+    void extract_markers();
+    void match_stop_patterns();
+    void run_input_script();
+    void push_json_event(const char* event, char wstype, const std::string& json);
+    void sample_telemetry();
+    void resize_terminal(int cols, int rows);
+    size_t history_start() const;
+    bool read_output_log(size_t first, size_t last, std::string& out);
+    void read_event_requests(bool force);
+    void start_event_source(std::list<esfd>::iterator it);
+    void record_output_latency(esfd& esf);
+    std::string metrics() const;
+    void read_websocket(esfd& esf);
+    void websocket_message(esfd& esf, int opcode, const std::string& msg);
+    size_t consumable_output() const;
+    void write_timing();
+    void make_pipes();
+    void enter_jail();
+    void join_jail();
+    void exec_go_pty(int ptymaster, const char* ptyslavename, pid_t child);
+    void exec_go_pipes();
+    [[noreturn]] void exec_done(pid_t child, int exit_status);
+};
+
+jailownerinfo::jailownerinfo()
+    : to_slave_(4096), from_slave_(8192), from_slave_err_(4096) {
+    stdin_tty_ = isatty(STDIN_FILENO);
+    stdout_tty_ = isatty(STDOUT_FILENO);
+    stderr_tty_ = isatty(STDERR_FILENO);
+    // Assume all tty-opened fds are to the same tty.
+    if (stdin_tty_ || stdout_tty_ || stderr_tty_) {
+        ttyfd_ = stdin_tty_ ? STDIN_FILENO : (stdout_tty_ ? STDOUT_FILENO : STDERR_FILENO);
+        tcgetattr(ttyfd_, &ttyfd_termios_);
+    } else {
+        ttyfd_ = -1;
+    }
+    auto stdout_off = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+    from_slave_.bufpos_ = from_slave_off_ = stdout_off < 0 ? 0 : stdout_off;
+}
+
+jailownerinfo::~jailownerinfo() {
+    delete[] argv_;
+}
+
+void jailownerinfo::set_inputfd(int inputfd) {
+    assert(inputfd_ < 0);
+    inputfd_ = inputfd;
+}
+
+void jailownerinfo::set_input_script(std::vector<inputstep> script) {
+    script_ = std::move(script);
+}
+
+static bool check_shell(const char* shell) {
+    bool found = false;
+    char* sh;
+    while (!found && (sh = getusershell())) {
+        found = strcmp(sh, shell) == 0;
+    }
+    endusershell();
+    return found;
+}
+
+void jailownerinfo::init(const char* owner_name) {
+    if (strlen(owner_name) >= 1024) {
+        die("%s: Username too long\n", owner_name);
+    }
+
+    struct passwd* pwnam = getpwnam(owner_name);
+    if (!pwnam) {
+        die("%s: No such user\n", owner_name);
+    }
+
+    owner_ = pwnam->pw_uid;
+    group_ = pwnam->pw_gid;
+    if (strcmp(pwnam->pw_dir, "/") == 0) {
+        owner_home_ = "/home/nobody";
+    } else if (strncmp(pwnam->pw_dir, "/home/", 6) == 0) {
+        owner_home_ = pwnam->pw_dir;
+    } else {
+        die("%s: Home directory %s not under /home\n", owner_name, pwnam->pw_dir);
+    }
+
+    if (strcmp(pwnam->pw_shell, "/bin/bash") == 0
+        || strcmp(pwnam->pw_shell, "/bin/sh") == 0
+        || check_shell(pwnam->pw_shell)) {
+        owner_sh_ = pwnam->pw_shell;
+    } else {
+        die("%s: Shell %s not allowed by /etc/shells\n", owner_name, pwnam->pw_shell);
+    }
+
+    if (owner_ == ROOT) {
+        die("%s: Jail user cannot be root\n", owner_name);
+    }
+}
+
+#if __linux__
+extern "C" {
+static int exec_clone_function(void* arg) {
+    jailownerinfo* jailowner = static_cast<jailownerinfo*>(arg);
+    return jailowner->exec_go();
+}
+}
+#endif
+
+static void write_pid(int p) {
+    if (pidfd < 0) {
+        return;
+    }
+    lseek(pidfd, 0, SEEK_SET);
+    char buf[1024], *sx = buf;
+    if (p > 0) {
+        const char* s0 = pidcontents.data(), *s1 = s0 + pidcontents.length();
+        while (s0 != s1 && sx != buf + 1024) {
+            if (*s0 == '$' && s0 + 1 != s1 && s0[1] == '$') {
+                int l = snprintf(sx, buf + 1024 - sx, "%d", p);
+                sx += std::min(ssize_t(l), buf + 1024 - sx);
+                s0 += 2;
+            } else {
+                *sx++ = *s0++;
+            }
+        }
+    } else {
+        *sx++ = '*';
+    }
+    if (sx != buf && sx != buf + 1024 && sx[-1] != '\n') {
+        *sx++ = '\n';
+    }
+    ssize_t w = write(pidfd, buf, sx - buf);
+    if (w != ssize_t(sx - buf) || ftruncate(pidfd, w) != 0) {
+        perror_die(pidfilename);
+    }
+}
+
+// Return the supervisor PID recorded in the locked PIDFILE of a live run.
+// The PID is the last number in the file, so `--pid-contents` may add a
+// prefix. On Linux, also open a pidfd for it into `attachfd`.
+static pid_t running_jail_pid(const std::string& filename, int& attachfd) {
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror_die(filename);
+    }
+    if (flock(fd, LOCK_SH | LOCK_NB) == 0) {
+        die("%s: No jail is running\n", filename.c_str());
+    } else if (errno != EWOULDBLOCK) {
+        perror_die(filename);
+    }
+    char buf[1024];
+    ssize_t n = read(fd, buf, sizeof(buf));
+    pid_t p = 0;
+    while (n > 0 && !isdigit((unsigned char) buf[n - 1])) {
+        --n;
+    }
+    for (ssize_t i = n, m = 1; i > 0 && isdigit((unsigned char) buf[i - 1]); --i, m *= 10) {
+        p += (buf[i - 1] - '0') * m;
+    }
+    if (p <= 1) {
+        die("%s: Jail has not started\n", filename.c_str());
+    }
+#if __linux__
+    // pin the process, then check the run still holds the lock, so `p`
+    // can't have been reused in between
+    attachfd = syscall(SYS_pidfd_open, p, 0);
+    if (attachfd == -1 && errno != ESRCH) {
+        perror_die("pidfd_open");
+    } else if (attachfd == -1 || flock(fd, LOCK_SH | LOCK_NB) == 0) {
+        die("%s: No jail is running\n", filename.c_str());
+    }
+#endif
+    close(fd);
+    return p;
+}
+
+static struct timeval timer_add_delay(struct timeval tv, double delay) {
+    struct timeval delta;
+    double sec, usec;
+    usec = modf(delay, &sec);
+    delta.tv_sec = (long) sec;
+    delta.tv_usec = (long) (usec * 1'000'000);
+    timeradd(&tv, &delta, &tv);
+    return tv;
+}
+
+static int timer_difference_ms(const struct timeval& lhs, struct timeval rhs) {
+    timersub(&lhs, &rhs, &rhs);
+    return rhs.tv_sec * 1000 + rhs.tv_usec / 1000;
+}
+
+void jailownerinfo::set_timeout(double timeout, double idle_timeout) {
+    this->timeout_ = timeout;
+    this->idle_timeout_ = idle_timeout;
+}
+
+void jailownerinfo::set_foreground(bool foreground) {
+    this->foreground_ = foreground;
+}
+
+void jailownerinfo::set_attach(pid_t pid, int pidfd) {
+    this->attach_pid_ = pid;
+    this->attach_pidfd_ = pidfd;
+}
+
+void jailownerinfo::exec(int argc, char** argv, jaildirinfo& jaildir) {
+    // adjust environment; make sure we have a PATH
+    char homebuf[8192];
+    sprintf(homebuf, "HOME=%s", owner_home_.c_str());
+    const char* path = "PATH=/usr/local/bin:/bin:/usr/bin";
+    const char* lang = "LANG=C";
+    const char* term = nullptr;
+    const char* ld_library_path = nullptr;
+    {
+        extern char** environ;
+        for (char** eptr = environ; *eptr; ++eptr) {
+            if (strncmp(*eptr, "PATH=", 5) == 0) {
+                path = *eptr;
+            } else if (strncmp(*eptr, "LANG=", 5) == 0) {
+                lang = *eptr;
+            } else if (strncmp(*eptr, "TERM=", 5) == 0) {
+                term = *eptr;
+            } else if (strncmp(*eptr, "LD_LIBRARY_PATH=", 16) == 0) {
+                ld_library_path = *eptr;
+            }
+        }
+    }
+    newenv_.push_back(path);
+    newenv_.push_back(lang);
+    if (term) {
+        newenv_.push_back(term);
+    }
+    if (ld_library_path) {
+        newenv_.push_back(ld_library_path);
+    }
+    newenv_.push_back(homebuf);
+    while (argc > 0) {
+        const char* arg = argv[0];
+        const char* argpos = arg;
+        while (*argpos && (isalnum((unsigned char) *argpos) || *argpos == '_')) {
+            ++argpos;
+        }
+        if (arg == argpos || *argpos != '=') {
+            break;
+        }
+        std::vector<const char*>::size_type i = 0;
+        while (i < newenv_.size() && strncmp(newenv_[i], arg, argpos - arg) != 0) {
+            ++i;
+        }
+        if (i < newenv_.size()) {
+            newenv_[i] = arg;
+        } else {
+            newenv_.push_back(arg);
+        }
+        --argc, ++argv;
+    }
+    newenv_.push_back(nullptr);
+
+    // create command
+    delete[] argv_;
+    argv_ = new char*[5 + argc];
+    if (!argv_) {
+        die("Out of memory\n");
+    }
+    int newargvpos = 0;
+    std::string command;
+    argv_[newargvpos++] = (char*) owner_sh_.c_str();
+    argv_[newargvpos++] = (char*) "-l";
+    if (argc == 0) {
+        // just a login shell
+    } else {
+        argv_[newargvpos++] = (char*) "-c";
+        if (argc == 1) {
+            command = argv[0];
+        } else {
+            command = shell_quote(argv[0]);
+            for (int i = 0; i < argc; ++i) {
+                command += std::string(" ") + shell_quote(argv[i]);
+            }
+        }
+        argv_[newargvpos++] = const_cast<char*>(command.c_str());
+    }
+    argv_[newargvpos++] = nullptr;
+
+    // store other arguments
+    this->jaildir_ = &jaildir;
+    gettimeofday(&this->start_time_, nullptr);
+    clock_gettime(CLOCK_MONOTONIC, &this->timing_start_);
+    if (timingfd != -1) {
+        this->timing_ = new timingwriter(timingfd, timing_binary);
+    }
+    if (transcriptfd != -1) {
+        this->transcript_ = new transcriptwriter(transcriptfd, transcriptindexfd);
+        from_slave_.bufpos_ = from_slave_off_ = this->transcript_off_ = 0;
+    }
+    if (lineindexfd != -1) {
+        this->line_index_ = new lineindexwriter(lineindexfd, from_slave_off_);
+        this->line_index_off_ = from_slave_off_;
+    }
+    this->extract_off_ = this->extract_line_off_ = from_slave_off_;
+    for (auto& pattern : stop_patterns) {
+        this->stop_matcher_.add(pattern);
+    }
+    this->stop_matcher_.build();
+    this->stop_off_ = from_slave_off_;
+    this->script_off_ = from_slave_off_;
+    if (this->timeout_ > 0) {
+        this->expiry_ = timer_add_delay(this->start_time_, this->timeout_);
+    } else {
+        timerclear(&this->expiry_);
+    }
+    if (telemetry_interval > 0) {
+        this->telemetry_next_ = timer_add_delay(this->start_time_, telemetry_interval);
+    }
+    if (this->idle_timeout_ > 0) {
+        this->active_time_ = this->start_time_;
+        this->idle_expiry_ = timer_add_delay(this->active_time_, this->idle_timeout_);
+    }
+
+    // enter the jail
+    profilephase clone_phase(attach_pid_ > 0 ? "attach" : "clone");
+#if __linux__
+    char* new_stack = (char*) malloc(256 * 1024);
+    if (!new_stack) {
+        die("Out of memory\n");
+    }
+    if (verbose) {
+        fprintf(verbosefile, "-clone-\n");
+    }
+    int child;
+    if (attach_pid_ > 0) {
+        free(new_stack);
+        join_jail();
+        if (!dryrun) {
+            child = fork();
+            if (child == 0) {
+                exit(exec_go());
+            }
+        } else {
+            exec_go();
+            exit(0);
+        }
+    } else if (!dryrun) {
+        child = clone(exec_clone_function, new_stack + 256 * 1024,
+                      CLONE_NEWIPC | CLONE_NEWNS | CLONE_NEWPID | SIGCHLD, this);
+    } else {
+        exec_clone_function(this);
+        exit(0);
+    }
+    if (child == -1) {
+        perror_die("clone");
+    }
+#else
+    if (attach_pid_ > 0) {
+        join_jail();
+    }
+    int child = fork();
+    if (child == 0) {
+        exit(exec_go());
+    }
+#endif
+    if (child == -1) {
+        perror_die("fork");
+    }
+    clone_phase.end();
+    transfer_status_slot(child);
+    if (attach_pid_ <= 0) {
+        write_pid(child);
+    }
+
+    // we don't need file descriptors any more
+    close(STDIN_FILENO);
+    close(STDOUT_FILENO);
+    close(STDERR_FILENO);
+
+    int exit_status = 0;
+    if (foreground_) {
+        int r = setresgid(caller_group, caller_group, caller_group);
+        (void) r;
+        r = setresuid(caller_owner, caller_owner, caller_owner);
+        (void) r;
+
+        exit_status = x_waitpid(child, 0).second;
+
+        if (ttyfd_ >= 0) {
+            tcsetattr(ttyfd_, TCSANOW, &ttyfd_termios_);
+        }
+    } else {
+        pidfd = -1;
+    }
+    exit(exit_status);
+}
+
+// Mount the jail's filesystems and make JAILDIR our root.
+void jailownerinfo::enter_jail() {
+    profilephase phase("enter_jail");
+    std::string jdir = jaildir_->dir;
+    assert(jdir.back() == '/');
+    std::string unmounted_jdir = unmounted(jdir);
+    if (unmounted_jdir.back() != '/') {
+        unmounted_jdir += '/';
+    }
+
+#if __linux__
+    mount_status = 2;
+
+    std::string parent_mnt = jdir + "mnt/.parent";
+    std::string unmounted_parent_mnt = unmounted_jdir + "mnt/.parent";
+    if (v_ensuredir(unmounted_parent_mnt, 0777, true) < 0) {
+        perror_die("mkdir -p " + unmounted_parent_mnt);
+    }
+
+    // ensure we truly have a private mount namespace: no shared mounts
+    // (some Linux distros, such as Ubuntu 15.10, have / a shared mount
+    // by default, which means mount changes propagate despite CLONE_NEWNS.
+    // This undoes the shared mount)
+    if (verbose) {
+        fprintf(verbosefile, "mount --make-rslave /\n");
+    }
+    profile_count(pc_mount);
+    if (mount("none", "/", nullptr, MS_REC | MS_SLAVE, nullptr) != 0) {
+        perror_die("mount --make-rslave /");
+    }
+
+    populate_mount_table();     // ensure we know how to mount /proc
+    for (size_t i = 0; i != delayed_mounts.size(); i += 2) {
+        handle_mount(delayed_mounts[i], delayed_mounts[i+1], true);
+    }
+    handle_mount("/proc", jdir + "proc", true);
+    handle_mount("/dev/pts", jdir + "dev/pts", true);
+    handle_mount("/tmp", jdir + "tmp", true);
+    handle_mount("/run", jdir + "run", true);
+#endif
+
+    // chroot
+    profilephase chroot_phase("pivot_root");
+#if __linux__
+    if (unmounted_jdir == jdir) {
+        if (verbose) {
+            fprintf(verbosefile, "mount --bind %s\n", jdir.c_str());
+        }
+        profile_count(pc_mount);
+        if (!dryrun
+            && mount(jdir.c_str(), jdir.c_str(), nullptr, MS_BIND | MS_REC, nullptr) != 0) {
+            perror_die("mount --bind " + jdir);
+        }
+    }
+    if (verbose) {
+        fprintf(verbosefile, "pivot_root %s %s\n", jdir.c_str(), parent_mnt.c_str());
+    }
+    if (!dryrun
+        && syscall(SYS_pivot_root, jdir.c_str(), parent_mnt.c_str()) != 0) {
+        perror_die("pivot_root " + jdir + " " + parent_mnt);
+    }
+    if (verbose) {
+        fprintf(verbosefile, "cd /\n");
+    }
+    if (!dryrun && chdir("/") != 0) {
+        perror_die("cd");
+    }
+    std::string new_parent_mnt = parent_mnt.substr(jdir.size() - 1);
+    if (verbose) {
+        fprintf(verbosefile, "umount %s\n", new_parent_mnt.c_str());
+    }
+    profile_count(pc_umount);
+    if (!dryrun
+        && umount2(new_parent_mnt.c_str(), MNT_DETACH) != 0) {
+        perror_die("umount " + new_parent_mnt);
+    }
+#else
+    if (verbose) {
+        fprintf(verbosefile, "cd %s\n", jdir.c_str());
+    }
+    if (!dryrun && chdir(jdir.c_str()) != 0) {
+        perror_die(jdir);
+    }
+    if (verbose) {
+        fprintf(verbosefile, "chroot .\n");
+    }
+    if (!dryrun && chroot(".") != 0) {
+        perror_die("chroot");
+    }
+#endif
+}
+
+// Join the namespaces and root of the jail running as `attach_pid_`,
+// which must be JAILDIR. The run's root is compared by device and inode,
+// since its `pivot_root` hides the path from us. Everything is looked up
+// through `attach_pidfd_` or a /proc directory opened while it was live,
+// so a reused PID can't redirect us.
+void jailownerinfo::join_jail() {
+#if __linux__
+    std::string proc = "/proc/" + std::to_string(attach_pid_) + "/";
+    int procfd = open(proc.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (procfd == -1
+        || syscall(SYS_pidfd_send_signal, attach_pidfd_, 0, nullptr, 0) != 0) {
+        die("%s: No jail is running\n", pidfilename.c_str());
+    }
+    // the supervisor is init of the jail's PID namespace
+    std::string status;
+    int statusfd = openat(procfd, "status", O_RDONLY | O_CLOEXEC);
+    char buf[4096];
+    ssize_t nr;
+    while (statusfd >= 0 && (nr = read(statusfd, buf, sizeof(buf))) > 0) {
+        status.append(buf, nr);
+    }
+    if (statusfd >= 0) {
+        close(statusfd);
+    }
+    size_t nspid = status.find("\nNSpid:");
+    size_t eol = status.find('\n', nspid + 1);
+    if (nspid == std::string::npos
+        || eol == std::string::npos
+        || status.compare(eol - 2, 2, "\t1") != 0) {
+        die("%s: No jail is running in %s\n", pidfilename.c_str(), jaildir_->dir.c_str());
+    }
+    int rootfd = openat(procfd, "root", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (rootfd == -1) {
+        perror_die(proc + "root");
+    }
+    close(procfd);
+    struct stat rootst, jailst;
+    if (fstat(rootfd, &rootst) != 0) {
+        perror_die(proc + "root");
+    } else if (stat(jaildir_->dir.c_str(), &jailst) != 0) {
+        perror_die(jaildir_->dir);
+    } else if (rootst.st_dev != jailst.st_dev || rootst.st_ino != jailst.st_ino) {
+        die("%s: No jail is running in %s\n", pidfilename.c_str(), jaildir_->dir.c_str());
+    }
+    // join all three namespaces at once
+    if (verbose) {
+        fprintf(verbosefile, "setns %d ipc,mnt,pid\n", attach_pid_);
+    }
+    if (!dryrun
+        && setns(attach_pidfd_, CLONE_NEWIPC | CLONE_NEWNS | CLONE_NEWPID) != 0) {
+        perror_die("setns");
+    }
+    close(attach_pidfd_);
+    attach_pidfd_ = -1;
+    if (verbose) {
+        fprintf(verbosefile, "chroot %s\n", jaildir_->dir.c_str());
+    }
+    if (!dryrun && (fchdir(rootfd) != 0 || chroot(".") != 0)) {
+        perror_die("chroot " + jaildir_->dir);
+    }
+    close(rootfd);
+#else
+    die("pa-jail attach requires Linux\n");
+#endif
+}
+
+int jailownerinfo::exec_go() {
+    profile_tid = 1;
+
+    // an attached command's supervisor has already joined the jail
+    if (attach_pid_ <= 0) {
+        enter_jail();
+    }
+
+    // open performance counters while still root
+    if (!perf_counters.empty() && !dryrun) {
+        open_perf_counters();
+    }
+
+    // upgrade privileges
+    if (verbose) {
+        fprintf(verbosefile, "su %s\n", uid_to_name(owner_));
+    }
+    if (!dryrun) {
+        // change effective uid/gid, but save root for later
+        if (setresgid(group_, group_, ROOT) != 0) {
+            perror_die("setresgid");
+        }
+        if (setresuid(owner_, owner_, ROOT) != 0) {
+            perror_die("setresuid");
+        }
+    }
+
+    // create a pty (or, with --no-pty, pipes)
+    profilephase pty_phase(no_pty ? "pipes" : "pty");
+    int ptymaster = -1;
+    char* ptyslavename = nullptr;
+    if (no_pty) {
+        make_pipes();
+    } else {
+        if (verbose) {
+            fprintf(verbosefile, "make-pty\n");
+        }
+        if (!dryrun) {
+            // create pty
+            if ((ptymaster = posix_openpt(O_RDWR | O_NOCTTY)) == -1) {
+                perror_die("posix_openpt");
+            }
+            struct termios tty;
+            if (tcgetattr(ptymaster, &tty) >= 0) {
+                tty.c_iflag |= BRKINT | IGNPAR | IMAXBEL;
+#ifdef IUTF8
+                tty.c_iflag |= IUTF8;
+#endif
+                tcsetattr(ptymaster, TCSANOW, &tty);
+            }
+            if (grantpt(ptymaster) == -1) {
+                perror_die("grantpt");
+            }
+            if (unlockpt(ptymaster) == -1) {
+                perror_die("unlockpt");
+            }
+            if ((ptyslavename = ptsname(ptymaster)) == nullptr) {
+                perror_die("ptsname");
+            }
+            to_slave_fd_ = from_slave_fd_ = ptymaster;
+        }
+    }
+    pty_phase.end();
+
+    // change into their home directory
+    if (verbose) {
+        fprintf(verbosefile, "cd %s\n", owner_home_.c_str());
+    }
+    if (!dryrun && chdir(owner_home_.c_str()) != 0) {
+        perror_die(owner_home_);
+    }
+
+    // check that shell exists
+    if (!dryrun && access(owner_sh_.c_str(), R_OK | X_OK) != 0) {
+        perror_die(owner_sh_);
+    }
+
+    // print ready marker
+    if (!ready_marker.empty()) {
+        if (verbose) {
+            bool nl = ready_marker.back() == '\n';
+            fprintf(verbosefile, "echo %s%s%s", nl ? "" : "-n ", ready_marker.c_str(), nl ? "" : "\n");
+        }
+        if (!dryrun) {
+            fputs(ready_marker.c_str(), stdout);
+            fflush(stdout);
+        }
+    }
+
+    // run command
+    if (verbose) {
+        for (int i = 0; newenv_[i]; ++i) {
+            fprintf(verbosefile, "%s ", newenv_[i]);
+        }
+        for (int i = 0; argv_[i]; ++i) {
+            fprintf(verbosefile, i ? " %s" : "%s", shell_quote(argv_[i]).c_str());
+        }
+        fprintf(verbosefile, "\n");
+    }
+
+    if (!dryrun) {
+        start_sigpipe();
+        profile_fork_ = monotonic_usec();
+        pid_t child = fork();
+        if (child < 0) {
+            perror_die("fork");
+        } else if (child == 0) {
+            child = getpid();
+            profile_tid = 2;
+            profilephase child_phase("exec");
+#if __linux__
+            // sigfd is close-on-exec, but need to unblock signals
+            sigset_t mask;
+            sigemptyset(&mask);
+            if (sigprocmask(SIG_SETMASK, &mask, nullptr) == -1) {
+                perror_die("sigprocmask");
+            }
+#else
+            close(sigpipe[0]);
+            close(sigpipe[1]);
+#endif
+
+            // reduce privileges permanently
+            if (setresgid(group_, group_, group_) != 0) {
+                perror_die("setresgid");
+            }
+            if (setresuid(owner_, owner_, owner_) != 0) {
+                perror_die("setresuid");
+            }
+            if (setsid() == -1) {
+                perror_die("setsid");
+            }
+            if (ptyslavename) {
+                exec_go_pty(ptymaster, ptyslavename, child);
+            } else if (no_pty) {
+                exec_go_pipes();
+            }
+
+            // restore all signals to their default actions
+            // (e.g., PHP may have ignored SIGPIPE; don't want that
+            // to propagate to student code!)
+            for (int sig = 1; sig < NSIG; ++sig) {
+                signal(sig, SIG_DFL);
+            }
+
+            child_phase.end();
+            int r = execve(argv_[0], (char* const*) argv_,
+                           (char* const*) newenv_.data());
+
+            assert(r < 0);
+            fprintf(stderr, "exec %s: %s\n", owner_sh_.c_str(), strerror(errno));
+            exit(126);
+        }
+
+        for (int i = 0; i != 3; ++i) {
+            if (slave_pipes_[i] >= 0) {
+                close(slave_pipes_[i]);
+            }
+        }
+        wait_background(child);
+    }
+
+    return 0;
+}
+
+void jailownerinfo::make_pipes() {
+    if (verbose) {
+        fprintf(verbosefile, "make-pipes%s\n", separate_stderr ? " --separate-stderr" : "");
+    }
+    if (dryrun) {
+        return;
+    }
+    int p[2];
+    if (inputfd_ > 0) {
+        if (pipe(p) != 0) {
+            perror_die("pipe");
+        }
+        slave_pipes_[0] = p[0];
+        to_slave_fd_ = p[1];
+    }
+    if (pipe(p) != 0) {
+        perror_die("pipe");
+    }
+    from_slave_fd_ = p[0];
+    slave_pipes_[1] = p[1];
+    if (separate_stderr) {
+        if (pipe(p) != 0) {
+            perror_die("pipe");
+        }
+        from_slave_err_fd_ = p[0];
+        slave_pipes_[2] = p[1];
+    }
+}
+
+void jailownerinfo::exec_go_pty(int ptymaster, const char* ptyslavename, pid_t child) {
+    int ptyslave = open(ptyslavename, O_RDWR);
+    if (ptyslave == -1) {
+        perror_die(ptyslavename);
+    }
+    close(ptymaster);
+#ifdef TIOCSCTTY
+    ioctl(ptyslave, TIOCSCTTY, 0);
+#endif
+    tcsetpgrp(ptyslave, child);
+#ifdef TIOCGWINSZ
+    if (tsize[0] > 0) {
+        struct winsize ws;
+        ioctl(ptyslave, TIOCGWINSZ, &ws);
+        ws.ws_row = tsize[1];
+        ws.ws_col = tsize[0];
+        ioctl(ptyslave, TIOCSWINSZ, &ws);
     }
 #endif
     struct termios tty;
@@ -2650,402 +6652,2005 @@ void jailownerinfo::exec_go_pty(int ptymaster, const char* ptyslavename, pid_t c
 #ifdef IUTF8
         tty.c_iflag |= IUTF8;
 #endif
-        if (no_onlcr) {
-            tty.c_oflag &= ~ONLCR;
+        if (no_onlcr) {
+            tty.c_oflag &= ~ONLCR;
+        }
+        tcsetattr(ptyslave, TCSANOW, &tty);
+    }
+
+    if (inputfd_ > 0 || stdin_tty_) {
+        dup2(ptyslave, STDIN_FILENO);
+    }
+    // output published to a hub must pass through us
+    if (inputfd_ > 0 || stdout_tty_ || capture_output()) {
+        dup2(ptyslave, STDOUT_FILENO);
+    }
+    if (inputfd_ > 0 || stderr_tty_ || capture_output()) {
+        dup2(ptyslave, STDERR_FILENO);
+    }
+    close(ptyslave);
+}
+
+void jailownerinfo::exec_go_pipes() {
+    if (slave_pipes_[0] >= 0) {
+        dup2(slave_pipes_[0], STDIN_FILENO);
+    }
+    dup2(slave_pipes_[1], STDOUT_FILENO);
+    dup2(slave_pipes_[2] >= 0 ? slave_pipes_[2] : slave_pipes_[1], STDERR_FILENO);
+    int fds[] = {
+        slave_pipes_[0], slave_pipes_[1], slave_pipes_[2],
+        to_slave_fd_, from_slave_fd_, from_slave_err_fd_
+    };
+    for (int fd : fds) {
+        if (fd > STDERR_FILENO) {
+            close(fd);
+        }
+    }
+}
+
+extern "C" {
+#if !__linux__
+void sighandler(int signo) {
+    if (signo == SIGTERM) {
+        got_sigterm = 1;
+    }
+    char c = (char) signo;
+    ssize_t w = write(sigpipe[1], &c, 1);
+    (void) w;
+}
+#endif
+}
+
+static void make_nonblocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+void jailownerinfo::start_sigpipe() {
+#if __linux__
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGTERM);
+    if (sigprocmask(SIG_BLOCK, &mask, nullptr) == -1) {
+        perror_die("sigprocmask");
+    }
+    sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigfd == -1) {
+        perror_die("signalfd");
+    }
+#else
+    int r = pipe(sigpipe);
+    if (r != 0) {
+        perror_die("pipe");
+    }
+    make_nonblocking(sigpipe[0]);
+    make_nonblocking(sigpipe[1]);
+
+    struct sigaction sa;
+    sa.sa_handler = sighandler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGCHLD, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+#endif
+
+    if (inputfd_ > 0 || stdin_tty_) {
+        make_nonblocking(inputfd_);
+    }
+    if (inputfd_ > 0 || stdout_tty_ || no_pty || capture_output()) {
+        make_nonblocking(STDOUT_FILENO);
+    }
+    if (separate_stderr) {
+        make_nonblocking(STDERR_FILENO);
+    }
+}
+
+
+void jailownerinfo::block() {
+    std::vector<pollfd> p;
+
+#if !__linux__
+    int sigfd = sigpipe[0];
+#endif
+    p.push_back({sigfd, POLLIN, 0});
+
+    if (to_slave_.can_read()) {
+        p.push_back({inputfd_, POLLIN, 0});
+    }
+
+    // don't drain the slave while --output-rate is exceeded
+    int throttle_ms = 3600000;
+    short ptymaster_events = 0;
+    if (from_slave_.can_read() && output_allowance(&throttle_ms) != 0) {
+        ptymaster_events |= POLLIN;
+    }
+    if (to_slave_.can_write()) {
+        ptymaster_events |= POLLOUT;
+    }
+    if (to_slave_fd_ != from_slave_fd_ || reader_) {
+        if (ptymaster_events & POLLIN) {
+            p.push_back({reader_ ? reader_->wakefd() : from_slave_fd_, POLLIN, 0});
+        }
+        if (ptymaster_events & POLLOUT) {
+            p.push_back({to_slave_fd_, POLLOUT, 0});
+        }
+    } else if (ptymaster_events) {
+        p.push_back({from_slave_fd_, ptymaster_events, 0});
+    }
+    if (from_slave_err_.can_read() && output_allowance(&throttle_ms) != 0) {
+        p.push_back({from_slave_err_fd_, POLLIN, 0});
+    }
+
+    if (from_slave_.can_write()
+        && !transcript_
+        && from_slave_off_ != from_slave_.bufpos_ + from_slave_.tail_) {
+        p.push_back({STDOUT_FILENO, POLLOUT, 0});
+    }
+    if (from_slave_err_.can_write()) {
+        p.push_back({STDERR_FILENO, POLLOUT, 0});
+    }
+
+    if (hubfd >= 0 && hub_off_ != from_slave_.bufpos_ + from_slave_.tail_) {
+        p.push_back({hubfd, POLLOUT, 0});
+    }
+
+    size_t eventsourceindex = 0;
+    if (eventsourcefd >= 0) {
+        p.push_back({eventsourcefd, POLLIN, 0});
+        eventsourceindex = p.size() - 1;
+    }
+    for (auto& esf : esfds_) {
+        short events = esf.can_write() ? POLLOUT : 0;
+        if (esf.ws_
+            && !esf.ws_closing_
+            && to_slave_.tail_ - to_slave_.head_ < 65536) {
+            events |= POLLIN;
+        }
+        esf.pollidx_ = events ? int(p.size()) : -1;
+        if (events) {
+            p.push_back({esf.fd_, events, 0});
+        }
+    }
+    for (auto& esf : espending_) {
+        p.push_back({esf.fd_, POLLIN, 0});
+    }
+    for (auto& esf : esreplies_) {
+        p.push_back({esf.fd_, POLLOUT, 0});
+    }
+
+    int timeout_ms = throttle_ms;
+    if (esfds_.size()) {
+        timeout_ms = std::min(timeout_ms, 30000);
+    }
+    if (!espending_.empty()) {
+        timeout_ms = std::min(timeout_ms, 1000);
+    }
+    struct timeval now;
+    if (timerisset(&expiry_) || idle_timeout_ > 0 || script_waiting_
+        || telemetry_interval > 0) {
+        gettimeofday(&now, nullptr);
+    }
+    if (telemetry_interval > 0) {
+        if (timercmp(&now, &telemetry_next_, <)) {
+            timeout_ms = std::min(timeout_ms, timer_difference_ms(telemetry_next_, now));
+        } else {
+            timeout_ms = 0;
+        }
+    }
+    if (script_waiting_) {
+        if (timercmp(&now, &script_expiry_, <)) {
+            timeout_ms = std::min(timeout_ms, timer_difference_ms(script_expiry_, now));
+        } else {
+            timeout_ms = 0;
+        }
+    }
+    if (timerisset(&expiry_)) {
+        if (timercmp(&now, &expiry_, <)) {
+            timeout_ms = std::min(timeout_ms, timer_difference_ms(expiry_, now));
+        } else {
+            timeout_ms = 0;
+        }
+    }
+    if (timerisset(&idle_expiry_)) {
+        if (timercmp(&now, &idle_expiry_, <)) {
+            timeout_ms = std::min(timeout_ms, timer_difference_ms(idle_expiry_, now));
+        } else {
+            timeout_ms = 0;
+        }
+    }
+
+    int pollr = poll(p.data(), p.size(), 0);
+    if (pollr == 0) {
+        has_blocked_ = true;
+        if (transcript_) {
+            transcript_->flush();
+        }
+        if (line_index_) {
+            line_index_->flush();
+        }
+        pollr = poll(p.data(), p.size(), timeout_ms);
+    }
+    assert(pollr >= 0);
+    if (pollr > 0) {
+        ++metric_wakeups_;
+    } else {
+        ++metric_timeouts_;
+    }
+
+    // read from signal pipe
+    if (p[0].revents & POLLIN) {
+#if __linux__
+        struct signalfd_siginfo ssi;
+        ssize_t r;
+        while ((r = read(sigfd, &ssi, sizeof(ssi))) == sizeof(ssi)) {
+            if (ssi.ssi_signo == SIGTERM) {
+                got_sigterm = 1;
+            }
+        }
+        assert(r == 0 || (r == -1 && errno == EAGAIN));
+#else
+        char buf[128];
+        while (read(sigpipe[0], buf, sizeof(buf)) > 0) {
+            /* skip */
+        }
+#endif
+    }
+
+    for (auto& esf : esfds_) {
+        esf.ws_readable_ = esf.ws_ && esf.pollidx_ >= 0
+            && (p[esf.pollidx_].revents & (POLLIN | POLLHUP | POLLERR));
+    }
+
+    // accept new eventsource connections
+    if (eventsourcefd >= 0
+        && (p[eventsourceindex].revents & POLLIN)) {
+        int cfd = accept(eventsourcefd, nullptr, nullptr);
+        if (cfd >= 0) {
+            make_nonblocking(cfd);
+            espending_.emplace_back(cfd);
+            gettimeofday(&espending_.back().request_expiry_, nullptr);
+            espending_.back().request_expiry_ =
+                timer_add_delay(espending_.back().request_expiry_, 1);
+            espending_.back().request_off_ = from_slave_off_;
+        }
+    }
+    if (!espending_.empty()) {
+        read_event_requests(false);
+    }
+}
+
+int jailownerinfo::check_child_timeout(pid_t child, bool waitpid) {
+    std::pair<pid_t, int> xr;
+    do {
+        xr = x_waitpid(-1, WNOHANG);
+        if (xr.first == child) {
+            child_status_ = xr.second;
+        }
+    } while (xr.first != -1);
+
+    if (errno != EAGAIN && errno != ECHILD) {
+        return 125;
+    } else if (child_status_ >= 0 && waitpid) {
+        return child_status_;
+    } else if (got_sigterm) {
+        return 128 + SIGTERM;
+    } else {
+        struct timeval now;
+        if (timerisset(&expiry_) || timerisset(&idle_expiry_)) {
+            gettimeofday(&now, nullptr);
+            if ((timerisset(&expiry_) && timercmp(&now, &expiry_, >))
+                || (timerisset(&idle_expiry_) && timercmp(&now, &idle_expiry_, >))) {
+                return 124;
+            }
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+}
+
+// Send output that no client has seen yet to all clients.
+void jailownerinfo::broadcast_events() {
+    record_history();
+    update_screen();
+    write_transcript();
+    write_line_index();
+    extract_markers();
+    match_stop_patterns();
+    if (esfds_.empty()) {
+        return;
+    }
+    bool any_sse = false, any_ws = false;
+    for (auto& esf : esfds_) {
+        (esf.ws_ ? any_ws : any_sse) = true;
+    }
+    const unsigned char* first = from_slave_.buf_ + (es_off_ - from_slave_.bufpos_);
+    const unsigned char* last = from_slave_.buf_ + from_slave_.tail_;
+    essegment seg, wsseg;
+    size_t newoff = es_off_;
+    if (first == last) {
+        /* nothing new */
+    } else if (any_sse) {
+        newoff = encode_event(es_off_, first, last, seg, from_slave_.rclosed_);
+    } else {
+        newoff = es_off_ + ((from_slave_.rclosed_ ? last : utf8_complete_end(first, last)) - first);
+    }
+    if (newoff != es_off_) {
+        if (any_ws) {
+            encode_ws_output(es_off_, first, first + (newoff - es_off_), wsseg);
+        }
+        es_off_ = newoff;
+        for (auto& esf : esfds_) {
+            esf.push(esf.ws_ ? wsseg : seg, newoff);
+        }
+    }
+
+    // extracted markers follow the output that contains them
+    for (auto& json : extracted_) {
+        push_json_event("extract", 'x', json);
+    }
+    extracted_.clear();
+}
+
+// Send JSON `json` to all clients, as an `event` event or a WebSocket
+// frame of type `wstype`.
+void jailownerinfo::push_json_event(const char* event, char wstype,
+                                    const std::string& json) {
+    essegment seg, wsseg;
+    for (auto& esf : esfds_) {
+        if (esf.ws_ && !wsseg) {
+            auto jb = std::make_shared<jbuffer>(json.size() + 16);
+            ws_frame_header(*jb, 2, json.size() + 1);
+            jb->append(wstype);
+            jb->append(json.data(), json.size());
+            wsseg = std::move(jb);
+        } else if (!esf.ws_ && !seg) {
+            std::string ev = std::string("event:") + event + "\ndata:" + json + "\n\n";
+            seg = make_essegment(ev.data(), ev.size());
+        }
+        esf.push(esf.ws_ ? wsseg : seg, es_off_);
+    }
+}
+
+// Copy output not yet recorded into the `es_history_` ring.
+void jailownerinfo::record_history() {
+    size_t cap = es_history_.size();
+    size_t first = from_slave_.bufpos_ + from_slave_.head_;
+    size_t last = from_slave_.bufpos_ + from_slave_.tail_;
+    if (cap == 0 || last <= es_history_end_) {
+        return;
+    }
+    if (first > es_history_end_) {
+        // output bypassed the buffer (splice)
+        es_history_start_ = first;
+    } else {
+        first = es_history_end_;
+    }
+    first = std::max(first, last - std::min(last, cap));
+    while (first != last) {
+        size_t pos = first % cap;
+        size_t n = std::min(last - first, cap - pos);
+        memcpy(&es_history_[pos], from_slave_.buf_ + (first - from_slave_.bufpos_), n);
+        first += n;
+    }
+    es_history_end_ = last;
+}
+
+// Feed output not yet seen to the terminal screen, up to the last
+// complete UTF-8 character.
+void jailownerinfo::update_screen() {
+    size_t last = from_slave_.bufpos_ + from_slave_.tail_;
+    if (!screen_ || screen_off_ >= last) {
+        return;
+    }
+    screen_off_ = std::max(screen_off_, from_slave_.bufpos_ + from_slave_.head_);
+    const unsigned char* first = from_slave_.buf_ + (screen_off_ - from_slave_.bufpos_);
+    const unsigned char* end = from_slave_.buf_ + from_slave_.tail_;
+    if (!from_slave_.rclosed_) {
+        end = utf8_complete_end(first, end);
+    }
+    screen_->feed(first, end);
+    screen_off_ += end - first;
+}
+
+size_t jailownerinfo::history_start() const {
+    size_t cap = es_history_.size();
+    if (cap == 0) {
+        return -1;
+    }
+    return std::max(es_history_start_, es_history_end_ - std::min(es_history_end_, cap));
+}
+
+// Read output bytes [first, last) back from the transcript or the stdout
+// log file.
+bool jailownerinfo::read_output_log(size_t first, size_t last, std::string& out) {
+    if (transcript_) {
+        // decompress from the transcript, starting at the nearest frame
+        transcript_->flush();
+        size_t pos = out.size(), want = last - first;
+        int r = read_transcript(transcriptfd, transcriptindexfd, first,
+                                [&] (const unsigned char* data, size_t n) {
+            n = std::min(n, want - (out.size() - pos));
+            out.append(reinterpret_cast<const char*>(data), n);
+            return out.size() - pos < want;
+        });
+        if (r != 0 || out.size() - pos != want) {
+            out.resize(pos);
+            return false;
+        }
+        return true;
+    }
+    if (output_log_fd_ < 0) {
+        return false;
+    }
+    size_t pos = out.size();
+    out.resize(pos + (last - first));
+    while (first != last) {
+        ssize_t nr = pread(output_log_fd_, &out[pos], last - first, output_log_base_ + first);
+        if (nr <= 0 && (nr == 0 || errno != EINTR)) {
+            out.resize(pos);
+            return false;
+        } else if (nr > 0) {
+            first += nr;
+            pos += nr;
+        }
+    }
+    return true;
+}
+
+// Parse requests from new event-source clients, and start streaming to
+// clients whose request is complete (or who took too long to send one).
+void jailownerinfo::read_event_requests(bool force) {
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+    for (auto it = espending_.begin(); it != espending_.end(); ) {
+        char buf[2048];
+        ssize_t nr;
+        while (it->request_.size() < 8192
+               && (nr = read(it->fd_, buf, sizeof(buf))) > 0) {
+            it->request_.append(buf, nr);
+        }
+        if (force
+            || it->request_.size() >= 8192
+            || nr == 0
+            || (nr == -1 && errno != EAGAIN && errno != EINTR)
+            || event_request_complete(it->request_)
+            || timercmp(&now, &it->request_expiry_, >)) {
+            auto next = std::next(it);
+            start_event_source(it);
+            it = next;
+        } else {
+            ++it;
+        }
+    }
+}
+
+// Move a client whose request has arrived from `espending_` to `esfds_`,
+// and queue its response and the output it asked for.
+void jailownerinfo::start_event_source(std::list<esfd>::iterator it) {
+    static const char message[] = "HTTP/1.1 200 OK\r\nCache-Control: no-store\r\nContent-Type: text/event-stream\r\nX-Accel-Buffering: no\r\n\r\n";
+    static essegment header = make_essegment(message, sizeof(message) - 1);
+    if (event_request_path(it->request_) == "/metrics") {
+        std::string body = metrics();
+        std::string h = "HTTP/1.1 200 OK\r\nCache-Control: no-store\r\nContent-Type: application/json\r\nContent-Length: "
+            + std::to_string(body.length()) + "\r\n\r\n" + body;
+        esreplies_.splice(esreplies_.end(), espending_, it);
+        esreplies_.back().push(make_essegment(h.data(), h.size()), 0, true);
+        return;
+    }
+    size_t off = it->request_off_;
+    event_request_offset(it->request_, off);
+    // bring existing clients up to date
+    broadcast_events();
+    // a snapshot reflects output through `screen_off_`
+    bool snapshot = screen_
+        && event_request_snapshot(it->request_)
+        && (esfds_.empty() || screen_off_ == es_off_);
+    if (snapshot) {
+        off = screen_off_;
+    }
+
+    // collect output from `start`: from the transcript or log file, then
+    // history, then the buffer. A client can't queue more than
+    // --event-client-buffer, so output older than that is skipped rather
+    // than read.
+    size_t buf_first = from_slave_.bufpos_ + from_slave_.head_;
+    size_t last = from_slave_.bufpos_ + from_slave_.tail_;
+    size_t mem_first = std::min(buf_first, history_start());
+    off = std::min(off, last);
+    size_t start = off;
+    if (event_client_buffer > 0 && last - start > event_client_buffer) {
+        start = last - event_client_buffer;
+    }
+    std::string bytes;
+    if (start < mem_first && !read_output_log(start, mem_first, bytes)) {
+        start = off = mem_first;
+    }
+    size_t cap = es_history_.size();
+    for (size_t x = std::max(start, mem_first); x < buf_first; ) {
+        size_t pos = x % cap;
+        size_t n = std::min(buf_first - x, cap - pos);
+        bytes.append(reinterpret_cast<char*>(&es_history_[pos]), n);
+        x += n;
+    }
+    const unsigned char* bfirst = from_slave_.buf_ + from_slave_.head_;
+    if (start > buf_first) {
+        bfirst += start - buf_first;
+    }
+    bytes.append(reinterpret_cast<const char*>(bfirst), from_slave_.buf_ + from_slave_.tail_ - bfirst);
+
+    // send the response header
+    esfds_.splice(esfds_.end(), espending_, it);
+    esfd& esf = esfds_.back();
+    esf.written_off_ = off;
+    std::string accept;
+    int window_bits;
+    if (event_request_websocket(esf.request_, accept)) {
+        esf.ws_ = true;
+        std::string h = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: " + accept + "\r\n\r\n";
+        esf.push(make_essegment(h.data(), h.size()), off, true);
+    } else if ((window_bits = event_request_encoding(esf.request_)) != 0
+               && esf.start_deflate(window_bits)) {
+        // the header is sent uncompressed
+        esf.zout_.assign(message, sizeof(message) - 3);
+        esf.zout_.append(window_bits > 15 ? "Content-Encoding: gzip\r\n\r\n" : "Content-Encoding: deflate\r\n\r\n");
+    } else {
+        esf.push(header, off, true);
+    }
+    esf.request_.clear();
+    esf.request_.shrink_to_fit();
+    if (snapshot) {
+        esf.push(encode_snapshot(off, *screen_, esf.ws_), off);
+    }
+    if (start != off) {
+        esf.resync(start);
+        off = start;
+    }
+
+    // encode in chunks, kept whole: `start` already bounds their size
+    auto encode = [&esf] (size_t off, const unsigned char* first,
+                          const unsigned char* last, essegment& seg,
+                          bool flush) {
+        if (!esf.ws_) {
+            return encode_event(off, first, last, seg, flush);
+        }
+        const unsigned char* stop = flush ? last : utf8_complete_end(first, last);
+        encode_ws_output(off, first, stop, seg);
+        return off + (stop - first);
+    };
+    const unsigned char* first = reinterpret_cast<const unsigned char*>(bytes.data());
+    size_t pos = 0;
+    while (true) {
+        size_t n = std::min(bytes.size() - pos, size_t(65536));
+        essegment seg;
+        size_t stop = encode(off + pos, first + pos, first + pos + n, seg, false);
+        if (pos + n == bytes.size()) {
+            if (stop < buf_first || (stop != last && from_slave_.rclosed_)) {
+                // incomplete character that output can no longer complete
+                stop = encode(off + pos, first + pos, first + pos + n, seg, true);
+            }
+            assert(esfds_.size() == 1 || stop == es_off_);
+            es_off_ = stop;
+            esf.push(std::move(seg), stop, true);
+            esf.metric_off_ = last;
+            break;
+        }
+        esf.push(std::move(seg), stop, true);
+        pos = stop - off;
+    }
+}
+
+// Record the latency of output that `esf` has written since last time,
+// from when it was read from the jail.
+void jailownerinfo::record_output_latency(esfd& esf) {
+    if (esf.written_off_ <= esf.metric_off_) {
+        return;
+    }
+    auto it = std::upper_bound(read_times_.begin(), read_times_.end(), esf.metric_off_,
+                               [] (size_t off, const std::pair<size_t, long long>& rt) {
+                                   return off < rt.first;
+                               });
+    long long now = monotonic_usec();
+    for (; it != read_times_.end() && it->first <= esf.written_off_; ++it) {
+        output_latency_.add(now - it->second);
+    }
+    esf.metric_off_ = esf.written_off_;
+}
+
+std::string jailownerinfo::metrics() const {
+    char buf[512];
+    std::string s(buf, sprintf(buf, "{\"offset\":%zu,\"wakeups\":%llu,\"poll_timeouts\":%llu,\"clients\":%zu,\"bytes_out\":%llu,\"dropped\":%llu,\"resyncs\":%llu,\"client_queued\":[",
+                               from_slave_.bufpos_ + from_slave_.tail_,
+                               metric_wakeups_, metric_timeouts_, esfds_.size(),
+                               event_bytes_written, event_dropped_bytes, event_resyncs));
+    for (auto& esf : esfds_) {
+        s.append(buf, sprintf(buf, "%s%zu", &esf == &esfds_.front() ? "" : ",", esf.queued_));
+    }
+    s += "],\"read_bytes\":" + read_sizes_.json()
+        + ",\"client_queue_bytes\":" + queue_depths_.json()
+        + ",\"input_latency_usec\":" + input_latency_.json()
+        + ",\"output_latency_usec\":" + output_latency_.json()
+        + "}\n";
+    return s;
+}
+
+// Read frames from a WebSocket client and act on complete messages.
+void jailownerinfo::read_websocket(esfd& esf) {
+    char buf[4096];
+    ssize_t nr = 0;
+    while (esf.wsin_.size() < 65536
+           && (nr = read(esf.fd_, buf, sizeof(buf))) > 0) {
+        esf.wsin_.append(buf, nr);
+    }
+    if (nr == 0 || (nr == -1 && errno != EAGAIN && errno != EINTR)) {
+        esf.wclosed_ = true;
+        return;
+    }
+    size_t pos = 0;
+    while (!esf.ws_closing_) {
+        const unsigned char* f = reinterpret_cast<const unsigned char*>(esf.wsin_.data()) + pos;
+        size_t avail = esf.wsin_.size() - pos;
+        if (avail < 2) {
+            break;
+        }
+        int opcode = f[0] & 15;
+        uint64_t len = f[1] & 127;
+        size_t hlen = 2;
+        if (len == 126 && avail >= 4) {
+            len = (f[2] << 8) | f[3];
+            hlen = 4;
+        } else if (len == 127 && avail >= 10) {
+            len = 0;
+            for (int i = 0; i != 8; ++i) {
+                len = (len << 8) | f[2 + i];
+            }
+            hlen = 10;
+        } else if (len >= 126) {
+            break;
+        }
+        if (!(f[1] & 0x80)
+            || len > 65536 - 14
+            || (opcode >= 8 && (len > 125 || !(f[0] & 0x80)))) {
+            // unmasked or oversized frame
+            esf.push(make_ws_control(8, "\x03\xEA", 2), esf.queued_end(), true);
+            esf.ws_closing_ = true;
+            break;
+        }
+        if (avail < hlen + 4 + len) {
+            break;
+        }
+        const unsigned char* mask = f + hlen;
+        std::string payload(reinterpret_cast<const char*>(mask + 4), len);
+        for (size_t i = 0; i != len; ++i) {
+            payload[i] ^= mask[i % 4];
+        }
+        pos += hlen + 4 + len;
+        if (opcode >= 8) {
+            websocket_message(esf, opcode, payload);
+            continue;
+        }
+        if (opcode != 0) {
+            esf.wsmsg_opcode_ = opcode;
+            esf.wsmsg_.clear();
+        }
+        esf.wsmsg_ += payload;
+        if (f[0] & 0x80) {
+            websocket_message(esf, esf.wsmsg_opcode_, esf.wsmsg_);
+            esf.wsmsg_.clear();
+        } else if (esf.wsmsg_.size() > 65536) {
+            esf.push(make_ws_control(8, "\x03\xF1", 2), esf.queued_end(), true);
+            esf.ws_closing_ = true;
+        }
+    }
+    esf.wsin_.erase(0, pos);
+}
+
+void jailownerinfo::websocket_message(esfd& esf, int opcode, const std::string& msg) {
+    bool can_input = event_input && to_slave_fd_ >= 0 && !to_slave_.wclosed_;
+    if (opcode == 8) {
+        esf.push(make_ws_control(8, "\x03\xE8", 2), esf.queued_end(), true);
+        esf.ws_closing_ = true;
+    } else if (opcode == 9) {
+        esf.push(make_ws_control(10, msg.data(), msg.size()), esf.queued_end(), true);
+    } else if (opcode == 1 && can_input) {
+        to_slave_.append(msg.data(), msg.size());
+    } else if (opcode == 2 && !msg.empty() && msg[0] == 'i' && can_input) {
+        to_slave_.append(msg.data() + 1, msg.size() - 1);
+    } else if (opcode == 2 && msg.size() == 5 && msg[0] == 'w' && event_input) {
+        const unsigned char* m = reinterpret_cast<const unsigned char*>(msg.data());
+        resize_terminal((m[1] << 8) | m[2], (m[3] << 8) | m[4]);
+    }
+}
+
+void jailownerinfo::resize_terminal(int cols, int rows) {
+#ifdef TIOCSWINSZ
+    // a client may ask for anything; `screen_` must stay allocatable
+    struct winsize ws;
+    memset(&ws, 0, sizeof(ws));
+    ws.ws_col = std::min(cols, int(max_tsize[0]));
+    ws.ws_row = std::min(rows, int(max_tsize[1]));
+    if (!no_pty && from_slave_fd_ >= 0 && ws.ws_col > 0 && ws.ws_row > 0) {
+        ioctl(from_slave_fd_, TIOCSWINSZ, &ws);
+        if (screen_) {
+            update_screen();
+            screen_->resize(ws.ws_col, ws.ws_row);
+        }
+    }
+#else
+    (void) cols, (void) rows;
+#endif
+}
+
+// Send output the hub hasn't seen. If the hub goes away, the run
+// continues without it.
+bool jailownerinfo::write_hub() {
+    size_t last = from_slave_.bufpos_ + from_slave_.tail_;
+    if (hubfd < 0 || hub_off_ == last) {
+        return false;
+    }
+    ssize_t nw = write(hubfd, from_slave_.buf_ + (hub_off_ - from_slave_.bufpos_),
+                       last - hub_off_);
+    if (nw > 0) {
+        hub_off_ += nw;
+        return true;
+    } else if (nw == 0 || (errno != EINTR && errno != EAGAIN)) {
+        if (verbose) {
+            fprintf(stderr, "hub: %s%s", strerror(nw ? errno : EPIPE), no_onlcr ? "\n" : "\r\n");
+        }
+        close(hubfd);
+        hubfd = -1;
+    }
+    return false;
+}
+
+// Output written to stdout may be released only once every event-source
+// client has been sent it. Without clients, keep a possibly incomplete
+// UTF-8 character so a client that connects later can resume at it,
+// unless no more output can complete it.
+size_t jailownerinfo::consumable_output() const {
+    size_t off = from_slave_off_;
+    if (hubfd >= 0) {
+        off = std::min(off, hub_off_);
+    }
+    if (screen_) {
+        off = std::min(off, screen_off_);
+    }
+    if (transcript_) {
+        off = std::min(off, transcript_off_);
+    }
+    if (line_index_) {
+        off = std::min(off, line_index_off_);
+    }
+    if (!extracts.empty()) {
+        off = std::min(off, extract_off_);
+    }
+    if (!stop_matcher_.empty()) {
+        off = std::min(off, stop_off_);
+    }
+    if (script_step_ != script_.size()) {
+        off = std::min(off, script_off_);
+    }
+    if (!esfds_.empty()) {
+        off = std::min(off, es_off_);
+    } else if (eventsourcefd >= 0 && !splice_ok_ && !from_slave_.rclosed_) {
+        size_t last = from_slave_.bufpos_ + from_slave_.tail_;
+        off = std::min(off, last - std::min(last, size_t(3)));
+    }
+    return std::max(off, from_slave_.bufpos_ + from_slave_.head_);
+}
+
+void jailownerinfo::write_transcript() {
+    size_t last = from_slave_.bufpos_ + from_slave_.tail_;
+    if (transcript_ && transcript_off_ != last) {
+        size_t first = std::max(transcript_off_, from_slave_.bufpos_ + from_slave_.head_);
+        transcript_->write(from_slave_.buf_ + (first - from_slave_.bufpos_),
+                           from_slave_.buf_ + from_slave_.tail_);
+        transcript_off_ = last;
+    }
+}
+
+// Write output to stdout, or with --transcript, to the transcript in its
+// place.
+bool jailownerinfo::write_output() {
+    if (!transcript_) {
+        return from_slave_.write(STDOUT_FILENO, from_slave_off_);
+    }
+    write_transcript();
+    bool any = from_slave_off_ != transcript_off_;
+    from_slave_off_ = transcript_off_;
+    return any;
+}
+
+void jailownerinfo::write_line_index() {
+    size_t last = from_slave_.bufpos_ + from_slave_.tail_;
+    if (line_index_ && line_index_off_ != last) {
+        size_t first = std::max(line_index_off_, from_slave_.bufpos_ + from_slave_.head_);
+        line_index_->add(from_slave_.buf_ + (first - from_slave_.bufpos_),
+                         from_slave_.buf_ + from_slave_.tail_);
+        line_index_off_ = last;
+    }
+}
+
+// Find output lines that begin with an `--extract` prefix, append them
+// to the prefix's file, and queue them for event clients. Lines may span
+// reads; those longer than `extract_max_line` are cut short.
+void jailownerinfo::extract_markers() {
+    if (extracts.empty()) {
+        return;
+    }
+    size_t prefix_max = 0;
+    for (auto& x : extracts) {
+        prefix_max = std::max(prefix_max, x.prefix.size());
+    }
+    size_t last = from_slave_.bufpos_ + from_slave_.tail_;
+    size_t off = std::max(extract_off_, from_slave_.bufpos_ + from_slave_.head_);
+    const unsigned char* p = from_slave_.buf_ + (off - from_slave_.bufpos_);
+    const unsigned char* end = from_slave_.buf_ + from_slave_.tail_;
+    // at end of output, finish a final line without a newline
+    while (p != end || (from_slave_.rclosed_ && !extract_line_.empty())) {
+        auto nl = reinterpret_cast<const unsigned char*>(memchr(p, '\n', end - p));
+        auto stop = nl ? nl : end;
+        bool eol = nl || from_slave_.rclosed_;
+        if (extract_match_ != -2 && extract_line_.size() < extract_max_line) {
+            size_t n = std::min(size_t(stop - p), extract_max_line - extract_line_.size());
+            extract_line_.append(reinterpret_cast<const char*>(p), n);
+        }
+        if (extract_match_ == -1
+            && (eol || extract_line_.size() >= prefix_max)) {
+            extract_match_ = -2;
+            for (size_t i = 0; i != extracts.size(); ++i) {
+                if (extract_line_.compare(0, extracts[i].prefix.size(), extracts[i].prefix) == 0) {
+                    extract_match_ = i;
+                    break;
+                }
+            }
+        }
+        p = stop;
+        if (eol) {
+            size_t end_off = last - (end - p);
+            if (extract_match_ >= 0) {
+                const extractspec& x = extracts[extract_match_];
+                std::string payload = extract_line_.substr(x.prefix.size());
+                if (!payload.empty() && payload.back() == '\r') {
+                    payload.pop_back();
+                }
+                std::string json = encode_extract(extract_line_off_, end_off, x.prefix, payload);
+                if (!esfds_.empty()) {
+                    extracted_.push_back(json);
+                }
+                json += '\n';
+                write_fully(x.fd, json.data(), json.size(), x.filename.c_str());
+            }
+            extract_line_.clear();
+            extract_match_ = -1;
+            if (nl) {
+                ++p;
+                extract_line_off_ = end_off + 1;
+            }
+        }
+    }
+    extract_off_ = last;
+}
+
+void jailownerinfo::match_stop_patterns() {
+    size_t last = from_slave_.bufpos_ + from_slave_.tail_;
+    if (stop_matcher_.empty() || stopped_on_ >= 0 || stop_off_ == last) {
+        return;
+    }
+    size_t off = std::max(stop_off_, from_slave_.bufpos_ + from_slave_.head_);
+    const unsigned char* p = from_slave_.buf_ + (off - from_slave_.bufpos_);
+    stopped_on_ = stop_matcher_.find(p, from_slave_.buf_ + from_slave_.tail_);
+    stop_off_ = last;
+}
+
+// Run `--input-script` steps until one must wait for output.
+void jailownerinfo::run_input_script() {
+    size_t last = from_slave_.bufpos_ + from_slave_.tail_;
+    if (script_step_ != script_.size() && script_off_ != last) {
+        size_t first = std::max(script_off_, from_slave_.bufpos_ + from_slave_.head_);
+        size_t pos = script_output_.size();
+        script_output_.append(reinterpret_cast<const char*>(from_slave_.buf_ + (first - from_slave_.bufpos_)), last - first);
+        // regexec() stops at a null character
+        std::replace(script_output_.begin() + pos, script_output_.end(), '\0', ' ');
+        if (script_output_.size() > input_script_window) {
+            script_output_.erase(0, script_output_.size() - input_script_window);
+        }
+        script_off_ = last;
+    }
+    bool can_input = to_slave_fd_ >= 0 && !to_slave_.wclosed_;
+    while (script_step_ != script_.size()) {
+        const inputstep& step = script_[script_step_];
+        if (step.type == inputstep::wait) {
+            struct timeval now;
+            gettimeofday(&now, nullptr);
+            if (!script_waiting_) {
+                regcomp(&script_regex_, step.text.c_str(), REG_EXTENDED);
+                script_expiry_ = timer_add_delay(now, step.timeout);
+                script_waiting_ = true;
+            }
+            regmatch_t m;
+            if (regexec(&script_regex_, script_output_.c_str(), 1, &m, 0) != 0) {
+                script_timed_out_ = timercmp(&now, &script_expiry_, >);
+                return;
+            }
+            script_output_.erase(0, m.rm_eo);
+            regfree(&script_regex_);
+            script_waiting_ = false;
+        } else if (step.type == inputstep::send && can_input) {
+            to_slave_.append(step.text.data(), step.text.size());
+        } else if (step.type == inputstep::eof && can_input) {
+            if (no_pty) {
+                script_eof_ = true;
+            } else {
+                to_slave_.append('\x04');
+            }
+        } else if (step.type == inputstep::resize) {
+            resize_terminal(step.cols, step.rows);
+        }
+        ++script_step_;
+    }
+    if (script_eof_
+        && to_slave_off_ == to_slave_.bufpos_ + to_slave_.tail_
+        && can_input) {
+        close(to_slave_fd_);
+        to_slave_fd_ = -1;
+        to_slave_.wclosed_ = true;
+        script_eof_ = false;
+    }
+}
+
+void jailownerinfo::sample_telemetry() {
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+    if (timercmp(&now, &telemetry_next_, <)) {
+        return;
+    }
+    telemetry_next_ = timer_add_delay(now, telemetry_interval);
+    jailusage u = sample_jail_usage();
+    char buf[256];
+    int n = snprintf(buf, sizeof(buf), "{\"offset\":%zu,\"time\":%.3f,\"procs\":%u,\"threads\":%u,\"rss\":%llu,\"cpu\":%.3f}",
+                     from_slave_off_, timer_difference_ms(now, start_time_) / 1000.0,
+                     u.procs, u.threads, u.rss, u.cpu);
+    std::string json(buf, n);
+    push_json_event("telemetry", 't', json);
+    if (telemetryfd >= 0) {
+        json += '\n';
+        write_fully(telemetryfd, json.data(), json.size(), "Telemetry file");
+    }
+}
+
+void jailownerinfo::write_timing() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long usec = (now.tv_sec - timing_start_.tv_sec) * 1'000'000LL
+        + (now.tv_nsec - timing_start_.tv_nsec) / 1000;
+    timing_->add(std::max(usec, 0LL), from_slave_off_);
+}
+
+// In --no-pty mode, move output from the pipe straight into a regular
+// stdout file without copying it through user space. Only possible while
+// no one else needs to see the bytes.
+bool jailownerinfo::splice_from_slave(size_t max) {
+#if __linux__
+    max = std::min(max, output_limit_off_ - from_slave_off_);
+    if (!splice_ok_
+        || !from_slave_.can_read()
+        || !from_slave_.empty()
+        || !esfds_.empty()
+        || inspect_output()
+        || max == 0) {
+        return false;
+    }
+    if (splice_fd_ != STDOUT_FILENO && lseek(splice_fd_, 0, SEEK_END) < 0) {
+        splice_ok_ = false;
+        return false;
+    }
+    ssize_t nw = splice(from_slave_fd_, nullptr, splice_fd_, nullptr,
+                        std::min(max, size_t(1 << 20)),
+                        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (nw > 0) {
+        from_slave_.bufpos_ += nw;
+        from_slave_off_ += nw;
+        return true;
+    } else if (nw == 0) {
+        from_slave_.rclosed_ = true;
+    } else if (errno != EINTR && errno != EAGAIN) {
+        // fall back to read/write, which will report any real error
+        splice_ok_ = false;
+    }
+#else
+    (void) max;
+#endif
+    return false;
+}
+
+// Return the number of output bytes --output-rate allows us to read now.
+// If none, lower `*wait_ms` to the time until more are allowed.
+size_t jailownerinfo::output_allowance(int* wait_ms) {
+    if (output_rate <= 0) {
+        return -1;
+    }
+    struct timeval now, delta;
+    gettimeofday(&now, nullptr);
+    timersub(&now, &rate_time_, &delta);
+    rate_tokens_ = std::min(std::max(output_rate, 1.0),
+                            rate_tokens_ + (delta.tv_sec + delta.tv_usec / 1e6) * output_rate);
+    rate_time_ = now;
+    if (rate_tokens_ >= 1) {
+        return (size_t) rate_tokens_;
+    }
+    if (wait_ms) {
+        int ms = (int) ceil((1 - rate_tokens_) * 1000 / output_rate);
+        *wait_ms = std::min(*wait_ms, std::max(ms, 1));
+    }
+    return 0;
+}
+
+bool jailownerinfo::read_from_slave() {
+    size_t allowance = output_allowance(nullptr);
+    size_t old_end = from_slave_.bufpos_ + from_slave_.tail_;
+    bool any;
+    if (reader_) {
+        any = from_slave_.read(*reader_, allowance);
+    } else {
+        any = splice_from_slave(allowance)
+            || from_slave_.read(from_slave_fd_, allowance);
+    }
+    size_t new_end = from_slave_.bufpos_ + from_slave_.tail_;
+    if (output_rate > 0) {
+        rate_tokens_ -= new_end - old_end;
+    }
+    if (eventsourcefd >= 0 && new_end > old_end) {
+        read_sizes_.add(new_end - old_end);
+        if (!esfds_.empty()) {
+            read_times_.emplace_back(new_end, monotonic_usec());
+        }
+    }
+    if (new_end > output_limit_off_) {
+        limit_output();
+    }
+    return any;
+}
+
+// Read separate stderr under the same --max-output and --output-rate
+// budget as stdout. Excess stderr is dropped, not kept in `output_tail_`.
+bool jailownerinfo::read_from_slave_err() {
+    size_t old_end = from_slave_err_.bufpos_ + from_slave_err_.tail_;
+    bool any = from_slave_err_.read(from_slave_err_fd_, output_allowance(nullptr));
+    size_t n = from_slave_err_.bufpos_ + from_slave_err_.tail_ - old_end;
+    if (output_rate > 0) {
+        rate_tokens_ -= n;
+    }
+    if (max_output > 0 && n > 0) {
+        size_t out_end = from_slave_.bufpos_ + from_slave_.tail_;
+        size_t left = output_limit_off_ > out_end ? output_limit_off_ - out_end : 0;
+        if (n > left) {
+            if (!max_output_truncate) {
+                output_exceeded_ = true;
+            }
+            output_err_dropped_ += n - left;
+            from_slave_err_.tail_ -= n - left;
+            n = left;
+        }
+        output_limit_off_ -= n;
+    }
+    return any;
+}
+
+// Handle output past --max-output. Either mark the run for termination
+// or keep the excess in the `output_tail_` ring.
+void jailownerinfo::limit_output() {
+    size_t n = from_slave_.bufpos_ + from_slave_.tail_ - output_limit_off_;
+    const unsigned char* excess = from_slave_.buf_ + (output_limit_off_ - from_slave_.bufpos_);
+    if (!max_output_truncate) {
+        output_exceeded_ = true;
+    } else if (!output_tail_.empty()) {
+        size_t cap = output_tail_.size();
+        if (n >= cap) {
+            excess += n - cap;
+            memcpy(output_tail_.data(), excess, cap);
+            output_tail_pos_ = 0;
+        } else {
+            size_t n1 = std::min(n, cap - output_tail_pos_);
+            memcpy(output_tail_.data() + output_tail_pos_, excess, n1);
+            memcpy(output_tail_.data(), excess + n1, n - n1);
+            output_tail_pos_ = (output_tail_pos_ + n) % cap;
+        }
+    }
+    output_dropped_ += n;
+    from_slave_.tail_ -= n;
+}
+
+// At exit, append a truncation marker and the retained tail to the output.
+void jailownerinfo::flush_truncated_output() {
+    size_t cap = output_tail_.size();
+    size_t kept = std::min(output_dropped_, (unsigned long long) cap);
+    const char* nl = no_onlcr ? "\n" : "\r\n";
+    char buf[256];
+    int n = snprintf(buf, sizeof(buf), "%s...[%llu bytes of output truncated]...%s",
+                     nl, output_dropped_ - kept + output_err_dropped_, nl);
+    from_slave_.append(buf, n);
+    const unsigned char* tail = output_tail_.data();
+    if (kept == cap) {
+        from_slave_.append(tail + output_tail_pos_, tail + cap);
+    }
+    from_slave_.append(tail, tail + output_tail_pos_);
+    output_dropped_ = output_err_dropped_ = 0;
+    broadcast_events();
+}
+
+void jailownerinfo::wait_background(pid_t child) {
+    // This process is the `init` (pid 1) of the new process namespace.
+    // On Linux, if it dies, everything in the jail dies too.
+
+    // go back to being the caller. With --perf-counters, keep root saved
+    // so `exec_done` can kill the jail's processes and count them.
+    if (setresuid(ROOT, ROOT, ROOT) != 0
+        || setresgid(caller_group, caller_group, caller_group) != 0
+        || setresuid(caller_owner, caller_owner,
+                     perfcountersfd >= 0 ? ROOT : caller_owner) != 0) {
+        perror("setresuid");
+        exec_done(child, 127);
+    }
+
+    fflush(stdout);
+
+    if (no_pty && from_slave_fd_ >= 0) {
+        make_nonblocking(from_slave_fd_);
+        if (to_slave_fd_ >= 0) {
+            make_nonblocking(to_slave_fd_);
+        } else {
+            to_slave_.rclosed_ = to_slave_.wclosed_ = true;
+        }
+        if (from_slave_err_fd_ >= 0) {
+            make_nonblocking(from_slave_err_fd_);
+        }
+#if __linux__
+        // splice() rejects O_APPEND files. Stdout's file description is
+        // shared with our caller, so rather than clear its O_APPEND, open
+        // our own description and append by hand; we are the only writer
+        // while the jail runs.
+        struct stat st;
+        int flags;
+        if (!inspect_output()
+            && fstat(STDOUT_FILENO, &st) == 0
+            && S_ISREG(st.st_mode)
+            && (flags = fcntl(STDOUT_FILENO, F_GETFL)) != -1) {
+            if (!(flags & O_APPEND)) {
+                splice_fd_ = STDOUT_FILENO;
+            } else {
+                splice_fd_ = open("/proc/self/fd/1", O_WRONLY | O_CLOEXEC);
+            }
+            splice_ok_ = splice_fd_ >= 0;
+        }
+#endif
+    } else if (from_slave_fd_ >= 0) {
+        // if input is a tty, put it in raw mode with short blocking
+        if (ttyfd_ >= 0) {
+            struct termios tty = ttyfd_termios_;
+            cfmakeraw(&tty);
+            tty.c_cc[VMIN] = 1;
+            tty.c_cc[VTIME] = 1;
+            (void) tcsetattr(ttyfd_, TCSANOW, &tty);
+        }
+
+        make_nonblocking(from_slave_fd_);
+        if (inputfd_ == 0 && !stdin_tty_) {
+            close(STDIN_FILENO);
+            to_slave_.rclosed_ = to_slave_.wclosed_ = true;
+        }
+        if (inputfd_ == 0 && !stdout_tty_ && !stderr_tty_ && !capture_output()) {
+            close(STDOUT_FILENO);
+            from_slave_.rclosed_ = from_slave_.wclosed_ = true;
+            from_slave_.rerrno_ = EIO; // don't misinterpret closed as error
+        }
+    } else {
+        from_slave_.rclosed_ = from_slave_.wclosed_ = true;
+        to_slave_.rclosed_ = to_slave_.wclosed_ = true;
+        from_slave_.rerrno_ = EIO;
+    }
+    if (from_slave_err_fd_ < 0) {
+        from_slave_err_.rclosed_ = from_slave_err_.wclosed_ = true;
+        from_slave_err_.rerrno_ = EIO;
+    }
+
+    // remember where output starts in a log file, and keep recent output,
+    // so event-source clients can resume
+    struct stat logst, errst;
+    if (!transcript_
+        && fstat(STDOUT_FILENO, &logst) == 0
+        && S_ISREG(logst.st_mode)
+        && ready_marker.empty()
+        && !(separate_stderr
+             && fstat(STDERR_FILENO, &errst) == 0
+             && errst.st_dev == logst.st_dev
+             && errst.st_ino == logst.st_ino)) {
+#if __linux__
+        output_log_fd_ = open("/proc/self/fd/1", O_RDONLY | O_CLOEXEC);
+#else
+        output_log_fd_ = open("/dev/fd/1", O_RDONLY | O_CLOEXEC);
+#endif
+        output_log_base_ = logst.st_size - from_slave_off_;
+    }
+    if (eventsourcefd >= 0) {
+        es_history_.resize(event_history_size);
+    }
+    if (eventsourcefd >= 0 && event_snapshot && !no_pty) {
+        screen_ = new vtscreen(tsize[0] > 0 ? tsize[0] : 80, tsize[1] > 0 ? tsize[1] : 24);
+        screen_off_ = from_slave_.bufpos_ + from_slave_.head_;
+    }
+
+    // set up output limits
+    if (max_output > 0) {
+        output_limit_off_ = from_slave_.bufpos_ + from_slave_.tail_ + max_output;
+        if (max_output_truncate) {
+            output_tail_.resize(max_output_tail);
+        }
+    }
+    gettimeofday(&rate_time_, nullptr);
+    rate_tokens_ = std::max(output_rate, 1.0);
+
+    if (output_buffer_size > 0
+        && !from_slave_.map_ring(output_buffer_size)
+        && verbose) {
+        fprintf(stderr, "cannot map output ring buffer, using ordinary buffer%s", no_onlcr ? "\n" : "\r\n");
+    }
+
+    // drain output in a separate thread, unless we need backpressure
+    // (--output-rate) or are splicing
+    if (reader_thread
+        && from_slave_fd_ >= 0
+        && !from_slave_.rclosed_
+        && !splice_ok_
+        && output_rate <= 0) {
+        reader_ = new spscring(262144);
+        reader_->start(from_slave_fd_);
+    }
+
+    // listen on unix socket
+    if (eventsourcefd > 0
+        && listen(eventsourcefd, 50) != 0) {
+        perror("listen");
+        exec_done(child, 127);
+    }
+
+    size_t profile_output_off = from_slave_.bufpos_ + from_slave_.tail_;
+    status_active_usec_ = unix_usec();
+    publish_status(ss_running, -1, profile_output_off, status_active_usec_);
+
+    while (true) {
+        // profile the command's startup, until its first output
+        if (profilefd >= 0
+            && profile_fork_ > 0
+            && from_slave_.bufpos_ + from_slave_.tail_ != profile_output_off) {
+            profile_event("X", "first_output", profile_fork_, monotonic_usec() - profile_fork_, std::string());
+            profile_fork_ = 0;
+        }
+
+        // check child and timeout
+        // (only wait for child if read done/failed)
+        int exit_status = check_child_timeout(child, from_slave_.done() && from_slave_err_.done());
+        if (exit_status != -1) {
+            exec_done(child, exit_status);
+        } else if (output_exceeded_) {
+            exec_done(child, 123);
+        } else if (stopped_on_ >= 0) {
+            exec_done(child, 122);
+        } else if (script_timed_out_) {
+            exec_done(child, 121);
+        }
+
+        // if child has not died, and read produced error, report it
+        if (from_slave_.rclosed_ && from_slave_.rerrno_ != 0 && from_slave_.rerrno_ != EIO) {
+            fprintf(stderr, "read: %s%s", strerror(from_slave_.rerrno_), no_onlcr ? "\n" : "\r\n");
+            exec_done(child, 125);
+        }
+
+        // wait for something to occur
+        run_input_script();
+        if (telemetry_interval > 0) {
+            sample_telemetry();
+        }
+        block();
+        bool any = false;
+
+        // transfer data to and from slave
+        if (to_slave_.read(inputfd_)) {
+            any = true;
+        }
+        for (auto& esf : esfds_) {
+            if (esf.ws_readable_) {
+                read_websocket(esf);
+                esf.ws_readable_ = false;
+                any = true;
+            }
+        }
+        if (!to_slave_.empty()
+            && memmem(&to_slave_.buf_[to_slave_.head_], to_slave_.tail_ - to_slave_.head_, "\x1b\x03", 2) != nullptr) {
+            exec_done(child, 128 + SIGTERM);
+        }
+        if (eventsourcefd >= 0 && input_time_ == 0 && !to_slave_.empty()) {
+            input_time_ = monotonic_usec();
+        }
+        if (to_slave_.write(to_slave_fd_, to_slave_off_)) {
+            to_slave_.consume_to(to_slave_off_);
+            any = true;
+        }
+        if (input_time_ != 0 && to_slave_.empty()) {
+            input_latency_.add(monotonic_usec() - input_time_);
+            input_time_ = 0;
+        }
+        if (read_from_slave()) {
+            any = true;
+        }
+        if (read_from_slave_err()) {
+            any = true;
+        }
+        if (has_blocked_ && timing_) {
+            write_timing();
+            has_blocked_ = false;
+        }
+        broadcast_events();
+        if (write_output()) {
+            from_slave_.consume_to(consumable_output());
+            any = true;
+        }
+        if (write_hub()) {
+            from_slave_.consume_to(consumable_output());
+            any = true;
+        }
+        if (from_slave_err_.write(STDERR_FILENO, from_slave_err_off_)) {
+            from_slave_err_.consume_to(from_slave_err_off_);
+            any = true;
+        }
+
+        // transfer events
+        for (auto it = esfds_.begin(); it != esfds_.end(); ) {
+            if (it->can_write()) {
+                queue_depths_.add(it->queued_);
+            }
+            it->write();
+            record_output_latency(*it);
+            if (it->wclosed_ || (it->ws_closing_ && !it->can_write())) {
+                it->close();
+                it = esfds_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        // forget read times once every client has recorded them
+        size_t metric_first = SIZE_MAX;
+        for (auto& esf : esfds_) {
+            metric_first = std::min(metric_first, esf.metric_off_);
+        }
+        while (!read_times_.empty() && read_times_.front().first <= metric_first) {
+            read_times_.pop_front();
+        }
+        for (auto it = esreplies_.begin(); it != esreplies_.end(); ) {
+            it->write();
+            if (!it->can_write()) {
+                it->close();
+                it = esreplies_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        from_slave_.consume_to(consumable_output());
+
+        // maybe reset idle timeout
+        if (any && idle_timeout_ > 0) {
+            gettimeofday(&active_time_, nullptr);
+            idle_expiry_ = timer_add_delay(active_time_, idle_timeout_);
+        }
+
+        // publish status; a second without input or output is waiting
+        if (status_slot) {
+            uint64_t now = unix_usec();
+            if (any) {
+                status_active_usec_ = now;
+            }
+            publish_status(now - status_active_usec_ >= 1000000 ? ss_waiting : ss_running,
+                           -1, from_slave_.bufpos_ + from_slave_.tail_, status_active_usec_);
+        }
+    }
+}
+
+void jailownerinfo::exec_done(pid_t child, int exit_status) {
+    // flush remaining output
+    if ((output_dropped_ > 0 || output_err_dropped_ > 0) && max_output_truncate) {
+        flush_truncated_output();
+    }
+    while (hubfd >= 0 && hub_off_ != from_slave_.bufpos_ + from_slave_.tail_) {
+        if (!write_hub() && hubfd >= 0) {
+            struct pollfd p = {hubfd, POLLOUT, 0};
+            if (poll(&p, 1, 5000) <= 0) {
+                break;
+            }
         }
-        tcsetattr(ptyslave, TCSANOW, &tty);
     }
-
-    if (inputfd_ > 0 || stdin_tty_) {
-        dup2(ptyslave, STDIN_FILENO);
+    if (hubfd >= 0) {
+        // the hub takes end of file as the end of the run
+        close(hubfd);
+        hubfd = -1;
     }
-    if (inputfd_ > 0 || stdout_tty_) {
-        dup2(ptyslave, STDOUT_FILENO);
+    broadcast_events();
+    from_slave_.consume_to(from_slave_off_);
+    while (from_slave_.can_write()) {
+        if (write_output()) {
+            from_slave_.consume_to(from_slave_off_);
+        } else if (!from_slave_.wclosed_) {
+            struct pollfd p = {STDOUT_FILENO, POLLOUT, 0};
+            if (poll(&p, 1, 5000) <= 0) {
+                break;
+            }
+        }
     }
-    if (inputfd_ > 0 || stderr_tty_) {
-        dup2(ptyslave, STDERR_FILENO);
+    if (timing_) {
+        write_timing();
+        timing_->finish();
     }
-    close(ptyslave);
-}
-
-extern "C" {
-#if !__linux__
-void sighandler(int signo) {
-    if (signo == SIGTERM) {
-        got_sigterm = 1;
+    if (transcript_) {
+        transcript_->finish();
     }
-    char c = (char) signo;
-    ssize_t w = write(sigpipe[1], &c, 1);
-    (void) w;
-}
-#endif
-}
-
-static void make_nonblocking(int fd) {
-    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
-}
-
-void jailownerinfo::start_sigpipe() {
-#if __linux__
-    sigset_t mask;
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGCHLD);
-    sigaddset(&mask, SIGTERM);
-    if (sigprocmask(SIG_BLOCK, &mask, nullptr) == -1) {
-        perror_die("sigprocmask");
+    if (line_index_) {
+        line_index_->flush();
     }
-    sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
-    if (sigfd == -1) {
-        perror_die("signalfd");
+    publish_status(ss_exited, exit_status, from_slave_.bufpos_ + from_slave_.tail_, unix_usec());
+    std::string xmsg;
+    if (exit_status == 124 && !quiet) {
+        xmsg = "...timed out";
+    } else if (output_exceeded_ && exit_status == 123 && !quiet) {
+        xmsg = "...output limit exceeded";
+    } else if (stopped_on_ >= 0 && exit_status == 122 && !quiet) {
+        xmsg = "...stopped on `" + stop_patterns[stopped_on_] + "`";
+    } else if (script_timed_out_ && exit_status == 121 && !quiet) {
+        xmsg = "...input script timed out waiting for `" + script_[script_step_].text + "`";
+    } else if (exit_status == 128 + SIGTERM && !quiet) {
+        xmsg = "...terminated";
+    } else if (verbose) {
+        xmsg = "...terminating with status " + std::to_string(exit_status);
+    }
+    if (!xmsg.empty()) {
+        const char* nl = no_onlcr ? "\n" : "\r\n";
+        fprintf(stderr, inputfd_ > 0 || stderr_tty_ ? "%s\x1b[3;7;31m%s\x1b[K\x1b[0m%s\x1b[K%s" : "%s%s%s%s", nl, xmsg.c_str(), nl, nl);
+    }
+#if __linux__
+    // an attached session isn't namespace init, so its processes
+    // don't die with us; kill its process group explicitly
+    if (attach_pid_ > 0) {
+        kill(-child, SIGKILL);
     }
 #else
-    int r = pipe(sigpipe);
-    if (r != 0) {
-        perror_die("pipe");
+    // kill a child we are giving up on
+    if (child_status_ < 0 || attach_pid_ > 0) {
+        kill(attach_pid_ > 0 ? -child : child, SIGKILL);
     }
-    make_nonblocking(sigpipe[0]);
-    make_nonblocking(sigpipe[1]);
-
-    struct sigaction sa;
-    sa.sa_handler = sighandler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0;
-    sigaction(SIGCHLD, &sa, nullptr);
-    sigaction(SIGTERM, &sa, nullptr);
 #endif
-
-    if (inputfd_ > 0 || stdin_tty_) {
-        make_nonblocking(inputfd_);
+    if (ttyfd_ >= 0) {
+        (void) tcsetattr(ttyfd_, TCSAFLUSH, &ttyfd_termios_);
     }
-    if (inputfd_ > 0 || stdout_tty_) {
-        make_nonblocking(STDOUT_FILENO);
+    fflush(stderr);
+    // send a final telemetry sample, then close event sources
+    if (telemetry_interval > 0) {
+        timerclear(&telemetry_next_);
+        sample_telemetry();
+    }
+#if __linux__
+    // end the jail's processes so their counts reach us; as namespace
+    // init, we inherit and reap orphans. They belong to the jail user, so
+    // this takes the saved root, which is dropped for good afterwards.
+    // Without root, count only what has already exited.
+    if (perfcountersfd >= 0) {
+        bool privileged = setresuid(-1, ROOT, -1) == 0;
+        if (privileged) {
+            kill(attach_pid_ > 0 ? -child : -1, SIGKILL);
+        }
+        while (x_waitpid(-1, privileged ? 0 : WNOHANG).first > 0) {
+        }
+        if (setresuid(caller_owner, caller_owner, caller_owner) != 0) {
+            perror_die("setresuid");
+        }
+        write_perf_counters();
+    }
+#endif
+    read_event_requests(true);
+    essegment done = make_essegment("data:{\"done\":true}\n\n", 20);
+    for (auto& esf : esfds_) {
+        if (esf.ws_) {
+            esf.push(make_ws_message('d', es_off_, esf.dropped_), es_off_, true);
+            esf.push(make_ws_control(8, "\x03\xE8", 2), es_off_, true);
+            esf.ws_closing_ = true;
+        } else if (esf.dropped_ == 0) {
+            esf.push(done, es_off_, true);
+        } else {
+            char buf[128];
+            int n = sprintf(buf, "data:{\"done\":true,\"dropped\":%llu}\n\n", esf.dropped_);
+            esf.push(make_essegment(buf, n), es_off_, true);
+        }
+        esf.zfinish_ = true;
+    }
+    esfds_.splice(esfds_.end(), esreplies_);
+    if (verbose && event_resyncs != 0) {
+        fprintf(stderr, "event sources: %llu bytes dropped in %llu resyncs%s",
+                event_dropped_bytes, event_resyncs, no_onlcr ? "\n" : "\r\n");
+    }
+    while (true) {
+        std::vector<pollfd> p;
+        for (auto it = esfds_.begin(); it != esfds_.end(); ) {
+            it->write();
+            if (!it->can_write()) {
+                it->close();
+                it = esfds_.erase(it);
+            } else {
+                p.push_back({it->fd_, POLLOUT, 0});
+                ++it;
+            }
+        }
+        if (p.empty()) {
+            break;
+        }
+        (void) poll(p.data(), p.size(), 5000);
     }
+    if (verbose && event_deflate_in != 0) {
+        fprintf(stderr, "event sources: compressed %llu bytes to %llu (%.1f%%)%s",
+                event_deflate_in, event_deflate_out,
+                100.0 * event_deflate_out / event_deflate_in,
+                no_onlcr ? "\n" : "\r\n");
+    }
+    exit(exit_status);
 }
 
 
-void jailownerinfo::block(int ptymaster) {
-    std::vector<pollfd> p;
+// event hub
+//
+// `pa-jail hub SOCK` serves event streams for many runs from one socket.
+// A run started with `--hub SOCK --hub-id ID` connects, sends
+// "PUBLISH ID\n", and then copies its output; closing the connection ends
+// the run. Viewers send HTTP requests on the same socket:
+//   GET /.../ID[?offset=N]   events for run ID, as from --event-source
+//   GET /?run=ID[:N]&...     events for several runs on one connection;
+//                            events name their "run" and have no id
+//   GET /stats               counters, as JSON
+// A multi-run connection that falls too far behind is closed; the viewer
+// reconnects with the offsets it has seen.
+
+static const int hub_linger = 60;   // seconds to keep a finished run
+
+static bool hub_valid_id(const std::string& id) {
+    return !id.empty()
+        && id.length() <= 128
+        && id.find_first_not_of("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789._-") == std::string::npos;
+}
 
-#if !__linux__
-    int sigfd = sigpipe[0];
-#endif
-    p.push_back({sigfd, POLLIN, 0});
+struct hubrun;
 
-    if (to_slave_.can_read()) {
-        p.push_back({inputfd_, POLLIN, 0});
-    }
+struct hubclient {
+    esfd es_;
+    std::vector<hubrun*> runs_;
+    bool tagged_ = false;       // events name their run
+    size_t ndone_ = 0;          // subscribed runs that have finished
 
-    short ptymaster_events = 0;
-    if (from_slave_.can_read()) {
-        ptymaster_events |= POLLIN;
-    }
-    if (to_slave_.can_write()) {
-        ptymaster_events |= POLLOUT;
-    }
-    if (ptymaster_events) {
-        p.push_back({ptymaster, ptymaster_events, 0});
+    hubclient(int fd)
+        : es_(fd) {
     }
+};
 
-    if (from_slave_.can_write()) {
-        p.push_back({STDOUT_FILENO, POLLOUT, 0});
+struct hubrun {
+    std::string id_;
+    int fd_ = -1;               // publisher connection
+    int pollidx_ = -1;
+    bool published_ = false;
+    bool done_ = false;
+    jbuffer buf_;               // recent output; `bufpos_` is an output offset
+    size_t es_off_ = 0;         // output offset sent to clients
+    std::vector<hubclient*> clients_;
+    struct timeval idle_since_;
+
+    hubrun(std::string id)
+        : id_(std::move(id)), buf_(65536) {
+        gettimeofday(&idle_since_, nullptr);
     }
+};
 
-    size_t eventsourceindex = 0;
-    if (eventsourcefd >= 0) {
-        p.push_back({eventsourcefd, POLLIN, 0});
-        eventsourceindex = p.size() - 1;
-    }
-    for (auto& esf : esfds_) {
-        if (esf.jbuf_.can_write()) {
-            p.push_back({esf.fd_, POLLOUT, 0});
-        }
+class eventhub {
+  public:
+    eventhub(int listenfd)
+        : listenfd_(listenfd) {
     }
+    [[noreturn]] void run();
 
-    int timeout_ms = 3600000;
-    if (esfds_.size()) {
-        timeout_ms = 30000;
+  private:
+    int listenfd_;
+    std::list<esfd> pending_;
+    std::list<hubclient> clients_;
+    std::unordered_map<std::string, std::unique_ptr<hubrun>> runs_;
+    unsigned long long connections_ = 0;
+    unsigned long long bytes_in_ = 0;
+
+    hubrun& find_run(const std::string& id);
+    void read_requests();
+    void start_publisher(std::list<esfd>::iterator it, size_t eol);
+    void start_client(std::list<esfd>::iterator it);
+    void subscribe(hubclient& c, hubrun& r, size_t off);
+    void read_publisher(hubrun& r);
+    void broadcast(hubrun& r);
+    void finish(hubrun& r);
+    void close_client(std::list<hubclient>::iterator it);
+    void expire_runs();
+    std::string stats() const;
+};
+
+hubrun& eventhub::find_run(const std::string& id) {
+    auto& r = runs_[id];
+    if (!r) {
+        r.reset(new hubrun(id));
     }
+    return *r;
+}
+
+void eventhub::read_requests() {
     struct timeval now;
-    if (timerisset(&expiry_) || idle_timeout_ > 0) {
-        gettimeofday(&now, nullptr);
+    gettimeofday(&now, nullptr);
+    for (auto it = pending_.begin(); it != pending_.end(); ) {
+        auto next = std::next(it);
+        char buf[2048];
+        ssize_t nr = 0;
+        while (it->request_.size() < 8192
+               && (nr = read(it->fd_, buf, sizeof(buf))) > 0) {
+            it->request_.append(buf, nr);
+        }
+        size_t eol = it->request_.find('\n');
+        if (it->request_.compare(0, 8, "PUBLISH ") == 0
+            && eol != std::string::npos) {
+            start_publisher(it, eol);
+        } else if (event_request_complete(it->request_)) {
+            start_client(it);
+        } else if (it->request_.size() >= 8192
+                   || nr == 0
+                   || (nr == -1 && errno != EAGAIN && errno != EINTR)
+                   || timercmp(&now, &it->request_expiry_, >)) {
+            close(it->fd_);
+            pending_.erase(it);
+        }
+        it = next;
     }
-    if (timerisset(&expiry_)) {
-        if (timercmp(&now, &expiry_, <)) {
-            timeout_ms = std::min(timeout_ms, timer_difference_ms(expiry_, now));
-        } else {
-            timeout_ms = 0;
-        }
+}
+
+void eventhub::start_publisher(std::list<esfd>::iterator it, size_t eol) {
+    std::string id = it->request_.substr(8, eol - 8);
+    if (!id.empty() && id.back() == '\r') {
+        id.pop_back();
     }
-    if (timerisset(&idle_expiry_)) {
-        if (timercmp(&now, &idle_expiry_, <)) {
-            timeout_ms = std::min(timeout_ms, timer_difference_ms(idle_expiry_, now));
-        } else {
-            timeout_ms = 0;
+    hubrun* r = hub_valid_id(id) ? &find_run(id) : nullptr;
+    if (!r || r->published_) {
+        if (verbose) {
+            fprintf(stderr, "hub: rejecting publisher for %s\n", id.c_str());
         }
+        close(it->fd_);
+        pending_.erase(it);
+        return;
     }
+    if (verbose) {
+        fprintf(stderr, "hub: %s: publishing\n", id.c_str());
+    }
+    r->fd_ = it->fd_;
+    r->published_ = true;
+    r->buf_.append(it->request_.data() + eol + 1, it->request_.size() - eol - 1);
+    bytes_in_ += it->request_.size() - eol - 1;
+    pending_.erase(it);
+    broadcast(*r);
+}
 
-    int pollr = poll(p.data(), p.size(), 0);
-    if (pollr == 0) {
-        has_blocked_ = true;
-        pollr = poll(p.data(), p.size(), timeout_ms);
+void eventhub::start_client(std::list<esfd>::iterator it) {
+    static const char message[] = "HTTP/1.1 200 OK\r\nCache-Control: no-store\r\nContent-Type: text/event-stream\r\nX-Accel-Buffering: no\r\n\r\n";
+    clients_.emplace_back(it->fd_);
+    hubclient& c = clients_.back();
+    c.es_.request_ = std::move(it->request_);
+    pending_.erase(it);
+    ++connections_;
+
+    // parse the request target
+    const std::string& req = c.es_.request_;
+    size_t tstart = req.find(' ');
+    size_t tend = tstart == std::string::npos ? tstart : req.find_first_of(" \r\n", tstart + 1);
+    std::string target, query;
+    if (tend != std::string::npos) {
+        target = req.substr(tstart + 1, tend - tstart - 1);
+    }
+    if (target.find('?') != std::string::npos) {
+        query = target.substr(target.find('?') + 1);
+        target.erase(target.find('?'));
+    }
+    std::vector<std::pair<std::string, size_t>> subs;
+    for (size_t pos = 0; pos < query.length(); ) {
+        size_t amp = query.find('&', pos);
+        std::string param = query.substr(pos, amp == std::string::npos ? amp : amp - pos);
+        if (param.compare(0, 4, "run=") == 0) {
+            size_t colon = param.find(':');
+            std::string id = param.substr(4, colon == std::string::npos ? colon : colon - 4);
+            size_t off = -1;
+            if (colon != std::string::npos) {
+                off = strtoull(param.c_str() + colon + 1, nullptr, 10);
+            }
+            subs.emplace_back(id, off);
+        }
+        pos = amp == std::string::npos ? query.length() : amp + 1;
+    }
+    c.tagged_ = !subs.empty();
+    c.es_.close_on_overflow_ = c.tagged_;
+    std::string accept;
+    std::string error;
+    if (target == "/stats" && subs.empty()) {
+        std::string body = stats();
+        std::string h = "HTTP/1.1 200 OK\r\nCache-Control: no-store\r\nContent-Type: application/json\r\nContent-Length: "
+            + std::to_string(body.length()) + "\r\n\r\n" + body;
+        c.es_.push(make_essegment(h.data(), h.size()), 0, true);
+        return;
+    } else if (event_request_websocket(req, accept)) {
+        // input can't reach a jail through the hub
+        error = "400 Bad Request";
+    } else if (subs.empty()) {
+        std::string id = target.substr(target.rfind('/') + 1);
+        size_t off = -1;
+        event_request_offset(req, off);
+        subs.emplace_back(id, off);
+    }
+    for (auto& sub : subs) {
+        if (!hub_valid_id(sub.first)) {
+            error = "404 Not Found";
+        }
+    }
+    if (!error.empty()) {
+        std::string h = "HTTP/1.1 " + error + "\r\nContent-Length: 0\r\n\r\n";
+        c.es_.push(make_essegment(h.data(), h.size()), 0, true);
+        c.runs_.clear();
+        return;
     }
-    assert(pollr >= 0);
 
-    // read from signal pipe
-    if (p[0].revents & POLLIN) {
-#if __linux__
-        struct signalfd_siginfo ssi;
-        ssize_t r;
-        while ((r = read(sigfd, &ssi, sizeof(ssi))) == sizeof(ssi)) {
-            if (ssi.ssi_signo == SIGTERM) {
-                got_sigterm = 1;
-            }
-        }
-        assert(r == 0 || (r == -1 && errno == EAGAIN));
-#else
-        char buf[128];
-        while (read(sigpipe[0], buf, sizeof(buf)) > 0) {
-            /* skip */
-        }
-#endif
+    int window_bits = event_request_encoding(req);
+    if (window_bits != 0 && c.es_.start_deflate(window_bits)) {
+        c.es_.zout_.assign(message, sizeof(message) - 3);
+        c.es_.zout_.append(window_bits > 15 ? "Content-Encoding: gzip\r\n\r\n" : "Content-Encoding: deflate\r\n\r\n");
+    } else {
+        c.es_.push(make_essegment(message, sizeof(message) - 1), 0, true);
+    }
+    for (auto& sub : subs) {
+        subscribe(c, find_run(sub.first), sub.second);
     }
+    c.es_.request_.clear();
+    c.es_.request_.shrink_to_fit();
+}
 
-    // accept new eventsource connections
-    if (eventsourcefd >= 0
-        && (p[eventsourceindex].revents & POLLIN)) {
-        int cfd = accept(eventsourcefd, nullptr, nullptr);
-        if (cfd >= 0) {
-            esfds_.emplace_back(cfd, from_slave_.bufpos_ + from_slave_.head_);
-            esfds_.back().write_header();
-            esfds_.back().write_event(from_slave_);
-        }
+// Send run `r`'s output from `off`, or from now if `off` is -1, to `c`.
+void eventhub::subscribe(hubclient& c, hubrun& r, size_t off) {
+    if (verbose) {
+        fprintf(stderr, "hub: %s: client %d\n", r.id_.c_str(), c.es_.fd_);
+    }
+    r.clients_.push_back(&c);
+    c.runs_.push_back(&r);
+    size_t first = r.buf_.bufpos_ + r.buf_.head_;
+    off = std::max(std::min(off, r.es_off_), first);
+    c.es_.written_off_ = off;
+    const char* tag = c.tagged_ ? r.id_.c_str() : nullptr;
+    while (off != r.es_off_) {
+        const unsigned char* p = r.buf_.buf_ + (off - r.buf_.bufpos_);
+        size_t n = std::min(r.es_off_ - off, size_t(65536));
+        essegment seg;
+        size_t stop = encode_event(off, p, p + n, seg, false, tag);
+        if (stop == off || (stop != off + n && off + n == r.es_off_)) {
+            // incomplete character that was flushed when the run ended
+            stop = encode_event(off, p, p + n, seg, true, tag);
+        }
+        c.es_.push(std::move(seg), c.tagged_ ? 0 : stop);
+        off = stop;
+    }
+    if (r.done_) {
+        finish(r);
     }
 }
 
-int jailownerinfo::check_child_timeout(pid_t child, bool waitpid) {
-    std::pair<pid_t, int> xr;
-    do {
-        xr = x_waitpid(-1, WNOHANG);
-        if (xr.first == child) {
-            child_status_ = xr.second;
+void eventhub::read_publisher(hubrun& r) {
+    size_t nread = 0;
+    while (nread < (1 << 20) && !r.buf_.rclosed_) {
+        if (r.buf_.space() < 16384) {
+            r.buf_.reserve(65536);
         }
-    } while (xr.first != -1);
-
-    if (errno != EAGAIN && errno != ECHILD) {
-        return 125;
-    } else if (child_status_ >= 0 && waitpid) {
-        return child_status_;
-    } else if (got_sigterm) {
-        return 128 + SIGTERM;
-    } else {
-        struct timeval now;
-        if (timerisset(&expiry_) || timerisset(&idle_expiry_)) {
-            gettimeofday(&now, nullptr);
-            if ((timerisset(&expiry_) && timercmp(&now, &expiry_, >))
-                || (timerisset(&idle_expiry_) && timercmp(&now, &idle_expiry_, >))) {
-                return 124;
-            }
+        size_t old_tail = r.buf_.tail_;
+        if (!r.buf_.read(r.fd_)) {
+            break;
         }
-        errno = EAGAIN;
-        return -1;
+        nread += r.buf_.tail_ - old_tail;
     }
-}
-
-void jailownerinfo::write_timing() {
-    struct timeval now, delta;
-    gettimeofday(&now, nullptr);
-    timersub(&now, &this->start_time_, &delta);
-    unsigned long long deltamsecs = (delta.tv_sec * 1'000'000 + delta.tv_usec) / 1000;
-    char timingstr[256];
-    ssize_t len;
-    if (this->timing_count_ % 128 == 0) {
-        len = snprintf(timingstr, sizeof(timingstr), "%llu,%llu\n", deltamsecs, (unsigned long long) from_slave_off_);
-    } else {
-        len = snprintf(timingstr, sizeof(timingstr), "+%llu,+%llu\n", deltamsecs - this->timing_msec_, (unsigned long long) from_slave_off_ - this->timing_offset_);
+    bytes_in_ += nread;
+    broadcast(r);
+    if (r.buf_.rclosed_) {
+        finish(r);
     }
-    assert(len < 256);
-    ssize_t written = 0;
-    while (written < len) {
-        ssize_t nw = write(timingfd, timingstr, len);
-        if (nw < 0) {
-            perror_die("Timing file");
-        }
-        written += nw;
+    // keep at most `event_history_size` bytes of output
+    size_t first = r.buf_.bufpos_ + r.buf_.head_;
+    size_t last = r.buf_.bufpos_ + r.buf_.tail_;
+    if (last - first > event_history_size) {
+        r.buf_.consume_to(std::min(r.es_off_, last - event_history_size));
     }
-    this->timing_msec_ = deltamsecs;
-    this->timing_offset_ = from_slave_off_;
-    ++this->timing_count_;
 }
 
-void jailownerinfo::wait_background(pid_t child, int ptymaster) {
-    // This process is the `init` (pid 1) of the new process namespace.
-    // On Linux, if it dies, everything in the jail dies too.
-
-    // go back to being the caller
-    if (setresuid(ROOT, ROOT, ROOT) != 0
-        || setresgid(caller_group, caller_group, caller_group) != 0
-        || setresuid(caller_owner, caller_owner, caller_owner) != 0) {
-        perror("setresuid");
-        exec_done(child, 127);
+void eventhub::broadcast(hubrun& r) {
+    const unsigned char* first = r.buf_.buf_ + (r.es_off_ - r.buf_.bufpos_);
+    const unsigned char* last = r.buf_.buf_ + r.buf_.tail_;
+    if (first == last) {
+        return;
     }
-
-    fflush(stdout);
-
-    if (ptymaster >= 0) {
-        // if input is a tty, put it in raw mode with short blocking
-        if (ttyfd_ >= 0) {
-            struct termios tty = ttyfd_termios_;
-            cfmakeraw(&tty);
-            tty.c_cc[VMIN] = 1;
-            tty.c_cc[VTIME] = 1;
-            (void) tcsetattr(ttyfd_, TCSANOW, &tty);
-        }
-
-        make_nonblocking(ptymaster);
-        if (inputfd_ == 0 && !stdin_tty_) {
-            close(STDIN_FILENO);
-            to_slave_.rclosed_ = to_slave_.wclosed_ = true;
-        }
-        if (inputfd_ == 0 && !stdout_tty_ && !stderr_tty_) {
-            close(STDOUT_FILENO);
-            from_slave_.rclosed_ = from_slave_.wclosed_ = true;
-            from_slave_.rerrno_ = EIO; // don't misinterpret closed as error
-        }
-    } else {
-        from_slave_.rclosed_ = from_slave_.wclosed_ = true;
-        to_slave_.rclosed_ = to_slave_.wclosed_ = true;
-        from_slave_.rerrno_ = EIO;
+    bool any_plain = false, any_tagged = false;
+    for (auto c : r.clients_) {
+        (c->tagged_ ? any_tagged : any_plain) = true;
+    }
+    bool flush = r.buf_.rclosed_;
+    essegment plain, tagged;
+    size_t newoff = r.es_off_ + ((flush ? last : utf8_complete_end(first, last)) - first);
+    if (any_plain) {
+        newoff = encode_event(r.es_off_, first, last, plain, flush);
+    }
+    if (any_tagged) {
+        newoff = encode_event(r.es_off_, first, last, tagged, flush, r.id_.c_str());
+    }
+    if (newoff == r.es_off_) {
+        return;
+    }
+    r.es_off_ = newoff;
+    for (auto c : r.clients_) {
+        c->es_.push(c->tagged_ ? tagged : plain, c->tagged_ ? 0 : newoff);
     }
+}
 
-    // listen on unix socket
-    if (eventsourcefd > 0
-        && listen(eventsourcefd, 50) != 0) {
-        perror("listen");
-        exec_done(child, 127);
+// Mark run `r` done and tell clients that haven't been told.
+void eventhub::finish(hubrun& r) {
+    if (r.fd_ >= 0) {
+        if (verbose) {
+            fprintf(stderr, "hub: %s: done at %zu\n", r.id_.c_str(), r.es_off_);
+        }
+        close(r.fd_);
+        r.fd_ = -1;
+        r.done_ = true;
+        gettimeofday(&r.idle_since_, nullptr);
     }
+    for (auto c : r.clients_) {
+        size_t nknown = std::find(c->runs_.begin(), c->runs_.end(), &r) - c->runs_.begin();
+        if (nknown < c->ndone_) {
+            continue;
+        }
+        // keep finished runs at the front of `runs_`
+        std::swap(c->runs_[nknown], c->runs_[c->ndone_]);
+        ++c->ndone_;
+        if (c->tagged_) {
+            std::string m = "data:{\"run\":\"" + r.id_ + "\",\"done\":true}\n\n";
+            c->es_.push(make_essegment(m.data(), m.size()), 0, true);
+        } else if (c->es_.dropped_ == 0) {
+            c->es_.push(make_essegment("data:{\"done\":true}\n\n", 20), r.es_off_, true);
+        } else {
+            char buf[128];
+            int n = sprintf(buf, "data:{\"done\":true,\"dropped\":%llu}\n\n", c->es_.dropped_);
+            c->es_.push(make_essegment(buf, n), r.es_off_, true);
+        }
+        if (c->ndone_ == c->runs_.size()) {
+            c->es_.zfinish_ = true;
+        }
+    }
+}
 
-    while (true) {
-        // check child and timeout
-        // (only wait for child if read done/failed)
-        int exit_status = check_child_timeout(child, from_slave_.done());
-        if (exit_status != -1) {
-            exec_done(child, exit_status);
+void eventhub::close_client(std::list<hubclient>::iterator it) {
+    for (auto r : it->runs_) {
+        r->clients_.erase(std::find(r->clients_.begin(), r->clients_.end(), &*it));
+        if (r->clients_.empty()) {
+            gettimeofday(&r->idle_since_, nullptr);
         }
+    }
+    it->es_.close();
+    clients_.erase(it);
+}
 
-        // if child has not died, and read produced error, report it
-        if (from_slave_.rclosed_ && from_slave_.rerrno_ != EIO) {
-            fprintf(stderr, "read: %s%s", strerror(from_slave_.rerrno_), no_onlcr ? "\n" : "\r\n");
-            exec_done(child, 125);
+// Forget runs that nobody is watching and that have finished, or were
+// never published.
+void eventhub::expire_runs() {
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+    for (auto it = runs_.begin(); it != runs_.end(); ) {
+        hubrun& r = *it->second;
+        if (r.clients_.empty()
+            && r.fd_ < 0
+            && now.tv_sec - r.idle_since_.tv_sec > hub_linger) {
+            it = runs_.erase(it);
+        } else {
+            ++it;
         }
+    }
+}
 
-        // wait for something to occur
-        block(ptymaster);
-        bool any = false;
+std::string eventhub::stats() const {
+    size_t npublishing = 0;
+    for (auto& it : runs_) {
+        npublishing += it.second->fd_ >= 0;
+    }
+    char buf[512];
+    sprintf(buf, "{\"runs\":%zu,\"publishing\":%zu,\"clients\":%zu,\"connections\":%llu,\"bytes_in\":%llu,\"bytes_out\":%llu,\"dropped\":%llu,\"resyncs\":%llu,\"deflate_in\":%llu,\"deflate_out\":%llu}\n",
+            runs_.size(), npublishing, clients_.size(), connections_,
+            bytes_in_, event_bytes_written, event_dropped_bytes,
+            event_resyncs, event_deflate_in, event_deflate_out);
+    return buf;
+}
 
-        // transfer data to and from slave
-        if (to_slave_.read(inputfd_)) {
-            any = true;
-        }
-        if (!to_slave_.empty()
-            && memmem(&to_slave_.buf_[to_slave_.head_], to_slave_.tail_ - to_slave_.head_, "\x1b\x03", 2) != nullptr) {
-            exec_done(child, 128 + SIGTERM);
+void eventhub::run() {
+    signal(SIGPIPE, SIG_IGN);
+    if (listen(listenfd_, 128) != 0) {
+        perror_die("listen");
+    }
+    while (true) {
+        std::vector<pollfd> p;
+        p.push_back({listenfd_, POLLIN, 0});
+        for (auto& it : runs_) {
+            hubrun& r = *it.second;
+            r.pollidx_ = r.fd_ >= 0 ? int(p.size()) : -1;
+            if (r.fd_ >= 0) {
+                p.push_back({r.fd_, POLLIN, 0});
+            }
         }
-        if (to_slave_.write(ptymaster, to_slave_off_)) {
-            to_slave_.consume_to(to_slave_off_);
-            any = true;
+        for (auto& esf : pending_) {
+            p.push_back({esf.fd_, POLLIN, 0});
         }
-        if (from_slave_.read(ptymaster)) {
-            any = true;
+        for (auto& c : clients_) {
+            c.es_.pollidx_ = p.size();
+            p.push_back({c.es_.fd_, short(c.es_.can_write() ? POLLOUT : 0), 0});
         }
-        if (has_blocked_ && timingfd != -1) {
-            write_timing();
-            has_blocked_ = false;
+        int timeout_ms = pending_.empty() && runs_.size() == 0 ? -1 : 1000;
+        if (poll(p.data(), p.size(), timeout_ms) < 0 && errno != EINTR) {
+            perror_die("poll");
         }
-        if (!from_slave_.empty()) {
-            size_t last_off = from_slave_.bufpos_ + from_slave_.tail_;
-            for (auto& esf : esfds_) {
-                if (esf.output_off_ < last_off) {
-                    esf.write_event(from_slave_);
-                }
+
+        // accept connections
+        if (p[0].revents & POLLIN) {
+            int cfd;
+            while ((cfd = accept(listenfd_, nullptr, nullptr)) >= 0) {
+                make_nonblocking(cfd);
+                fcntl(cfd, F_SETFD, FD_CLOEXEC);
+                pending_.emplace_back(cfd);
+                gettimeofday(&pending_.back().request_expiry_, nullptr);
+                pending_.back().request_expiry_ =
+                    timer_add_delay(pending_.back().request_expiry_, 5);
             }
         }
-        if (from_slave_.write(STDOUT_FILENO, from_slave_off_)) {
-            from_slave_.consume_to(from_slave_off_);
-            any = true;
+
+        // read output from runs
+        for (auto& it : runs_) {
+            hubrun& r = *it.second;
+            if (r.pollidx_ >= 0 && p[r.pollidx_].revents != 0) {
+                read_publisher(r);
+            }
         }
 
-        // transfer events
-        for (auto it = esfds_.begin(); it != esfds_.end(); ) {
-            if (it->jbuf_.write(it->fd_, it->off_)) {
-                it->jbuf_.consume_to(it->off_);
+        // write to clients; `p` doesn't cover clients added since poll
+        for (auto it = clients_.begin(); it != clients_.end(); ) {
+            auto next = std::next(it);
+            int idx = it->es_.pollidx_;
+            if (idx >= 0 && idx < int(p.size()) && p[idx].fd == it->es_.fd_
+                && (p[idx].revents & (POLLHUP | POLLERR))) {
+                it->es_.wclosed_ = true;
             }
-            if (it->jbuf_.wclosed_) {
-                close(it->fd_);
-                it = esfds_.erase(it);
-            } else {
-                ++it;
+            it->es_.write();
+            if (it->es_.wclosed_
+                || (it->ndone_ == it->runs_.size() && !it->es_.can_write())) {
+                close_client(it);
             }
+            it = next;
         }
 
-        // maybe reset idle timeout
-        if (any && idle_timeout_ > 0) {
-            gettimeofday(&active_time_, nullptr);
-            idle_expiry_ = timer_add_delay(active_time_, idle_timeout_);
+        if (!pending_.empty()) {
+            read_requests();
         }
+        expire_runs();
     }
 }
 
-void jailownerinfo::exec_done(pid_t child, int exit_status) {
-    if (timingfd != -1) {
-        write_timing();
-    }
-    std::string xmsg;
-    if (exit_status == 124 && !quiet) {
-        xmsg = "...timed out";
-    } else if (exit_status == 128 + SIGTERM && !quiet) {
-        xmsg = "...terminated";
-    } else if (verbose) {
-        xmsg = "...terminating with status " + std::to_string(exit_status);
-    }
-    if (!xmsg.empty()) {
-        const char* nl = no_onlcr ? "\n" : "\r\n";
-        fprintf(stderr, inputfd_ > 0 || stderr_tty_ ? "%s\x1b[3;7;31m%s\x1b[K\x1b[0m%s\x1b[K%s" : "%s%s%s%s", nl, xmsg.c_str(), nl, nl);
-    }
-#if __linux__
-    (void) child;
-#else
-    if (exit_status >= 124) {
-        kill(child, SIGKILL);
-    }
-#endif
-    if (ttyfd_ >= 0) {
-        (void) tcsetattr(ttyfd_, TCSAFLUSH, &ttyfd_termios_);
-    }
-    fflush(stderr);
-    // close event sources
-    for (auto& esf : esfds_) {
-        esf.jbuf_.append("data:{\"done\":true}\n\n", 20);
-    }
-    while (true) {
-        std::vector<pollfd> p;
-        for (auto it = esfds_.begin(); it != esfds_.end(); ) {
-            if (it->jbuf_.write(it->fd_, it->off_)) {
-                it->jbuf_.consume_to(it->off_);
-            }
-            if (it->jbuf_.wclosed_ || !it->jbuf_.can_write()) {
-                close(it->fd_);
-                it = esfds_.erase(it);
-            } else {
-                p.push_back({it->fd_, POLLOUT, 0});
-                ++it;
-            }
-        }
-        if (p.empty()) {
-            break;
-        }
-        (void) poll(p.data(), p.size(), 5000);
-    }
-    exit(exit_status);
+[[noreturn]] static void run_hub(int listenfd) {
+    eventhub hub(listenfd);
+    hub.run();
 }
 
 
@@ -3070,14 +8675,56 @@ static void close_unwanted_fds() {
        pa-jail run [--fg] [-nqhL] [-T TIMEOUT] [-I TIMEOUT] [-p PIDFILE] \\\n\
                    [-i INPUT] [-f FILE | -F DATA] [-S SKELETON] \\\n\
                    JAILDIR USER COMMAND\n\
+       pa-jail attach [--fg] [-T TIMEOUT] [-i INPUT] -p PIDFILE \\\n\
+                   JAILDIR USER [COMMAND]\n\
        pa-jail mv SOURCE DEST\n\
-       pa-jail rm [-nf] [--bg] JAILDIR\n");
+       pa-jail rm [-nf] [--bg] JAILDIR\n\
+       pa-jail hub [OPTIONS...] SOCK\n\
+       pa-jail timing [--at MS] INFILE [OUTFILE]\n\
+       pa-jail transcript [--offset N] [--length N] FILE\n\
+       pa-jail lines [--from X] [--to Y | --tail N] INDEX LOG\n\
+       pa-jail ps STATUSTABLE\n");
     } else if (action == do_mv) {
         fprintf(stderr, "Usage: pa-jail mv [-n] SOURCE DEST\n\
 Safely move a jail from SOURCE to DEST. SOURCE and DEST must be allowed\n\
 by /etc/pa-jail.conf.\n\
 \n\
   -n, --dry-run     Print actions that would be taken, don't run them\n");
+    } else if (action == do_hub) {
+        fprintf(stderr, "Usage: pa-jail hub [OPTIONS...] SOCK\n\
+Listen on UNIX SOCK for runs started with `--hub SOCK` and serve their\n\
+output as event streams.\n\
+\n\
+      --event-history BYTES  Keep BYTES of output per run [1M]\n\
+      --event-client-buffer BYTES  Skip ahead when an event client falls\n\
+                            BYTES behind [4M]\n\
+      --event-compression LEVEL  Compress event streams at zlib LEVEL when\n\
+                            clients accept it; 0 disables [1]\n\
+  -V, --verbose             Print actions\n");
+    } else if (action == do_timing) {
+        fprintf(stderr, "Usage: pa-jail timing [--at MS] INFILE [OUTFILE]\n\
+Convert the text or binary timing file INFILE to the other format.\n\
+\n\
+      --at MS               Print the last record at or before MS\n\
+                            milliseconds instead\n");
+    } else if (action == do_transcript) {
+        fprintf(stderr, "Usage: pa-jail transcript [--offset N] [--length N] FILE\n\
+Print output from the transcript FILE written by `pa-jail run --transcript`.\n\
+Uses FILE.idx, if present, to find the output offset quickly.\n\
+\n\
+      --offset N            Start at output offset N [0]\n\
+      --length N            Print at most N bytes\n");
+    } else if (action == do_lines) {
+        fprintf(stderr, "Usage: pa-jail lines [--from X] [--to Y | --tail N] INDEX LOG\n\
+Print lines from the stdout log LOG using INDEX, written by\n\
+`pa-jail run --line-index`. Lines count from 1.\n\
+\n\
+      --from X              Start at line X [1]\n\
+      --to Y                End at line Y\n\
+      --tail N              Print the last N lines\n");
+    } else if (action == do_ps) {
+        fprintf(stderr, "Usage: pa-jail ps STATUSTABLE\n\
+Print the runs recorded in STATUSTABLE by `pa-jail run --status-table`.\n");
     } else if (action == do_rm) {
         fprintf(stderr, "Usage: pa-jail rm [-nf] [--bg] JAILDIR\n\
 Unmount and remove a jail. Like `rm -r[f] --one-file-system JAILDIR`.\n\
@@ -3086,27 +8733,84 @@ JAILDIR must be allowed by /etc/pa-jail.conf.\n\
   -f, --force       Do not complain if JAILDIR doesn't exist\n\
   -n, --dry-run     Print actions that would be taken, don't run them\n\
   -V, --verbose     Print actions as well as running them\n\
-      --bg          Run in the background\n");
+      --bg          Run in the background\n\
+      --profile FILE  Write a trace of setup phases to FILE\n");
     } else {
         if (action == do_add) {
             fprintf(stderr, "Usage: pa-jail add [OPTIONS...] JAILDIR [USER]\n\
 Create or augment a jail. JAILDIR must be allowed by /etc/pa-jail.conf.\n\n");
+        } else if (action == do_attach) {
+            fprintf(stderr, "Usage: pa-jail attach [OPTIONS...] -p PIDFILE JAILDIR USER [COMMAND...]\n\
+Run COMMAND, or a login shell, as USER inside the jail that `pa-jail run\n\
+-p PIDFILE` is running in JAILDIR, on its own terminal.\n\n");
         } else {
             fprintf(stderr, "Usage: pa-jail run [OPTIONS...] JAILDIR USER [NAME=VALUE...] COMMAND...\n\
 Run COMMAND as USER in the JAILDIR jail. JAILDIR must be allowed by\n\
 /etc/pa-jail.conf.\n\n");
         }
-        fprintf(stderr, "  -f, --manifest-file FILE  Populate jail with manifest from FILE\n");
-        fprintf(stderr, "  -F, --manifest MANIFEST   Populate jail with MANIFEST\n");
-        fprintf(stderr, "  -h, --chown-home          Change ownership of USER homedir\n");
-        fprintf(stderr, "  -S, --skeleton SKELDIR    Populate jail from SKELDIR\n");
-        if (action == do_run) {
+        if (action != do_attach) {
+            fprintf(stderr, "  -f, --manifest-file FILE  Populate jail with manifest from FILE\n");
+            fprintf(stderr, "  -F, --manifest MANIFEST   Populate jail with MANIFEST\n");
+            fprintf(stderr, "  -h, --chown-home          Change ownership of USER homedir\n");
+            fprintf(stderr, "  -S, --skeleton SKELDIR    Populate jail from SKELDIR\n");
+        }
+        fprintf(stderr, "      --profile FILE        Write a Chrome trace of setup phases, with\n\
+                            operation counts, to FILE\n");
+        if (action == do_attach) {
+            fprintf(stderr, "  -p, --pid-file PIDFILE    Attach to the run that locked PIDFILE\n");
+        } else if (action == do_run) {
             fprintf(stderr, "  -p, --pid-file PIDFILE    Write jail process PID to PIDFILE\n\
-  -P, --pid-contents STR    Write STR to PIDFILE\n\
-  -i, --input INPUTSOCKET   Use TTY, read input from INPUTSOCKET\n\
-      --event-source SOCK   Listen on UNIX SOCK for event source connections\n\
+  -P, --pid-contents STR    Write STR to PIDFILE\n");
+        }
+        if (action == do_run || action == do_attach) {
+            fprintf(stderr, "  -i, --input INPUTSOCKET   Use TTY, read input from INPUTSOCKET\n\
+      --event-source SOCK   Listen on UNIX SOCK for event source and\n\
+                            WebSocket connections; `GET /metrics` there\n\
+                            reports loop counters and latencies\n\
+      --event-history BYTES  Keep BYTES of output for resuming events [1M]\n\
+      --event-client-buffer BYTES  Skip ahead when an event client falls\n\
+                            BYTES behind [4M]\n\
+      --event-compression LEVEL  Compress event streams at zlib LEVEL when\n\
+                            clients accept it; 0 disables [1]\n\
+      --event-input         Let WebSocket clients send input and resize\n\
+                            the terminal\n\
+      --event-snapshot      Track the terminal screen so clients can\n\
+                            start from a snapshot (`?snapshot=1`)\n\
+      --hub SOCK            Publish output to the `pa-jail hub` at SOCK\n\
+      --hub-id ID           Publish output as run ID\n\
       --ready[=STR]         Write STR to stdout when ready\n\
+  -t, --timing-file FILE    Write output timing to FILE\n\
+      --timing-format text|binary  Write FILE as text lines or as compact\n\
+                            binary records with a seek index [text]\n\
+      --transcript FILE     Write output to FILE, not stdout, as seekable\n\
+                            gzip frames, indexed in FILE.idx\n\
+      --line-index FILE     Write an index of output lines to FILE\n\
+      --extract PREFIX:FILE  Append output lines starting with PREFIX to\n\
+                            FILE as JSON, and send them as `extract`\n\
+                            events\n\
+      --stop-on PATTERN     Stop with status 122 when output contains\n\
+                            PATTERN\n\
+      --input-script FILE   Send input as scripted in FILE, waiting for\n\
+                            output as needed\n\
+      --telemetry SECONDS   Report the jail's processes, memory, and CPU\n\
+                            time every SECONDS as `telemetry` events, and\n\
+                            with -t, in FILE.telemetry\n\
+      --status-table FILE   Keep this run's state in a slot of the shared\n\
+                            status table FILE (see `pa-jail ps`)\n\
+      --perf-counters LIST  Count the perf events in LIST (e.g.\n\
+                            instructions,cycles,page-faults,\n\
+                            context-switches)\n\
+      --counters-file FILE  Write the --perf-counters totals to FILE\n\
       --no-onlcr            Don't translate \\n -> \\r\\n in output\n\
+      --no-pty              Connect output to pipes, not a TTY\n\
+      --separate-stderr     With --no-pty, send stderr to stderr\n\
+      --max-output BYTES    Limit output to BYTES\n\
+      --max-output-policy kill|truncate  Kill the jail at the output limit,\n\
+                            or keep only the head and tail of output [kill]\n\
+      --max-output-tail BYTES  Keep BYTES of tail when truncating [64k]\n\
+      --output-rate BYTES   Limit output to BYTES per second\n\
+      --no-reader-thread    Read output in the main loop\n\
+      --output-buffer BYTES  Use a fixed BYTES-sized ring for output\n\
   -T, --timeout TIMEOUT     Kill the jail after TIMEOUT seconds\n\
   -I, --idle-timeout TIMEOUT  Kill the jail after TIMEOUT idle seconds\n\
       --size WxH            Set terminal size [80x25]\n\
@@ -3131,6 +8835,38 @@ static struct option longoptions_before[] = {
 #define ARG_EVENT_SOURCE 1003
 #define ARG_BG           1004
 #define ARG_READY        1005
+#define ARG_NO_PTY       1006
+#define ARG_SEPARATE_STDERR 1007
+#define ARG_MAX_OUTPUT   1008
+#define ARG_MAX_OUTPUT_POLICY 1009
+#define ARG_MAX_OUTPUT_TAIL 1010
+#define ARG_OUTPUT_RATE  1011
+#define ARG_NO_READER_THREAD 1012
+#define ARG_OUTPUT_BUFFER 1013
+#define ARG_EVENT_HISTORY 1014
+#define ARG_EVENT_CLIENT_BUFFER 1015
+#define ARG_EVENT_COMPRESSION 1016
+#define ARG_HUB          1017
+#define ARG_HUB_ID       1018
+#define ARG_TIMING_FORMAT 1019
+#define ARG_AT           1020
+#define ARG_TRANSCRIPT   1021
+#define ARG_OFFSET       1022
+#define ARG_LENGTH       1023
+#define ARG_LINE_INDEX   1024
+#define ARG_FROM         1025
+#define ARG_TO           1026
+#define ARG_TAIL         1027
+#define ARG_EXTRACT      1028
+#define ARG_STOP_ON      1029
+#define ARG_INPUT_SCRIPT 1030
+#define ARG_TELEMETRY    1031
+#define ARG_PROFILE      1032
+#define ARG_STATUS_TABLE 1033
+#define ARG_PERF_COUNTERS 1034
+#define ARG_EVENT_INPUT  1035
+#define ARG_EVENT_SNAPSHOT 1036
+#define ARG_COUNTERS_FILE 1037
 
 static struct option longoptions_run[] = {
     { "verbose", no_argument, nullptr, 'V' },
@@ -3155,6 +8891,67 @@ static struct option longoptions_run[] = {
     { "size", required_argument, nullptr, ARG_SIZE },
     { "event-source", required_argument, nullptr, ARG_EVENT_SOURCE },
     { "ready", optional_argument, nullptr, ARG_READY },
+    { "no-pty", no_argument, nullptr, ARG_NO_PTY },
+    { "separate-stderr", no_argument, nullptr, ARG_SEPARATE_STDERR },
+    { "max-output", required_argument, nullptr, ARG_MAX_OUTPUT },
+    { "max-output-policy", required_argument, nullptr, ARG_MAX_OUTPUT_POLICY },
+    { "max-output-tail", required_argument, nullptr, ARG_MAX_OUTPUT_TAIL },
+    { "output-rate", required_argument, nullptr, ARG_OUTPUT_RATE },
+    { "no-reader-thread", no_argument, nullptr, ARG_NO_READER_THREAD },
+    { "output-buffer", required_argument, nullptr, ARG_OUTPUT_BUFFER },
+    { "event-history", required_argument, nullptr, ARG_EVENT_HISTORY },
+    { "event-client-buffer", required_argument, nullptr, ARG_EVENT_CLIENT_BUFFER },
+    { "event-compression", required_argument, nullptr, ARG_EVENT_COMPRESSION },
+    { "event-input", no_argument, nullptr, ARG_EVENT_INPUT },
+    { "event-snapshot", no_argument, nullptr, ARG_EVENT_SNAPSHOT },
+    { "hub", required_argument, nullptr, ARG_HUB },
+    { "hub-id", required_argument, nullptr, ARG_HUB_ID },
+    { "timing-format", required_argument, nullptr, ARG_TIMING_FORMAT },
+    { "transcript", required_argument, nullptr, ARG_TRANSCRIPT },
+    { "line-index", required_argument, nullptr, ARG_LINE_INDEX },
+    { "extract", required_argument, nullptr, ARG_EXTRACT },
+    { "stop-on", required_argument, nullptr, ARG_STOP_ON },
+    { "input-script", required_argument, nullptr, ARG_INPUT_SCRIPT },
+    { "telemetry", required_argument, nullptr, ARG_TELEMETRY },
+    { "profile", required_argument, nullptr, ARG_PROFILE },
+    { "status-table", required_argument, nullptr, ARG_STATUS_TABLE },
+    { "perf-counters", required_argument, nullptr, ARG_PERF_COUNTERS },
+    { "counters-file", required_argument, nullptr, ARG_COUNTERS_FILE },
+    { nullptr, 0, nullptr, 0 }
+};
+
+static struct option longoptions_hub[] = {
+    { "verbose", no_argument, nullptr, 'V' },
+    { "help", no_argument, nullptr, 'H' },
+    { "event-history", required_argument, nullptr, ARG_EVENT_HISTORY },
+    { "event-client-buffer", required_argument, nullptr, ARG_EVENT_CLIENT_BUFFER },
+    { "event-compression", required_argument, nullptr, ARG_EVENT_COMPRESSION },
+    { nullptr, 0, nullptr, 0 }
+};
+
+static struct option longoptions_timing[] = {
+    { "help", no_argument, nullptr, 'H' },
+    { "at", required_argument, nullptr, ARG_AT },
+    { nullptr, 0, nullptr, 0 }
+};
+
+static struct option longoptions_transcript[] = {
+    { "help", no_argument, nullptr, 'H' },
+    { "offset", required_argument, nullptr, ARG_OFFSET },
+    { "length", required_argument, nullptr, ARG_LENGTH },
+    { nullptr, 0, nullptr, 0 }
+};
+
+static struct option longoptions_lines[] = {
+    { "help", no_argument, nullptr, 'H' },
+    { "from", required_argument, nullptr, ARG_FROM },
+    { "to", required_argument, nullptr, ARG_TO },
+    { "tail", required_argument, nullptr, ARG_TAIL },
+    { nullptr, 0, nullptr, 0 }
+};
+
+static struct option longoptions_ps[] = {
+    { "help", no_argument, nullptr, 'H' },
     { nullptr, 0, nullptr, 0 }
 };
 
@@ -3164,15 +8961,18 @@ static struct option longoptions_rm[] = {
     { "bg", no_argument, nullptr, ARG_BG },
     { "help", no_argument, nullptr, 'H' },
     { "force", no_argument, nullptr, 'f' },
+    { "profile", required_argument, nullptr, ARG_PROFILE },
     { nullptr, 0, nullptr, 0 }
 };
 
 static struct option* longoptions_action[] = {
     longoptions_before, longoptions_run, longoptions_run, longoptions_rm,
-    longoptions_before
+    longoptions_before, longoptions_hub, longoptions_timing,
+    longoptions_transcript, longoptions_lines, longoptions_run, longoptions_ps
 };
 static const char* shortoptions_action[] = {
-    "+Vn", "VnS:f:F:p:P:T:I:qi:hu:t:", "VnS:f:F:p:P:T:I:qi:hu:t:", "Vnf", "Vn"
+    "+Vn", "VnS:f:F:p:P:T:I:qi:hu:t:", "VnS:f:F:p:P:T:I:qi:hu:t:", "Vnf", "Vn", "V", "", "", "",
+    "Vnp:T:I:qi:t:", ""
 };
 
 static bool opt_strtod(double& v) {
@@ -3181,6 +8981,23 @@ static bool opt_strtod(double& v) {
     return end != optarg && *end == '\0';
 }
 
+// parse a byte count with an optional k, M, or G suffix
+static bool opt_strtosize(size_t& v) {
+    char* end;
+    double d = strtod(optarg, &end);
+    if (end == optarg || d < 0) {
+        return false;
+    } else if (*end == 'k' || *end == 'K') {
+        d *= 1 << 10, ++end;
+    } else if (*end == 'm' || *end == 'M') {
+        d *= 1 << 20, ++end;
+    } else if (*end == 'g' || *end == 'G') {
+        d *= 1 << 30, ++end;
+    }
+    v = (size_t) d;
+    return *end == '\0';
+}
+
 static bool range_strtol(long& v, const char* a, const char* b) {
     bool negative = false;
     if (a != b && (*a == '-' || *a == '+')) {
@@ -3204,6 +9021,9 @@ int main(int argc, char** argv) {
     jailaction action = do_start;
     bool chown_home = false, foreground = false;
     double timeout = -1, idle_timeout = -1;
+    long at_msec = -1;
+    size_t transcript_offset = 0, transcript_length = SIZE_MAX;
+    size_t lines_from = 1, lines_to = SIZE_MAX, lines_tail = SIZE_MAX;
     std::string inputarg, linkarg, manifest;
     std::vector<std::string> chown_user_args;
     pidcontents = "$$";
@@ -3230,7 +9050,7 @@ int main(int argc, char** argv) {
                 if (!manifest.empty() && manifest.back() != '\n') {
                     manifest.push_back('\n');
                 }
-            } else if (ch == 'p' && action == do_run) {
+            } else if (ch == 'p' && (action == do_run || action == do_attach)) {
                 pidfilename = optarg;
             } else if (ch == 'P' && action == do_run) {
                 pidcontents = optarg;
@@ -3242,6 +9062,128 @@ int main(int argc, char** argv) {
                 no_onlcr = false;
             } else if (ch == ARG_NO_ONLCR) {
                 no_onlcr = true;
+            } else if (ch == ARG_NO_PTY) {
+                no_pty = no_onlcr = true;
+            } else if (ch == ARG_SEPARATE_STDERR) {
+                no_pty = no_onlcr = separate_stderr = true;
+            } else if (ch == ARG_MAX_OUTPUT) {
+                if (!opt_strtosize(max_output)) {
+                    usage();
+                }
+            } else if (ch == ARG_MAX_OUTPUT_POLICY) {
+                if (strcmp(optarg, "kill") == 0) {
+                    max_output_truncate = false;
+                } else if (strcmp(optarg, "truncate") == 0) {
+                    max_output_truncate = true;
+                } else {
+                    usage();
+                }
+            } else if (ch == ARG_MAX_OUTPUT_TAIL) {
+                if (!opt_strtosize(max_output_tail)) {
+                    usage();
+                }
+            } else if (ch == ARG_OUTPUT_RATE) {
+                size_t rate;
+                if (!opt_strtosize(rate)) {
+                    usage();
+                }
+                output_rate = rate;
+            } else if (ch == ARG_NO_READER_THREAD) {
+                reader_thread = false;
+            } else if (ch == ARG_OUTPUT_BUFFER) {
+                if (!opt_strtosize(output_buffer_size)) {
+                    usage();
+                }
+            } else if (ch == ARG_EVENT_HISTORY) {
+                if (!opt_strtosize(event_history_size)) {
+                    usage();
+                }
+            } else if (ch == ARG_EVENT_CLIENT_BUFFER) {
+                if (!opt_strtosize(event_client_buffer)) {
+                    usage();
+                }
+            } else if (ch == ARG_EVENT_COMPRESSION) {
+                long level;
+                if (!range_strtol(level, optarg, optarg + strlen(optarg))
+                    || level < 0 || level > 9) {
+                    usage();
+                }
+                event_compression = level;
+            } else if (ch == ARG_EVENT_INPUT) {
+                event_input = true;
+            } else if (ch == ARG_EVENT_SNAPSHOT) {
+                event_snapshot = true;
+            } else if (ch == ARG_HUB) {
+                hubfilename = optarg;
+            } else if (ch == ARG_HUB_ID) {
+                hubrunid = optarg;
+            } else if (ch == ARG_TIMING_FORMAT) {
+                if (strcmp(optarg, "text") == 0) {
+                    timing_binary = false;
+                } else if (strcmp(optarg, "binary") == 0) {
+                    timing_binary = true;
+                } else {
+                    usage();
+                }
+            } else if (ch == ARG_AT) {
+                if (!range_strtol(at_msec, optarg, optarg + strlen(optarg))
+                    || at_msec < 0) {
+                    usage();
+                }
+            } else if (ch == ARG_TRANSCRIPT) {
+                transcriptfilename = optarg;
+            } else if (ch == ARG_OFFSET) {
+                if (!opt_strtosize(transcript_offset)) {
+                    usage();
+                }
+            } else if (ch == ARG_LENGTH) {
+                if (!opt_strtosize(transcript_length)) {
+                    usage();
+                }
+            } else if (ch == ARG_LINE_INDEX) {
+                lineindexfilename = optarg;
+            } else if (ch == ARG_EXTRACT) {
+                const char* colon = strrchr(optarg, ':');
+                if (!colon || colon == optarg || !colon[1]) {
+                    usage();
+                }
+                extractspec x;
+                x.prefix = std::string(optarg, colon - optarg);
+                x.filename = colon + 1;
+                extracts.push_back(std::move(x));
+            } else if (ch == ARG_STOP_ON) {
+                if (!optarg[0]) {
+                    usage();
+                }
+                stop_patterns.push_back(optarg);
+            } else if (ch == ARG_INPUT_SCRIPT) {
+                inputscriptfilename = optarg;
+            } else if (ch == ARG_TELEMETRY) {
+                if (!opt_strtod(telemetry_interval) || telemetry_interval <= 0) {
+                    usage();
+                }
+            } else if (ch == ARG_PROFILE) {
+                profilefilename = optarg;
+            } else if (ch == ARG_STATUS_TABLE) {
+                statustablefilename = optarg;
+            } else if (ch == ARG_PERF_COUNTERS) {
+                if (!parse_perf_counters(optarg)) {
+                    usage();
+                }
+            } else if (ch == ARG_COUNTERS_FILE) {
+                countersfilename = optarg;
+            } else if (ch == ARG_FROM) {
+                if (!opt_strtosize(lines_from)) {
+                    usage();
+                }
+            } else if (ch == ARG_TO) {
+                if (!opt_strtosize(lines_to)) {
+                    usage();
+                }
+            } else if (ch == ARG_TAIL) {
+                if (!opt_strtosize(lines_tail)) {
+                    usage();
+                }
             } else if (ch == ARG_SIZE) {
                 const char* ex;
                 if (strcmp(optarg, "none") == 0) {
@@ -3250,7 +9192,9 @@ int main(int argc, char** argv) {
                            && range_strtol(tsize[0], optarg, ex)
                            && range_strtol(tsize[1], ex + 1, optarg + strlen(optarg))
                            && tsize[0] > 0
-                           && tsize[1] > 0) {
+                           && tsize[1] > 0
+                           && tsize[0] <= max_tsize[0]
+                           && tsize[1] <= max_tsize[1]) {
                     /* ok */
                 } else {
                     usage();
@@ -3277,7 +9221,7 @@ int main(int argc, char** argv) {
                 if (end == optarg || *end != 0) {
                     usage();
                 }
-            } else if (ch == 't' && action == do_run) {
+            } else if (ch == 't' && (action == do_run || action == do_attach)) {
                 timingfilename = optarg;
             } else { /* if (ch == 'H') */
                 usage(action);
@@ -3298,6 +9242,18 @@ int main(int argc, char** argv) {
             action = do_add;
         } else if (strcmp(argv[optind], "run") == 0) {
             action = do_run;
+        } else if (strcmp(argv[optind], "hub") == 0) {
+            action = do_hub;
+        } else if (strcmp(argv[optind], "timing") == 0) {
+            action = do_timing;
+        } else if (strcmp(argv[optind], "transcript") == 0) {
+            action = do_transcript;
+        } else if (strcmp(argv[optind], "lines") == 0) {
+            action = do_lines;
+        } else if (strcmp(argv[optind], "attach") == 0) {
+            action = do_attach;
+        } else if (strcmp(argv[optind], "ps") == 0) {
+            action = do_ps;
         } else {
             usage();
         }
@@ -3310,12 +9266,23 @@ int main(int argc, char** argv) {
     if (action == do_run && optind + 2 >= argc) {
         action = do_add;
     }
-    bool has_runarg = !linkarg.empty() || !manifest.empty() || !inputarg.empty() || !eventsourcefilename.empty();
+    bool has_runarg = !linkarg.empty() || !manifest.empty() || !inputarg.empty() || !eventsourcefilename.empty() || !hubfilename.empty() || !transcriptfilename.empty() || !lineindexfilename.empty() || !extracts.empty() || !stop_patterns.empty() || !inputscriptfilename.empty();
     if ((action == do_rm && optind + 1 != argc)
         || (action == do_mv && optind + 2 != argc)
         || (action == do_add && optind != argc - 1 && optind + 2 != argc)
         || (action == do_run && optind + 3 > argc)
-        || (action == do_run && foreground && (!inputarg.empty() || !eventsourcefilename.empty()))
+        || (action == do_run && foreground && (!inputarg.empty() || !eventsourcefilename.empty() || !hubfilename.empty() || !transcriptfilename.empty() || !lineindexfilename.empty() || !extracts.empty()))
+        || (action == do_run && hubfilename.empty() != hubrunid.empty())
+        || (!hubrunid.empty() && !hub_valid_id(hubrunid))
+        || (action == do_hub && optind + 1 != argc)
+        || (action == do_timing && optind + 1 != argc && optind + 2 != argc)
+        || (action == do_transcript && optind + 1 != argc)
+        || (action == do_lines && optind + 2 != argc)
+        || (action == do_ps && optind + 1 != argc)
+        || (perf_counters.empty() != countersfilename.empty())
+        || (action == do_attach && (optind + 2 > argc || pidfilename.empty()))
+        || (action == do_attach && (!linkarg.empty() || !manifest.empty() || chown_home || !chown_user_args.empty()))
+        || (action == do_attach && foreground && (!inputarg.empty() || !eventsourcefilename.empty() || !hubfilename.empty() || !transcriptfilename.empty() || !lineindexfilename.empty() || !extracts.empty()))
         || (action == do_rm && has_runarg)
         || (action == do_mv && has_runarg)
         || !argv[optind][0]
@@ -3325,10 +9292,14 @@ int main(int argc, char** argv) {
     if (verbose && !dryrun) {
         verbosefile = stderr;
     }
+    if (action == do_hub) {
+        eventsourcefilename = argv[optind];
+    }
 
     // parse user
     jailownerinfo jailuser;
-    if ((action == do_add || action == do_run) && optind + 1 < argc) {
+    if ((action == do_add || action == do_run || action == do_attach)
+        && optind + 1 < argc) {
         jailuser.init(argv[optind + 1]);
     }
 
@@ -3344,16 +9315,46 @@ int main(int argc, char** argv) {
         }
     }
 
+    // read timing files, transcripts, line indexes, and status tables as the
+    // calling user
+    if (action == do_timing || action == do_transcript || action == do_lines
+        || action == do_ps) {
+        if (setresgid(caller_group, caller_group, caller_group) < 0) {
+            perror_die("setresgid");
+        }
+        if (setresuid(caller_owner, caller_owner, caller_owner) < 0) {
+            perror_die("setresuid");
+        }
+        if (action == do_transcript) {
+            run_transcript(argv[optind], transcript_offset, transcript_length);
+        } else if (action == do_lines) {
+            run_lines(argv[optind], argv[optind + 1], lines_from, lines_to, lines_tail);
+        } else if (action == do_ps) {
+            run_ps(argv[optind]);
+        }
+        run_timing(argv[optind], optind + 1 < argc ? argv[optind + 1] : nullptr, at_msec);
+    }
+
     // close extra file descriptors
-    if (action == do_run) {
+    if (action == do_run || action == do_attach) {
         close_unwanted_fds();
     }
 
+    // find the running jail as current user
+    pid_t attach_pid = -1;
+    int attach_pidfd = -1;
+    if (action == do_attach) {
+        attach_pid = running_jail_pid(pidfilename, attach_pidfd);
+        if (verbose) {
+            fprintf(verbosefile, "attach %d\n", attach_pid);
+        }
+    }
+
     // open pidfile as current user
-    if (!pidfilename.empty() && verbose) {
+    if (!pidfilename.empty() && action == do_run && verbose) {
         fprintf(verbosefile, "touch %s\nflock %s\n", pidfilename.c_str(), pidfilename.c_str());
     }
-    if (!pidfilename.empty() && !dryrun) {
+    if (!pidfilename.empty() && action == do_run && !dryrun) {
         pidfd = open(pidfilename.c_str(), O_WRONLY | O_CLOEXEC | O_CREAT, 0666);
         if (pidfd == -1) {
             perror_die(pidfilename);
@@ -3385,6 +9386,18 @@ int main(int argc, char** argv) {
         }
     }
 
+    // read input script as current user; it needs an input channel even
+    // without `-i`
+    if (!inputscriptfilename.empty()) {
+        jailuser.set_input_script(read_input_script(inputscriptfilename.c_str()));
+        if (inputarg.empty() && !dryrun) {
+            inputfd = open("/dev/null", O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+            if (inputfd == -1) {
+                perror_die("/dev/null");
+            }
+        }
+    }
+
     // create event source socket as current user
     if (!eventsourcefilename.empty() && !dryrun) {
         if (verbose) {
@@ -3419,6 +9432,71 @@ int main(int argc, char** argv) {
         fprintf(verbosefile, "socket %s\n", eventsourcefilename.c_str());
     }
 
+    // serve the event hub as the calling user
+    if (action == do_hub) {
+        if (setresgid(caller_group, caller_group, caller_group) < 0) {
+            perror_die("setresgid");
+        }
+        if (setresuid(caller_owner, caller_owner, caller_owner) < 0) {
+            perror_die("setresuid");
+        }
+        run_hub(eventsourcefd);
+    }
+
+    // connect to event hub as current user
+    if (!hubfilename.empty() && verbose) {
+        fprintf(verbosefile, "connect %s\n", hubfilename.c_str());
+    }
+    if (!hubfilename.empty() && !dryrun) {
+        hubfd = socket(AF_LOCAL, SOCK_STREAM, 0);
+        if (hubfd == -1) {
+            perror_die("socket");
+        }
+        sockaddr_un hub_addr;
+        hub_addr.sun_family = AF_LOCAL;
+        if (hubfilename.length() + 1 > sizeof(hub_addr.sun_path)) {
+            fprintf(stderr, "%s: socket name too long\n", hubfilename.c_str());
+            exit(1);
+        }
+        strcpy(hub_addr.sun_path, hubfilename.c_str());
+        if (connect(hubfd, (sockaddr*) &hub_addr, sizeof(hub_addr)) != 0) {
+            perror_die("connect " + hubfilename);
+        }
+        std::string publish = "PUBLISH " + hubrunid + "\n";
+        if (write(hubfd, publish.data(), publish.size()) != ssize_t(publish.size())) {
+            perror_die(hubfilename);
+        }
+
+        int flags;
+        if (fcntl(hubfd, F_SETFD, FD_CLOEXEC) == -1
+            || (flags = fcntl(hubfd, F_GETFL)) == -1
+            || fcntl(hubfd, F_SETFL, flags | O_NONBLOCK) == -1) {
+            perror_die("fcntl");
+        }
+    }
+
+    // map status table as current user
+    if (!statustablefilename.empty() && (action == do_run || action == do_attach)) {
+        if (verbose) {
+            fprintf(verbosefile, "touch %s\n", statustablefilename.c_str());
+        }
+        if (!dryrun) {
+            map_status_table(statustablefilename, true);
+        }
+    }
+
+    // create setup profile as current user
+    if (!profilefilename.empty() && verbose) {
+        fprintf(verbosefile, "touch %s\n", profilefilename.c_str());
+    }
+    if (!profilefilename.empty() && !dryrun) {
+        int fd = open(profilefilename.c_str(), O_WRONLY | O_CLOEXEC | O_CREAT | O_TRUNC | O_APPEND, 0666);
+        if (fd == -1) {
+            perror_die(profilefilename);
+        }
+        profile_open(fd);
+    }
+
     // create timing file as current user
     if (!timingfilename.empty() && verbose) {
         fprintf(verbosefile, "touch %s\n", timingfilename.c_str());
@@ -3429,6 +9507,72 @@ int main(int argc, char** argv) {
             perror_die(timingfilename);
         }
     }
+    std::string telemetryfilename = timingfilename + ".telemetry";
+    if (!timingfilename.empty() && telemetry_interval > 0 && verbose) {
+        fprintf(verbosefile, "touch %s\n", telemetryfilename.c_str());
+    }
+    if (!timingfilename.empty() && telemetry_interval > 0 && !dryrun) {
+        telemetryfd = open(telemetryfilename.c_str(), O_WRONLY | O_CLOEXEC | O_CREAT | O_TRUNC, 0666);
+        if (telemetryfd == -1) {
+            perror_die(telemetryfilename);
+        }
+    }
+    if (!countersfilename.empty() && verbose) {
+        fprintf(verbosefile, "touch %s\n", countersfilename.c_str());
+    }
+    if (!countersfilename.empty() && !dryrun) {
+        perfcountersfd = open(countersfilename.c_str(), O_WRONLY | O_CLOEXEC | O_CREAT | O_TRUNC, 0666);
+        if (perfcountersfd == -1) {
+            perror_die(countersfilename);
+        }
+    }
+
+    // create transcript and its index as current user
+    if (!transcriptfilename.empty() && verbose) {
+        fprintf(verbosefile, "touch %s %s.idx\n", transcriptfilename.c_str(), transcriptfilename.c_str());
+    }
+    if (!transcriptfilename.empty() && !dryrun) {
+        transcriptfd = open(transcriptfilename.c_str(), O_RDWR | O_CLOEXEC | O_CREAT | O_TRUNC, 0666);
+        if (transcriptfd == -1) {
+            perror_die(transcriptfilename);
+        }
+        std::string indexname = transcriptfilename + ".idx";
+        transcriptindexfd = open(indexname.c_str(), O_RDWR | O_CLOEXEC | O_CREAT | O_TRUNC, 0666);
+        if (transcriptindexfd == -1) {
+            perror_die(indexname);
+        }
+    }
+
+    // create line index as current user
+    if (!lineindexfilename.empty() && verbose) {
+        fprintf(verbosefile, "touch %s\n", lineindexfilename.c_str());
+    }
+    if (!lineindexfilename.empty() && !dryrun) {
+        lineindexfd = open(lineindexfilename.c_str(), O_WRONLY | O_CLOEXEC | O_CREAT | O_TRUNC, 0666);
+        if (lineindexfd == -1) {
+            perror_die(lineindexfilename);
+        }
+    }
+
+    // create extract files as current user
+    for (auto it = extracts.begin(); it != extracts.end(); ++it) {
+        auto prev = std::find_if(extracts.begin(), it, [&] (const extractspec& x) {
+            return x.filename == it->filename;
+        });
+        if (prev != it) {
+            it->fd = prev->fd;
+            continue;
+        }
+        if (verbose) {
+            fprintf(verbosefile, "touch %s\n", it->filename.c_str());
+        }
+        if (!dryrun) {
+            it->fd = open(it->filename.c_str(), O_WRONLY | O_CLOEXEC | O_CREAT | O_TRUNC, 0666);
+            if (it->fd == -1) {
+                perror_die(it->filename);
+            }
+        }
+    }
 
     // escalate so that the real (not just effective) UID/GID is root. this is
     // so that the system processes will execute as root
@@ -3450,8 +9594,13 @@ int main(int argc, char** argv) {
     // - stuff below the allowed jail directory dynamically created as
     //   necessary
     // - try to eliminate TOCTTOU
+    profilephase check_phase("check_jaildir");
     pajailconf jailconf;
     jaildirinfo jaildir(argv[optind], linkarg, action, jailconf);
+    check_phase.end();
+    if (status_slots && (action == do_run || action == do_attach)) {
+        claim_status_slot(pidfilename.empty() ? jaildir.dir : pidfilename);
+    }
 
     // move the sandbox if asked
     if (action == do_mv) {
@@ -3494,6 +9643,7 @@ int main(int argc, char** argv) {
         }
         // unmount EVERYTHING mounted in the jail!
         // INCLUDING MY HOME DIRECTORY
+        profilephase umount_phase("umount");
         populate_mount_table();
         for (auto it = mount_table.begin(); it != mount_table.end(); ++it) {
             if (it->first.length() >= jaildir.dir.length()
@@ -3501,12 +9651,27 @@ int main(int argc, char** argv) {
                           jaildir.dir.length()) == 0)
                 handle_umount(it);
         }
+        umount_phase.end();
         // remove the jail
+        profilephase remove_phase("remove");
         jaildir.remove();
+        remove_phase.end();
         exit(0);
     }
 
+    // attach to the running jail if asked
+    if (action == do_attach) {
+        close(jaildir.parentfd);
+        jaildir.parentfd = -1;
+        jailuser.set_attach(attach_pid, attach_pidfd);
+        jailuser.set_inputfd(inputfd);
+        jailuser.set_timeout(timeout, idle_timeout);
+        jailuser.set_foreground(foreground);
+        jailuser.exec(argc - (optind + 2), argv + optind + 2, jaildir);
+    }
+
     // check skeleton directory
+    profilephase home_phase("home");
     if (!jaildir.skeletondir.empty()) {
         if (v_ensuredir(jaildir.skeletondir, 0755, true) < 0) {
             perror_die(jaildir.skeletondir);
@@ -3538,8 +9703,11 @@ int main(int argc, char** argv) {
         }
     }
 
+    home_phase.end();
+
     // set ownership
     if (chown_home) {
+        profilephase phase("chown_home");
         jaildir.chown_home();
     }
     for (const auto& f : chown_user_args) {
@@ -3547,6 +9715,7 @@ int main(int argc, char** argv) {
             die("%s: --chown-user directory disabled by /etc/pa-jail.conf\n%s",
                 f.c_str(), jailconf.disable_message().c_str());
         }
+        profilephase phase("chown_recursive", f);
         jaildir.chown_recursive(f, jailuser.owner_, jailuser.group_);
     }
 
@@ -3555,6 +9724,7 @@ int main(int argc, char** argv) {
     dstroot = path_noendslash(jaildir.dir);
     assert(dstroot != "/");
     if (!manifest.empty()) {
+        profilephase phase("construct_jail");
         mode_t old_umask = umask(0);
         if (construct_jail(jaildir.dev, manifest, false) != 0) {
             exit(1);
@@ -3578,6 +9748,13 @@ int main(int argc, char** argv) {
     if (timingfd != -1) {
         close(timingfd);
     }
+    if (transcriptfd != -1) {
+        close(transcriptfd);
+        close(transcriptindexfd);
+    }
+    if (lineindexfd != -1) {
+        close(lineindexfd);
+    }
 
     exit(0);
 }